@@ -0,0 +1,486 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//
+// Compares two fat32_bench JSON results (--benchmark_out_format=json, best
+// with --benchmark_repetitions >= 5) benchmark by benchmark. A benchmark
+// regressed when Welch's t-test says the means differ (p < alpha) and the
+// contender is slower than the baseline by more than the threshold.
+//
+//   bench_compare [--threshold=0.05] [--alpha=0.05] [--metric=real_time|cpu_time]
+//                 [--filter=regex] baseline.json contender.json
+//
+// Exit code 0: no regression, 1: regression, 2: bad input, or a benchmark
+// with fewer than 2 repetitions on a side, which the test can not judge.
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// just enough JSON for benchmark output
+//
+////////////////////////////////////////////////////////////////////////////////
+
+struct Json
+{
+  enum Type { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT } type = NUL;
+  double number = 0;
+  string str;
+  vector<Json> items;
+  vector<pair<string, Json>> members;
+
+  Json const* get(string const& key) const
+  {
+    for (auto& [k, v] : members) {
+      if (k == key)
+        return &v;
+    }
+    return nullptr;
+  }
+};
+
+class JsonParser
+{
+  public:
+    JsonParser(string const& text) : text(text) {}
+
+    Json parse()
+    {
+      Json value = parse_value();
+      skip_space();
+      if (pos != text.size())
+        fail("trailing characters");
+      return value;
+    }
+
+  private:
+    void fail(string const& what)
+    {
+      throw runtime_error("json: " + what + " at offset " + to_string(pos));
+    }
+
+    void skip_space()
+    {
+      while (pos < text.size() && isspace((unsigned char)text[pos]))
+        pos++;
+    }
+
+    void expect(char c)
+    {
+      skip_space();
+      if (pos >= text.size() || text[pos] != c)
+        fail(string("expected '") + c + "'");
+      pos++;
+    }
+
+    string parse_string()
+    {
+      expect('"');
+      string res;
+
+      while (pos < text.size() && text[pos] != '"') {
+        char c = text[pos++];
+        if (c != '\\') {
+          res += c;
+          continue;
+        }
+
+        if (pos >= text.size())
+          fail("bad escape");
+
+        c = text[pos++];
+        switch (c) {
+          case 'n': res += '\n'; break;
+          case 't': res += '\t'; break;
+          case 'r': res += '\r'; break;
+          case 'b': res += '\b'; break;
+          case 'f': res += '\f'; break;
+          case 'u':
+            // names are ASCII, keep anything else as '?'
+            if (pos + 4 > text.size())
+              fail("bad escape");
+            res += '?';
+            pos += 4;
+            break;
+          default: res += c; break;
+        }
+      }
+
+      expect('"');
+      return res;
+    }
+
+    Json parse_value()
+    {
+      skip_space();
+      if (pos >= text.size())
+        fail("unexpected end");
+
+      Json value;
+      char c = text[pos];
+
+      if (c == '{') {
+        value.type = Json::OBJECT;
+        pos++;
+        skip_space();
+        if (pos < text.size() && text[pos] == '}') {
+          pos++;
+          return value;
+        }
+        while (true) {
+          string key = parse_string();
+          expect(':');
+          value.members.emplace_back(key, parse_value());
+          skip_space();
+          if (pos < text.size() && text[pos] == ',') {
+            pos++;
+            continue;
+          }
+          expect('}');
+          return value;
+        }
+      }
+
+      if (c == '[') {
+        value.type = Json::ARRAY;
+        pos++;
+        skip_space();
+        if (pos < text.size() && text[pos] == ']') {
+          pos++;
+          return value;
+        }
+        while (true) {
+          value.items.push_back(parse_value());
+          skip_space();
+          if (pos < text.size() && text[pos] == ',') {
+            pos++;
+            continue;
+          }
+          expect(']');
+          return value;
+        }
+      }
+
+      if (c == '"') {
+        value.type = Json::STRING;
+        value.str = parse_string();
+        return value;
+      }
+
+      for (auto word : { "true", "false", "null" }) {
+        if (text.compare(pos, strlen(word), word) == 0) {
+          pos += strlen(word);
+          value.type = word[0] == 'n' ? Json::NUL : Json::BOOL;
+          value.number = word[0] == 't';
+          return value;
+        }
+      }
+
+      char *end = nullptr;
+      value.type = Json::NUMBER;
+      value.number = strtod(text.c_str() + pos, &end);
+      if (end == text.c_str() + pos)
+        fail("unexpected character");
+      pos = end - text.c_str();
+
+      return value;
+    }
+
+  private:
+    string const& text;
+    size_t pos = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// statistics
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// continued fraction of the regularized incomplete beta function
+static double beta_cf(double a, double b, double x)
+{
+  double c = 1, d = 1 - (a + b) * x / (a + 1);
+  d = 1 / (fabs(d) < 1e-300 ? 1e-300 : d);
+  double h = d;
+
+  for (int m = 1; m <= 300; m++) {
+    for (int odd = 0; odd < 2; odd++) {
+      double num = odd == 0
+          ? m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m))
+          : -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+      d = 1 + num * d;
+      d = 1 / (fabs(d) < 1e-300 ? 1e-300 : d);
+      c = 1 + num / c;
+      if (fabs(c) < 1e-300)
+        c = 1e-300;
+      h *= d * c;
+      if (odd == 1 && fabs(d * c - 1) < 1e-12)
+        return h;
+    }
+  }
+
+  return h;
+}
+
+static double incomplete_beta(double a, double b, double x)
+{
+  if (x <= 0) return 0;
+  if (x >= 1) return 1;
+
+  double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1 - x));
+
+  return x < (a + 1) / (a + b + 2)
+      ? front * beta_cf(a, b, x) / a
+      : 1 - front * beta_cf(b, a, 1 - x) / b;
+}
+
+// P(|T| > t) for Student's t with df degrees of freedom
+static double two_sided_p(double t, double df)
+{
+  return incomplete_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+// t with P(|T| > t) = p
+static double t_quantile(double p, double df)
+{
+  double lo = 0, hi = 1000;
+
+  for (int i = 0; i < 200; i++) {
+    double mid = (lo + hi) / 2;
+    (two_sided_p(mid, df) > p ? lo : hi) = mid;
+  }
+
+  return (lo + hi) / 2;
+}
+
+struct Sample
+{
+  vector<double> values;
+
+  double mean() const
+  {
+    double sum = 0;
+    for (double v : values)
+      sum += v;
+    return sum / values.size();
+  }
+
+  double variance() const
+  {
+    double m = mean(), sum = 0;
+    for (double v : values)
+      sum += (v - m) * (v - m);
+    return values.size() > 1 ? sum / (values.size() - 1) : 0;
+  }
+};
+
+struct Comparison
+{
+  double base_mean, new_mean;
+  double change;              // relative change of the mean
+  double ci_lo, ci_hi;        // confidence interval of change
+  double p;                   // -1: not enough samples
+};
+
+static Comparison compare(Sample const& a, Sample const& b, double alpha)
+{
+  Comparison res;
+  res.base_mean = a.mean();
+  res.new_mean = b.mean();
+  res.change = res.new_mean / res.base_mean - 1;
+  res.ci_lo = res.ci_hi = res.change;
+  res.p = -1;
+
+  size_t na = a.values.size(), nb = b.values.size();
+  if (na < 2 || nb < 2)
+    return res;
+
+  double va = a.variance() / na, vb = b.variance() / nb;
+  double se = sqrt(va + vb);
+  double diff = res.new_mean - res.base_mean;
+
+  if (se == 0) {
+    res.p = diff == 0 ? 1 : 0;
+    return res;
+  }
+
+  // Welch-Satterthwaite degrees of freedom
+  double df = (va + vb) * (va + vb) / (va * va / (na - 1) + vb * vb / (nb - 1));
+  double t = diff / se;
+  double margin = t_quantile(alpha, df) * se;
+
+  res.p = two_sided_p(fabs(t), df);
+  res.ci_lo = (diff - margin) / res.base_mean;
+  res.ci_hi = (diff + margin) / res.base_mean;
+
+  return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// main
+//
+////////////////////////////////////////////////////////////////////////////////
+
+static double to_ns(double value, string const& unit)
+{
+  if (unit == "us") return value * 1e3;
+  if (unit == "ms") return value * 1e6;
+  if (unit == "s")  return value * 1e9;
+  return value;
+}
+
+// run name -> per repetition times in ns, in file order
+static vector<pair<string, Sample>> load(string const& path, string const& metric)
+{
+  ifstream ifs(path);
+  if (!ifs.good())
+    throw runtime_error("cannot open " + path);
+
+  stringstream ss;
+  ss << ifs.rdbuf();
+  string text = ss.str();
+  Json root = JsonParser(text).parse();
+
+  Json const *benchmarks = root.get("benchmarks");
+  if (benchmarks == nullptr || benchmarks->type != Json::ARRAY)
+    throw runtime_error(path + ": no \"benchmarks\" array");
+
+  vector<pair<string, Sample>> res;
+  map<string, size_t> index;
+
+  for (auto& b : benchmarks->items) {
+    Json const *run_type = b.get("run_type");
+    if (run_type != nullptr && run_type->str != "iteration")  // mean/median/stddev aggregates
+      continue;
+
+    Json const *name = b.get("run_name");
+    if (name == nullptr)
+      name = b.get("name");
+    Json const *value = b.get(metric);
+    Json const *unit = b.get("time_unit");
+    if (name == nullptr || value == nullptr || b.get("error_occurred") != nullptr)
+      continue;
+
+    auto it = index.find(name->str);
+    if (it == index.end()) {
+      it = index.emplace(name->str, res.size()).first;
+      res.push_back({name->str, Sample()});
+    }
+    res[it->second].second.values.push_back(to_ns(value->number, unit != nullptr ? unit->str : "ns"));
+  }
+
+  return res;
+}
+
+static string format_time(double ns)
+{
+  char buf[32];
+  if (ns >= 1e9)      snprintf(buf, sizeof(buf), "%.3f s", ns / 1e9);
+  else if (ns >= 1e6) snprintf(buf, sizeof(buf), "%.3f ms", ns / 1e6);
+  else if (ns >= 1e3) snprintf(buf, sizeof(buf), "%.3f us", ns / 1e3);
+  else                snprintf(buf, sizeof(buf), "%.1f ns", ns);
+  return buf;
+}
+
+static int usage()
+{
+  cerr << "usage: bench_compare [--threshold=0.05] [--alpha=0.05] [--metric=real_time|cpu_time]" << endl;
+  cerr << "                     [--filter=regex] baseline.json contender.json" << endl;
+  return 2;
+}
+
+int main(int argc, char* argv[])
+{
+  double threshold = 0.05;
+  double alpha = 0.05;
+  string metric = "real_time";
+  string filter = ".*";
+  vector<string> files;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    auto value = [&](char const *opt) { return arg.substr(strlen(opt)); };
+
+    if (arg.rfind("--threshold=", 0) == 0)   threshold = stod(value("--threshold="));
+    else if (arg.rfind("--alpha=", 0) == 0)  alpha = stod(value("--alpha="));
+    else if (arg.rfind("--metric=", 0) == 0) metric = value("--metric=");
+    else if (arg.rfind("--filter=", 0) == 0) filter = value("--filter=");
+    else if (arg.rfind("--", 0) == 0)        return usage();
+    else files.push_back(arg);
+  }
+
+  if (files.size() != 2 || (metric != "real_time" && metric != "cpu_time") || alpha <= 0 || alpha >= 1)
+    return usage();
+
+  try {
+    auto base = load(files[0], metric);
+    auto contender = load(files[1], metric);
+    regex re(filter);
+
+    map<string, Sample const*> contender_index;
+    for (auto& [name, sample] : contender)
+      contender_index[name] = &sample;
+
+    int regressions = 0, compared = 0, insufficient = 0;
+    printf("%-40s %12s %12s %9s %21s %8s\n", "benchmark", "baseline", "contender", "change", "ci", "p");
+
+    for (auto& [name, sample] : base) {
+      auto it = contender_index.find(name);
+      if (it == contender_index.end() || !regex_search(name, re))
+        continue;
+
+      Comparison c = compare(sample, *it->second, alpha);
+      compared++;
+
+      bool significant = c.p >= 0 && c.p < alpha;
+      bool regressed = significant && c.change > threshold;
+      regressions += regressed;
+      insufficient += c.p < 0;
+
+      char ci[32] = "n/a", p[16] = "n/a";
+      if (c.p >= 0) {
+        snprintf(ci, sizeof(ci), "[%+.1f%%, %+.1f%%]", c.ci_lo * 100, c.ci_hi * 100);
+        snprintf(p, sizeof(p), "%.4f", c.p);
+      }
+
+      printf("%-40s %12s %12s %+8.1f%% %21s %8s%s\n", name.c_str(),
+          format_time(c.base_mean).c_str(), format_time(c.new_mean).c_str(),
+          c.change * 100, ci, p,
+          regressed ? "  REGRESSION" : c.p < 0 ? "  insufficient samples"
+                    : (significant && c.change < -threshold ? "  improved" : ""));
+    }
+
+    if (compared == 0) {
+      cerr << "no benchmarks in common" << endl;
+      return 2;
+    }
+
+    printf("\n%d of %d benchmarks regressed by more than %.1f%% (alpha %.3f, %s)\n",
+        regressions, compared, threshold * 100, alpha, metric.c_str());
+
+    if (insufficient > 0) {
+      cerr << "warning: insufficient samples: " << insufficient << " of " << compared
+           << " benchmarks have fewer than 2 repetitions on a side, run with --benchmark_repetitions=5" << endl;
+      return 2;
+    }
+
+    return regressions > 0 ? 1 : 0;
+  } catch (exception const& e) {
+    cerr << "error: " << e.what() << endl;
+    return 2;
+  }
+}
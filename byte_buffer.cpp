@@ -11,6 +11,7 @@
 #include <sstream>
 #include <cassert>
 #include <algorithm>
+#include <atomic>
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -21,6 +22,14 @@ namespace sys::io {
   
   using namespace detail;
 
+  struct shared_block
+  {
+    atomic<int> refs;
+    uint8_t* data;
+    int capacity;
+    byte_allocator* alloc;
+  };
+
   byte_buffer::byte_buffer(uint8_t* data, int offset, int count, bool owner)
   {
     m_data   = data;
@@ -47,7 +56,7 @@ namespace sys::io {
 
     if (len > 0) 
     {
-      m_data = new uint8_t[len];
+      m_data = allocate(int(len));
       for (int i=0; i<len; i++) m_data[i] = src[i];
 
       m_begin  = 0;
@@ -73,15 +82,20 @@ namespace sys::io {
     m_limit  = rhs.m_limit;
     m_owner  = rhs.m_owner;
     m_capacity = rhs.m_capacity;
+    m_alloc  = rhs.m_alloc;
+    m_shared = rhs.m_shared;
     
     rhs.m_data  = nullptr;
     rhs.m_owner = false;
+    rhs.m_shared = nullptr;
   }
 
   auto byte_buffer::operator=(byte_buffer const& rhs) -> byte_buffer&
   {
     if (&rhs != this)
     {
+      release();
+
       m_offset = rhs.m_offset;
       m_begin  = rhs.m_begin;
       m_count  = rhs.m_count;
@@ -90,15 +104,22 @@ namespace sys::io {
       m_capacity = rhs.m_capacity;
 
       // TODO test
-      if (m_owner)
+      if (rhs.m_shared != nullptr)
+      {
+        m_data = rhs.m_data;
+        m_alloc = nullptr;
+        m_shared = rhs.m_shared;
+        m_shared->refs.fetch_add(1, memory_order_relaxed);
+      }
+      else if (m_owner)
       {
-        delete [] m_data;
-        m_data = new uint8_t[m_count];
-        copy(rhs.m_data, rhs.m_data + m_count, m_data);
+        m_data = allocate(m_capacity);
+        copy(rhs.m_data, rhs.m_data + m_limit, m_data);
       }
       else
       {
         m_data = rhs.m_data;
+        m_alloc = nullptr;
       }
     }
 
@@ -114,16 +135,53 @@ namespace sys::io {
   {
     if (m_owner)
     {
-      delete [] m_data;
+      release();
       m_data = nullptr;
     }
   }
 
+  auto byte_buffer::allocate(int size) -> uint8_t*
+  {
+    m_alloc = default_allocator();
+
+    return m_alloc->allocate(size);
+  }
+
+  // frees owned m_data with whatever it was allocated by
+  auto byte_buffer::release() -> void
+  {
+    if (!m_owner or m_data == nullptr)
+      return;
+
+    if (m_shared != nullptr)
+    {
+      if (m_shared->refs.fetch_sub(1, memory_order_acq_rel) == 1)
+      {
+        if (m_shared->alloc != nullptr)
+          m_shared->alloc->deallocate(m_shared->data, m_shared->capacity);
+        else
+          delete [] m_shared->data;
+
+        delete m_shared;
+      }
+
+      m_shared = nullptr;
+      return;
+    }
+
+    if (m_alloc != nullptr)
+      m_alloc->deallocate(m_data, m_capacity);
+    else
+      delete [] m_data;
+
+    m_alloc = nullptr;
+  }
+
   auto byte_buffer::set_owner() -> byte_buffer&
   {
     if (!m_owner and m_count > 0)
     {
-      auto new_data = new uint8_t[m_count];
+      auto new_data = allocate(m_count);
       memcpy(new_data, m_data + m_begin, m_count);
 
       m_data = new_data;
@@ -137,19 +195,60 @@ namespace sys::io {
     return *this;
   }
 
+  //
+  // Hands the owned block over to a reference counted control block.
+  // A view is copied into owned memory first.
+  //
+  auto byte_buffer::share() -> byte_buffer&
+  {
+    if (m_shared != nullptr)
+      return *this;
+
+    set_owner();
+    if (!m_owner)
+      return *this;
+
+    m_shared = new shared_block{ {1}, m_data, m_capacity, m_alloc };
+    m_alloc = nullptr;
+
+    return *this;
+  }
+
+  auto byte_buffer::use_count() const -> int
+  {
+    return m_shared == nullptr ? 0 : m_shared->refs.load(memory_order_relaxed);
+  }
+
+  auto byte_buffer::shared_view(int from, int count) const -> byte_buffer
+  {
+    byte_buffer view(m_data, from, count);
+
+    if (m_shared != nullptr)
+    {
+      m_shared->refs.fetch_add(1, memory_order_relaxed);
+      view.m_shared = m_shared;
+      view.m_owner  = true;
+    }
+
+    return view;
+  }
+
   // very simple scheme
   auto byte_buffer::resize(int upto) -> int
   {
-    if (!m_owner or upto <= m_limit)
+    if (!m_owner or m_shared != nullptr or upto <= m_limit)
       return -1;
 
     auto blocks = (upto + 4096 - 1) / 4096;
-    m_capacity  = blocks * 4096;
+    auto alloc  = default_allocator();
 
-    auto new_data = new uint8_t[m_capacity];
+    auto new_data = alloc->allocate(blocks * 4096);
     memcpy(new_data, m_data, m_count);
-    delete [] m_data;
+    release();
+
     m_data = new_data;
+    m_alloc = alloc;
+    m_capacity = blocks * 4096;
 
     return m_capacity;
   }
@@ -183,6 +282,9 @@ namespace sys::io {
     if (!m_owner)
       throw runtime_error("only owned buffer can append");
 
+    if (m_shared != nullptr)
+      throw runtime_error("shared buffer can not append");
+
     if (m_limit + count >= m_capacity)
       resize(m_count+count);
 
@@ -673,6 +775,172 @@ namespace sys::io {
     return make_pair(value, value_size);
   }
 
+  auto byte_buffer::put_int8(int8_t value, int at) -> byte_buffer&
+  {
+    *writable(at, 1) = (uint8_t)value;
+
+    return *this;
+  }
+
+  auto byte_buffer::put_uint8(uint8_t value, int at) -> byte_buffer&
+  {
+    *writable(at, 1) = value;
+
+    return *this;
+  }
+
+  auto byte_buffer::put_int16_be(int16_t value, int at) -> byte_buffer&
+  {
+    auto res = detail::endian_swap_bytes<HOST_ENDIAN_ORDER, BIG_ENDIAN_ORDER>(value);
+    memcpy(writable(at, 2), &res, 2);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_int16_le(int16_t value, int at) -> byte_buffer&
+  {
+    memcpy(writable(at, 2), &value, 2);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_uint16_be(uint16_t value, int at) -> byte_buffer&
+  {
+    auto res = detail::endian_swap_bytes<HOST_ENDIAN_ORDER, BIG_ENDIAN_ORDER>(value);
+    memcpy(writable(at, 2), &res, 2);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_uint16_le(uint16_t value, int at) -> byte_buffer&
+  {
+    memcpy(writable(at, 2), &value, 2);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_int32_be(int32_t value, int at) -> byte_buffer&
+  {
+    auto res = detail::endian_swap_bytes<HOST_ENDIAN_ORDER, BIG_ENDIAN_ORDER>(value);
+    memcpy(writable(at, 4), &res, 4);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_int32_le(int32_t value, int at) -> byte_buffer&
+  {
+    memcpy(writable(at, 4), &value, 4);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_uint32_be(uint32_t value, int at) -> byte_buffer&
+  {
+    auto res = detail::endian_swap_bytes<HOST_ENDIAN_ORDER, BIG_ENDIAN_ORDER>(value);
+    memcpy(writable(at, 4), &res, 4);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_uint32_le(uint32_t value, int at) -> byte_buffer&
+  {
+    memcpy(writable(at, 4), &value, 4);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_int64_be(int64_t value, int at) -> byte_buffer&
+  {
+    auto res = detail::endian_swap_bytes<HOST_ENDIAN_ORDER, BIG_ENDIAN_ORDER>(value);
+    memcpy(writable(at, 8), &res, 8);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_int64_le(int64_t value, int at) -> byte_buffer&
+  {
+    memcpy(writable(at, 8), &value, 8);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_uint64_be(uint64_t value, int at) -> byte_buffer&
+  {
+    auto res = detail::endian_swap_bytes<HOST_ENDIAN_ORDER, BIG_ENDIAN_ORDER>(value);
+    memcpy(writable(at, 8), &res, 8);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_uint64_le(uint64_t value, int at) -> byte_buffer&
+  {
+    memcpy(writable(at, 8), &value, 8);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_ascii(string const& str, int at) -> byte_buffer&
+  {
+    auto size = int(str.length());
+    memcpy(writable(at, size), str.data(), size);
+
+    return *this;
+  }
+
+  // fixed width field, truncated or padded with `pad` (8.3 names are space padded)
+  auto byte_buffer::put_ascii(string const& str, int size, uint8_t pad, int at) -> byte_buffer&
+  {
+    auto here = writable(at, size);
+    auto len  = min(size, int(str.length()));
+
+    memcpy(here, str.data(), len);
+    memset(here + len, pad, size - len);
+
+    return *this;
+  }
+
+  auto byte_buffer::put_utf16le(string const& str, int at) -> int
+  {
+#if _MSC_VER >= 1900
+    wstring_convert<codecvt_utf8_utf16<int16_t>, int16_t> convert;
+    auto w = convert.from_bytes(str);
+    u16string u16(w.begin(), w.end());
+#else
+    wstring_convert<codecvt_utf8_utf16<char16_t>, char16_t> convert;
+    auto u16 = convert.from_bytes(str);
+#endif
+
+    return put_utf16le(u16, at);
+  }
+
+  auto byte_buffer::put_utf16le(u16string const& str, int at) -> int
+  {
+    auto size = int(str.length());
+    auto here = writable(at, size * 2);
+
+    for (int i=0; i<size; i++)
+    {
+      here[2*i + 0] = uint8_t(str[i] & 0xff);
+      here[2*i + 1] = uint8_t(str[i] >> 8);
+    }
+
+    return size;
+  }
+
+  auto byte_buffer::put_bytes(uint8_t const* src, int count, int at) -> byte_buffer&
+  {
+    memcpy(writable(at, count), src, count);
+
+    return *this;
+  }
+
+  auto byte_buffer::fill(uint8_t value, int count, int at) -> byte_buffer&
+  {
+    memset(writable(at, count), value, count);
+
+    return *this;
+  }
+
   auto byte_buffer::has_remaining() const -> bool
   {
     return m_offset < m_limit;
@@ -706,7 +974,7 @@ namespace sys::io {
     
   auto byte_buffer::take(int amount) const -> byte_buffer
   {
-    byte_buffer subrange(m_data, m_offset, amount);
+    auto subrange = shared_view(m_offset, amount);
     m_offset += amount;
 
     return subrange;
@@ -714,15 +982,19 @@ namespace sys::io {
 
   auto byte_buffer::slice(int from, int count) -> byte_buffer
   {
-    return byte_buffer(m_data, from, count);
+    return shared_view(from, count);
   }
     
   auto byte_buffer::copy_slice(int from, int count) -> byte_buffer
   {
-    auto data = new uint8_t[count];
+    auto alloc = default_allocator();
+    auto data  = alloc->allocate(count);
     memcpy(data, m_data + from, count);
     
-    return byte_buffer(data, count, true);
+    byte_buffer res(data, count, true);
+    res.m_alloc = alloc;
+
+    return res;
   }
 
   auto byte_buffer::compare_range(int from, int count, uint8_t value) -> bool
@@ -747,7 +1019,7 @@ namespace sys::io {
   {
     check_offset(amount);
 
-    return byte_buffer(m_data, m_begin, amount);
+    return shared_view(m_begin, amount);
   }
 
   auto byte_buffer::last() const -> uint8_t
@@ -759,9 +1031,7 @@ namespace sys::io {
 
   auto byte_buffer::last(int amount) const -> byte_buffer
   {
-    byte_buffer sub_range(m_data, m_limit - amount, amount);
-
-    return sub_range;
+    return shared_view(m_limit - amount, amount);
   }
 
   auto byte_buffer::starts_with(string const& str) const -> bool
@@ -784,7 +1054,9 @@ namespace sys::io {
   
   auto byte_buffer::reset(initializer_list<uint8_t> l) -> void
   {
-    m_data = new uint8_t[l.size()];
+    release();
+
+    m_data = allocate(int(l.size()));
     int i = 0;
     for (auto it : l) m_data[i++] = it;
 
@@ -792,19 +1064,20 @@ namespace sys::io {
     m_begin  = 0;
     m_count  = (int)l.size();
     m_limit  = m_count;
+    m_capacity = m_count;
     m_owner  = true;
   }
 
   auto byte_buffer::reset(uint8_t* buffer, size_t size) -> void
   {
-    if (m_owner)
-      delete [] m_data;
+    release();
 
     m_data   = buffer;
     m_limit  = size;
     m_offset = 0;
     m_begin  = 0;
     m_count  = size;
+    m_capacity = size;
 
     m_owner = true;
   }
@@ -883,8 +1156,9 @@ namespace sys::io {
 
     if (s.length() % 2 == 0 && all_hex)
     {
-      auto size = int(s.length() / 2);
-      auto data = new uint8_t[size];
+      auto size  = int(s.length() / 2);
+      auto alloc = default_allocator();
+      auto data  = alloc->allocate(size);
 
       for (int i=0; i<size; ++i)
       {
@@ -898,6 +1172,8 @@ namespace sys::io {
       }
 
       byte_buffer res(data, 0, size, true);
+      res.m_alloc = alloc;
+
       return res;
     }
     
@@ -918,6 +1194,20 @@ namespace sys::io {
       throw out_of_range("check_offset: array out of index");
   }
 
+  // bounds checked write position, advances the offset like advance(at, dist)
+  auto byte_buffer::writable(int at, int count) -> uint8_t*
+  {
+    auto here = (at == -1) ? m_offset : m_begin + at;
+
+    if (count < 0 or here < m_begin or here + count > m_limit)
+      throw out_of_range("put: array out of index");
+
+    if (at == -1)
+      m_offset += count;
+
+    return &m_data[here];
+  }
+
   auto byte_buffer::leading_byte(uint8_t b) const -> uint8_t 
   {
     return (b & 0x80) == 0 ? 0 : 0xff;
@@ -4,16 +4,25 @@
 #include <string>
 #include <initializer_list>
 
+#include "byte_pool.hpp"
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // byte_buffer is basically, a shallow version of byte buffer.
 //
-// But, It can own buffer memory
+// But, It can own buffer memory, owned memory comes from an allocator
+// (byte_pool unless changed by set_default_allocator)
+//
+// An owned buffer can be turned into a shared one with share(): from then on
+// slice, take, first(int) and last(int) return views which hold a reference
+// on the underlying block, so they stay valid after the original is gone.
 //
 ////////////////////////////////////////////////////////////////////////////////
 namespace sys::io {
 
   using namespace std;
+
+  struct shared_block;
   
   class byte_buffer
   {
@@ -31,6 +40,9 @@ namespace sys::io {
 
   public:
     auto set_owner() -> byte_buffer&;
+    auto share() -> byte_buffer&;
+    auto is_shared() const -> bool { return m_shared != nullptr; }
+    auto use_count() const -> int;
 
     auto resize(int to) -> int;
     auto append(byte_buffer const& b) -> byte_buffer&;
@@ -94,6 +106,37 @@ namespace sys::io {
     auto get_varint2() const -> pair<int64_t, int>;
     auto get_varint_with_size() const -> pair<int64_t, int>;
 
+    // writers mirror the getters: at == -1 writes at the offset and advances,
+    // otherwise at is relative to begin() and the offset is left alone.
+    // They write straight into the underlying memory, views included.
+    auto put_int8(int8_t, int at=-1) -> byte_buffer&;
+    auto put_uint8(uint8_t, int at=-1) -> byte_buffer&;
+
+    auto put_int16_be(int16_t, int at=-1) -> byte_buffer&;
+    auto put_int16_le(int16_t, int at=-1) -> byte_buffer&;
+    auto put_uint16_be(uint16_t, int at=-1) -> byte_buffer&;
+    auto put_uint16_le(uint16_t, int at=-1) -> byte_buffer&;
+
+    auto put_int32_be(int32_t, int at=-1) -> byte_buffer&;
+    auto put_int32_le(int32_t, int at=-1) -> byte_buffer&;
+    auto put_uint32_be(uint32_t, int at=-1) -> byte_buffer&;
+    auto put_uint32_le(uint32_t, int at=-1) -> byte_buffer&;
+
+    auto put_int64_be(int64_t, int at=-1) -> byte_buffer&;
+    auto put_int64_le(int64_t, int at=-1) -> byte_buffer&;
+    auto put_uint64_be(uint64_t, int at=-1) -> byte_buffer&;
+    auto put_uint64_le(uint64_t, int at=-1) -> byte_buffer&;
+
+    auto put_ascii(string const& str, int at=-1) -> byte_buffer&;
+    auto put_ascii(string const& str, int size, uint8_t pad, int at=-1) -> byte_buffer&;
+
+    // utf-8 in, utf-16le code units out, returns the number of units written
+    auto put_utf16le(string const& str, int at=-1) -> int;
+    auto put_utf16le(u16string const& str, int at=-1) -> int;
+
+    auto put_bytes(uint8_t const* src, int count, int at=-1) -> byte_buffer&;
+    auto fill(uint8_t value, int count, int at=-1) -> byte_buffer&;
+
     auto has_remaining() const -> bool;
     auto remained_size() const -> int;
 
@@ -138,7 +181,12 @@ namespace sys::io {
     auto debug_it() const -> string;
 
   private:
+    auto allocate(int size) -> uint8_t*;
+    auto release() -> void;
+    auto shared_view(int from, int count) const -> byte_buffer;
+
     auto check_offset(int) const -> void;
+    auto writable(int at, int count) -> uint8_t*;
     auto leading_byte(uint8_t) const -> uint8_t;
     auto advance(int at, int dist) const -> int;
 
@@ -152,6 +200,12 @@ namespace sys::io {
 
     uint8_t* m_data{};
     bool m_owner{};
+
+    // where owned m_data came from, nullptr when handed in by the caller (new[])
+    byte_allocator* m_alloc{};
+
+    // reference counted block when shared, m_data then points into it
+    shared_block* m_shared{};
   };
 
 }
@@ -0,0 +1,229 @@
+#include "byte_pool.hpp"
+
+#include <bit>
+#include <new>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// byte_pool: size-class free lists with thread local caches
+//
+////////////////////////////////////////////////////////////////////////////////
+namespace sys::io {
+
+  auto heap_allocator::allocate(size_t size) -> uint8_t*
+  {
+    return new uint8_t[size];
+  }
+
+  auto heap_allocator::deallocate(uint8_t* data, size_t) -> void
+  {
+    delete [] data;
+  }
+
+  auto pool_stats::hit_rate() const -> double
+  {
+    return allocs == 0 ? 0.0 : double(hits) / double(allocs);
+  }
+
+  //
+  // Free blocks of the calling thread. Blocks freed on another thread than
+  // the one which allocated them simply land in the freeing thread's cache.
+  //
+  struct thread_cache
+  {
+    byte_pool::free_list lists[byte_pool::class_count];
+
+   ~thread_cache()
+    {
+      auto& pool = byte_pool::instance();
+
+      for (int cls = 0; cls < byte_pool::class_count; cls++)
+        pool.spill(lists[cls], cls, 0);
+    }
+  };
+
+  static thread_local thread_cache t_cache;
+
+  auto byte_pool::instance() -> byte_pool&
+  {
+    // never destroyed, thread caches may outlive static destruction order
+    static auto* pool = new byte_pool();
+
+    return *pool;
+  }
+
+  auto byte_pool::class_of(size_t size) -> int
+  {
+    if (size > class_size(class_count - 1))
+      return -1;
+
+    auto shift = size <= 1 ? 0 : int(bit_width(size - 1));
+
+    return shift <= min_shift ? 0 : shift - min_shift;
+  }
+
+  auto byte_pool::cache_limit(int cls) const -> size_t
+  {
+    auto n = cache_bytes / class_size(cls);
+
+    return n < 4 ? 4 : n;
+  }
+
+  auto byte_pool::allocate(size_t size) -> uint8_t*
+  {
+    m_allocs.fetch_add(1, memory_order_relaxed);
+
+    auto cls = class_of(size);
+    if (cls < 0)
+    {
+      m_oversized.fetch_add(1, memory_order_relaxed);
+      return new uint8_t[size];
+    }
+
+    auto& local = t_cache.lists[cls];
+    if (local.head == nullptr)
+      refill(local, cls);
+
+    if (local.head != nullptr)
+    {
+      auto b = local.head;
+      local.head = b->next;
+      local.count--;
+
+      m_hits.fetch_add(1, memory_order_relaxed);
+      return reinterpret_cast<uint8_t*>(b);
+    }
+
+    m_misses.fetch_add(1, memory_order_relaxed);
+
+    return static_cast<uint8_t*>(::operator new(class_size(cls)));
+  }
+
+  auto byte_pool::deallocate(uint8_t* data, size_t size) -> void
+  {
+    if (data == nullptr)
+      return;
+
+    m_frees.fetch_add(1, memory_order_relaxed);
+
+    auto cls = class_of(size);
+    if (cls < 0)
+    {
+      delete [] data;
+      return;
+    }
+
+    auto& local = t_cache.lists[cls];
+    auto b = reinterpret_cast<block*>(data);
+    b->next = local.head;
+    local.head = b;
+    local.count++;
+
+    auto limit = cache_limit(cls);
+    if (local.count > limit)
+      spill(local, cls, limit / 2);
+  }
+
+  // move half a cache worth of blocks from the shared list to the thread
+  auto byte_pool::refill(free_list& local, int cls) -> void
+  {
+    auto want = cache_limit(cls) / 2;
+
+    lock_guard<mutex> guard(m_lock[cls]);
+    auto& shared = m_shared[cls];
+
+    while (shared.head != nullptr and local.count < want)
+    {
+      auto b = shared.head;
+      shared.head = b->next;
+      shared.count--;
+
+      b->next = local.head;
+      local.head = b;
+      local.count++;
+    }
+  }
+
+  // keep `keep` blocks in the thread cache, hand the rest to the shared list
+  auto byte_pool::spill(free_list& local, int cls, size_t keep) -> void
+  {
+    if (local.count <= keep)
+      return;
+
+    lock_guard<mutex> guard(m_lock[cls]);
+    auto& shared = m_shared[cls];
+
+    while (local.count > keep)
+    {
+      auto b = local.head;
+      local.head = b->next;
+      local.count--;
+
+      b->next = shared.head;
+      shared.head = b;
+      shared.count++;
+    }
+  }
+
+  auto byte_pool::trim() -> void
+  {
+    for (int cls = 0; cls < class_count; cls++)
+    {
+      lock_guard<mutex> guard(m_lock[cls]);
+      auto& shared = m_shared[cls];
+
+      while (shared.head != nullptr)
+      {
+        auto b = shared.head;
+        shared.head = b->next;
+        ::operator delete(b);
+      }
+
+      shared.count = 0;
+    }
+  }
+
+  auto byte_pool::stats() const -> pool_stats
+  {
+    pool_stats s;
+    s.allocs    = m_allocs.load(memory_order_relaxed);
+    s.hits      = m_hits.load(memory_order_relaxed);
+    s.misses    = m_misses.load(memory_order_relaxed);
+    s.oversized = m_oversized.load(memory_order_relaxed);
+    s.frees     = m_frees.load(memory_order_relaxed);
+
+    return s;
+  }
+
+  auto byte_pool::reset_stats() -> void
+  {
+    m_allocs    = 0;
+    m_hits      = 0;
+    m_misses    = 0;
+    m_oversized = 0;
+    m_frees     = 0;
+  }
+
+  static atomic<byte_allocator*> g_default_allocator{nullptr};
+
+  auto default_allocator() -> byte_allocator*
+  {
+    auto alloc = g_default_allocator.load(memory_order_acquire);
+
+    return alloc != nullptr ? alloc : &byte_pool::instance();
+  }
+
+  auto set_default_allocator(byte_allocator* alloc) -> byte_allocator*
+  {
+    auto prev = g_default_allocator.exchange(alloc, memory_order_acq_rel);
+
+    return prev != nullptr ? prev : &byte_pool::instance();
+  }
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//
+//
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// byte_pool is the storage source of owned byte_buffers.
+//
+// Blocks are grouped into power-of-two size classes (64 bytes .. 64K, which
+// covers every FAT32 cluster size) and recycled through per-thread free lists
+// backed by a shared, mutex protected free list per class.
+//
+////////////////////////////////////////////////////////////////////////////////
+namespace sys::io {
+
+  using namespace std;
+
+  class byte_allocator
+  {
+  public:
+    virtual ~byte_allocator() = default;
+
+    virtual auto allocate(size_t size) -> uint8_t* = 0;
+    virtual auto deallocate(uint8_t* data, size_t size) -> void = 0;
+  };
+
+  // plain new[]/delete[], what byte_buffer used before the pool
+  class heap_allocator : public byte_allocator
+  {
+  public:
+    auto allocate(size_t size) -> uint8_t* override;
+    auto deallocate(uint8_t* data, size_t size) -> void override;
+  };
+
+  struct pool_stats
+  {
+    uint64_t allocs{};      // allocate() calls
+    uint64_t hits{};        // served from a free list
+    uint64_t misses{};      // pooled size, but free lists were empty
+    uint64_t oversized{};   // larger than the biggest class, went to the heap
+    uint64_t frees{};       // deallocate() calls
+
+    auto hit_rate() const -> double;
+  };
+
+  class byte_pool : public byte_allocator
+  {
+  public:
+    static constexpr int min_shift   = 6;   // 64 bytes
+    static constexpr int max_shift   = 16;  // 64K
+    static constexpr int class_count = max_shift - min_shift + 1;
+
+    // per thread, per class cache limit in bytes before spilling to the shared list
+    static constexpr size_t cache_bytes = 1 << 20;
+
+  public:
+    static auto instance() -> byte_pool&;
+
+    auto allocate(size_t size) -> uint8_t* override;
+    auto deallocate(uint8_t* data, size_t size) -> void override;
+
+    auto stats() const -> pool_stats;
+    auto reset_stats() -> void;
+
+    // give the shared free lists back to the heap
+    auto trim() -> void;
+
+    static auto class_of(size_t size) -> int;
+    static auto class_size(int cls) -> size_t { return size_t(1) << (cls + min_shift); }
+
+  public:
+    struct block { block* next; };
+
+    struct free_list
+    {
+      block* head{};
+      size_t count{};
+    };
+
+  private:
+    byte_pool() = default;
+
+    auto cache_limit(int cls) const -> size_t;
+    auto refill(free_list& local, int cls) -> void;
+    auto spill(free_list& local, int cls, size_t keep) -> void;
+
+    friend struct thread_cache;
+
+  private:
+    mutex m_lock[class_count];
+    free_list m_shared[class_count];
+
+    atomic<uint64_t> m_allocs{};
+    atomic<uint64_t> m_hits{};
+    atomic<uint64_t> m_misses{};
+    atomic<uint64_t> m_oversized{};
+    atomic<uint64_t> m_frees{};
+  };
+
+  // allocator used by byte_buffer for new owned storage, byte_pool by default
+  auto default_allocator() -> byte_allocator*;
+  auto set_default_allocator(byte_allocator* alloc) -> byte_allocator*;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//
+//
+////////////////////////////////////////////////////////////////////////////////
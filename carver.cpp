@@ -0,0 +1,392 @@
+#include "carver.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "parallel.hpp"
+
+
+// clusters read at once by a scanning thread
+static constexpr uint32_t BATCH_BYTES = 4 << 20;
+
+struct Signature
+{
+  enum End
+  {
+    FIRST_FOOTER,
+    LAST_FOOTER,              // the last footer before the next header of the type
+    NESTED,                   // headers and footers pair up like brackets
+  };
+
+  char const *type;
+  char const *ext;
+  string header;
+  string footer;
+  End end;
+  uint64_t max_size;
+};
+
+// pattern 2k is the header of SIGNATURES[k], 2k + 1 its footer
+static vector<Signature> const SIGNATURES = {
+  { "jpeg", "jpg", string("\xFF\xD8\xFF", 3), string("\xFF\xD9", 2), Signature::NESTED, 32 << 20 },
+  { "png", "png", string("\x89PNG\r\n\x1A\n", 8), string("IEND\xAE\x42\x60\x82", 8), Signature::FIRST_FOOTER, 64 << 20 },
+  { "pdf", "pdf", string("%PDF-", 5), string("%%EOF", 5), Signature::LAST_FOOTER, 256 << 20 },
+  { "zip", "zip", string("PK\x03\x04", 4), string("PK\x05\x06", 4), Signature::FIRST_FOOTER, 1024 << 20 },
+};
+
+// a ZIP ends 22 bytes after its end of central directory signature, plus the comment
+static constexpr uint32_t ZIP_EOCD_SIZE = 22;
+
+//
+// Aho-Corasick automaton over bytes with the failure links folded into a
+// full transition table, so the scan is one table lookup per byte.
+//
+class PatternMatcher
+{
+  public:
+    PatternMatcher(vector<string> const& patterns)
+    {
+      next.assign(256, -1);
+      out.push_back({});
+
+      for (size_t p = 0; p < patterns.size(); p++) {
+        int32_t s = 0;
+        for (uint8_t b : patterns[p]) {
+          if (next[s * 256 + b] < 0) {
+            next[s * 256 + b] = state_cnt();
+            next.resize(next.size() + 256, -1);
+            out.push_back({});
+          }
+          s = next[s * 256 + b];
+        }
+        out[s].push_back(p);
+        is_first[(uint8_t)patterns[p][0]] = true;
+        max_len = max(max_len, patterns[p].size());
+        lengths.push_back(patterns[p].size());
+      }
+
+      // breadth first: a state's failure target is complete before the state itself
+      vector<int32_t> fail(state_cnt(), 0);
+      vector<int32_t> queue;
+
+      for (int b = 0; b < 256; b++) {
+        int32_t& t = next[b];
+        if (t < 0)
+          t = 0;
+        else
+          queue.push_back(t);
+      }
+
+      for (size_t i = 0; i < queue.size(); i++) {
+        int32_t s = queue[i];
+        out[s].insert(out[s].end(), out[fail[s]].begin(), out[fail[s]].end());
+
+        for (int b = 0; b < 256; b++) {
+          int32_t& t = next[s * 256 + b];
+          if (t < 0) {
+            t = next[fail[s] * 256 + b];
+          } else {
+            fail[t] = next[fail[s] * 256 + b];
+            queue.push_back(t);
+          }
+        }
+      }
+    }
+
+  public:
+    int32_t state_cnt() { return out.size(); }
+
+    // feeds data starting at stream offset pos; fn(start, pattern) for every match
+    template<typename Fn>
+    int32_t feed(int32_t state, uint8_t const *data, size_t size, uint64_t pos, Fn fn)
+    {
+      for (size_t i = 0; i < size; i++) {
+        // in the start state, bytes no pattern starts with are skipped without a lookup
+        if (state == 0) {
+          while (i < size && !is_first[data[i]])
+            i++;
+          if (i == size)
+            break;
+        }
+
+        state = next[state * 256 + data[i]];
+        if (out[state].empty())
+          continue;
+
+        for (auto p : out[state])
+          fn(pos + i + 1 - lengths[p], p);
+      }
+
+      return state;
+    }
+
+    size_t get_max_len() { return max_len; }
+
+  private:
+    vector<int32_t> next;
+    vector<vector<uint32_t>> out;
+    vector<size_t> lengths;
+    array<bool, 256> is_first = {};
+    size_t max_len = 0;
+};
+
+// free clusters, index is the position in the stream of free clusters
+struct FreeRun
+{
+  uint64_t index;
+  uint32_t cluster;
+  uint32_t count;
+};
+
+struct SignatureMatch
+{
+  uint64_t start;             // stream offset
+  uint32_t pattern;
+};
+
+Carver::Carver(FAT32& fat32, unsigned thread_cnt)
+  : fat32(fat32), thread_cnt(thread_cnt != 0 ? thread_cnt : max(1u, thread::hardware_concurrency()))
+{
+}
+
+// (image offset, length) pieces of the stream bytes [from, to)
+static vector<pair<uint64_t, uint64_t>> to_ranges(FAT32& fat32, vector<FreeRun> const& runs, uint64_t from, uint64_t to)
+{
+  uint32_t cluster_size = fat32.get_super_block()->get_cluster_size();
+  vector<pair<uint64_t, uint64_t>> ranges;
+
+  auto it = upper_bound(runs.begin(), runs.end(), from / cluster_size,
+      [](uint64_t index, FreeRun const& run) { return index < run.index; });
+
+  for (--it; it != runs.end() && from < to; ++it) {
+    uint64_t run_end = (it->index + it->count) * cluster_size;
+    uint64_t n = min(to, run_end) - from;
+
+    ranges.push_back({ fat32.cal_data_offset(it->cluster) + (from - it->index * cluster_size), n });
+    from += n;
+  }
+
+  return ranges;
+}
+
+static void read_range(FAT32& fat32, uint64_t offset, uint64_t size, uint8_t *out)
+{
+  uint32_t cluster_size = fat32.get_super_block()->get_cluster_size();
+  uint32_t first = fat32.cal_cluster_no(offset);
+  uint32_t last = fat32.cal_cluster_no(offset + size - 1);
+
+  vector<uint8_t> buffer((uint64_t)(last - first + 1) * cluster_size);
+  fat32.read_clusters(first, last - first + 1, buffer.data());
+  memcpy(out, &buffer[offset - fat32.cal_data_offset(first)], size);
+}
+
+CarveReport Carver::run()
+{
+  TraceSpan span("Carver::run");
+
+  SuperBlock *super_block = fat32.get_super_block();
+  uint32_t cluster_size = super_block->get_cluster_size();
+  uint32_t max_cluster = super_block->get_cluster_cnt() + 1;
+  uint32_t *fat = fat32.get_fat_area()->get_copy(0);
+
+  // clusters past the end of a truncated image cannot be read
+  uint64_t image_size = fat32.get_image_size();
+  while (max_cluster >= 2 && fat32.cal_data_offset(max_cluster) + cluster_size > image_size)
+    max_cluster--;
+
+  CarveReport report;
+
+  vector<FreeRun> runs;
+  for (uint32_t c = 2; c <= max_cluster; c++) {
+    if ((fat[c] & 0x0FFFFFFF) != 0)
+      continue;
+
+    if (!runs.empty() && runs.back().cluster + runs.back().count == c)
+      runs.back().count++;
+    else
+      runs.push_back({ report.free_cluster_cnt, c, 1 });
+    report.free_cluster_cnt++;
+  }
+
+  report.free_run_cnt = runs.size();
+  uint64_t stream_size = report.free_cluster_cnt * cluster_size;
+
+  vector<string> patterns;
+  for (auto& sig : SIGNATURES) {
+    patterns.push_back(sig.header);
+    patterns.push_back(sig.footer);
+  }
+  PatternMatcher matcher(patterns);
+
+  // 1. scan, each thread a part of the stream and max_len - 1 bytes of the next
+  vector<SignatureMatch> matches;
+  mutex matches_lock;
+  atomic<uint64_t> scanned{0};
+  exception_ptr error;
+
+  parallel_ranges(thread_cnt, 0, report.free_cluster_cnt, [&](uint64_t first, uint64_t last) {
+    TraceSpan span("Carver::scan", "cluster", first);
+
+    // an exception must not leave the thread, the first one is rethrown after the join
+    try {
+      uint64_t part_end = last * cluster_size;
+      uint64_t scan_end = min(stream_size, part_end + matcher.get_max_len() - 1);
+      uint32_t batch = max<uint32_t>(1, BATCH_BYTES / cluster_size);
+      vector<uint8_t> buffer((size_t)batch * cluster_size);
+      vector<SignatureMatch> local;
+      int32_t state = 0;
+
+      auto it = upper_bound(runs.begin(), runs.end(), first,
+          [](uint64_t index, FreeRun const& run) { return index < run.index; }) - 1;
+      uint64_t index = first;
+
+      while (index * cluster_size < scan_end) {
+        uint32_t skip = index - it->index;
+        uint32_t n = min<uint64_t>({ batch, it->count - skip, (scan_end - index * cluster_size + cluster_size - 1) / cluster_size });
+
+        fat32.read_clusters(it->cluster + skip, n, buffer.data());
+
+        uint64_t pos = index * cluster_size;
+        size_t len = min<uint64_t>((uint64_t)n * cluster_size, scan_end - pos);
+        state = matcher.feed(state, buffer.data(), len, pos, [&](uint64_t start, uint32_t pattern) {
+          if (start < part_end)
+            local.push_back({ start, pattern });
+        });
+
+        index += n;
+        if (index == it->index + it->count)
+          ++it;
+      }
+
+      scanned.fetch_add(scan_end - first * cluster_size, memory_order_relaxed);
+
+      lock_guard<mutex> guard(matches_lock);
+      matches.insert(matches.end(), local.begin(), local.end());
+    } catch (...) {
+      lock_guard<mutex> guard(matches_lock);
+      if (!error)
+        error = current_exception();
+    }
+  });
+
+  if (error)
+    rethrow_exception(error);
+
+  report.bytes_scanned = scanned;
+  report.match_cnt = matches.size();
+
+  sort(matches.begin(), matches.end(), [](SignatureMatch const& a, SignatureMatch const& b) {
+    return a.start != b.start ? a.start < b.start : a.pattern < b.pattern;
+  });
+
+  // 2. pair headers with footers; headers inside a carved file of the same type belong to it
+  vector<uint64_t> carved_until(SIGNATURES.size(), 0);
+
+  for (size_t i = 0; i < matches.size(); i++) {
+    if (matches[i].pattern % 2 != 0)
+      continue;
+
+    uint32_t k = matches[i].pattern / 2;
+    Signature const& sig = SIGNATURES[k];
+    uint64_t start = matches[i].start;
+
+    if (start < carved_until[k])
+      continue;
+
+    uint64_t limit = min(stream_size, start + sig.max_size);
+    uint64_t end = 0;
+    int depth = 1;
+
+    for (size_t j = i + 1; j < matches.size() && matches[j].start < limit; j++) {
+      if (matches[j].pattern / 2 != k)
+        continue;
+
+      bool is_footer = matches[j].pattern % 2 != 0;
+      uint64_t footer_end = matches[j].start + sig.footer.size();
+
+      if (sig.end == Signature::FIRST_FOOTER && is_footer && footer_end <= limit) {
+        end = footer_end;
+        break;
+      } else if (sig.end == Signature::LAST_FOOTER) {
+        if (!is_footer)
+          break;
+        if (footer_end <= limit)
+          end = footer_end;
+      } else if (sig.end == Signature::NESTED) {
+        depth += is_footer ? -1 : 1;
+        if (depth == 0 && footer_end <= limit) {
+          end = footer_end;
+          break;
+        }
+      }
+    }
+
+    // the central directory record and its comment follow the signature
+    if (end != 0 && sig.ext == string("zip")) {
+      uint64_t eocd = end - sig.footer.size();
+      if (eocd + ZIP_EOCD_SIZE <= stream_size) {
+        auto ranges = to_ranges(fat32, runs, eocd + 20, eocd + 22);
+        uint8_t len[2];
+        for (size_t r = 0, at = 0; r < ranges.size(); at += ranges[r].second, r++)
+          read_range(fat32, ranges[r].first, ranges[r].second, len + at);
+
+        end = min(stream_size, eocd + ZIP_EOCD_SIZE + (len[0] | (len[1] << 8)));
+      } else {
+        end = 0;
+      }
+    }
+
+    CarvedFile file;
+    file.type = sig.type;
+    file.ext = sig.ext;
+    file.complete = end != 0;
+    file.size = (file.complete ? end : limit) - start;
+    file.ranges = to_ranges(fat32, runs, start, start + file.size);
+    file.offset = file.ranges.front().first;
+
+    if (file.complete)
+      carved_until[k] = end;
+
+    report.files.push_back(std::move(file));
+  }
+
+  return report;
+}
+
+string Carver::read(CarvedFile const& file)
+{
+  string data(file.size, '\0');
+  uint64_t pos = 0;
+
+  for (auto [offset, size] : file.ranges) {
+    read_range(fat32, offset, size, (uint8_t*)&data[pos]);
+    pos += size;
+  }
+
+  return data;
+}
+
+uint64_t Carver::save(CarveReport const& report, string const& out_dir)
+{
+  TraceSpan span("Carver::save");
+
+  uint32_t sector_size = fat32.get_super_block()->get_sector_size();
+  uint64_t written = 0;
+
+  create_dirs(out_dir);
+
+  for (auto& file : report.files) {
+    if (!file.complete)
+      continue;
+
+    write_file(out_dir + "/f" + to_string(file.offset / sector_size) + "." + file.ext, read(file));
+    written++;
+  }
+
+  return written;
+}
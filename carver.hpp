@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fat32.hpp"
+
+using namespace std;
+
+struct CarvedFile
+{
+  string type;                // "jpeg", "png", "pdf", "zip"
+  string ext;
+  uint64_t offset;            // image offset of the header
+  uint64_t size;
+  bool complete;              // false: no footer within the size limit of the type
+
+  // (image offset, length) pieces, the free clusters the file is assumed to run through
+  vector<pair<uint64_t, uint64_t>> ranges;
+};
+
+struct CarveReport
+{
+  vector<CarvedFile> files;
+
+  uint64_t free_cluster_cnt = 0;
+  uint64_t free_run_cnt = 0;
+  uint64_t bytes_scanned = 0;
+  uint64_t match_cnt = 0;     // headers and footers
+};
+
+//
+// Signature carving over the unallocated clusters. The free clusters, in
+// cluster order, are treated as one stream, so a file that was fragmented
+// around clusters still in use is carved whole. The stream is split into
+// thread_cnt parts; every part is scanned with one Aho-Corasick automaton
+// for all headers and footers, carrying on a few bytes past its end so that
+// a signature spanning the boundary (or a cluster boundary) is found once.
+// Headers are then paired with footers in stream order: JPEG counts nested
+// SOI/EOI markers (EXIF thumbnails), PNG ends at IEND, PDF at the last %%EOF
+// before the next PDF header, ZIP behind the end of central directory record.
+//
+class Carver
+{
+  public:
+    Carver(FAT32& fat32, unsigned thread_cnt = 0);
+
+  public:
+    CarveReport run();
+
+    string read(CarvedFile const& file);
+    // the complete files of report as out_dir/f<sector>.<ext>, returns the number written
+    uint64_t save(CarveReport const& report, string const& out_dir);
+
+  private:
+    FAT32& fat32;
+    unsigned thread_cnt;
+};
@@ -0,0 +1,100 @@
+#include "cluster_map.hpp"
+
+#include <algorithm>
+
+
+void ClusterMap::add_entry(DirectoryEntry *dentry)
+{
+  uint32_t entry_id = entries.size();
+  entries.push_back(dentry);
+
+  for (auto& extent : fat32.to_extents(dentry->get_start_cluster_no()))
+    intervals.push_back({extent.cluster, extent.count, entry_id, extent.logical});
+
+  for (auto child : dentry->get_children())
+    add_entry(child);
+}
+
+void ClusterMap::build()
+{
+  TraceSpan span("ClusterMap::build");
+
+  if (fat32.get_root_dir() == nullptr)
+    fat32.build();
+
+  intervals.clear();
+  entries.clear();
+  add_entry(fat32.get_root_dir());
+
+  sort(intervals.begin(), intervals.end(),
+      [](Interval const& a, Interval const& b) { return a.first < b.first; });
+  intervals.shrink_to_fit();
+  entries.shrink_to_fit();
+
+  reach.resize(intervals.size());
+  for (size_t i = 0; i < intervals.size(); i++)
+    reach[i] = max(i > 0 ? reach[i - 1] : 0, intervals[i].first + intervals[i].count);
+}
+
+vector<ClusterMap::Owner> ClusterMap::find_cluster(uint32_t cluster_no)
+{
+  vector<Owner> owners;
+  uint32_t cluster_size = fat32.get_super_block()->get_cluster_size();
+
+  // intervals starting at or before cluster_no, back to where none before reaches it
+  size_t i = upper_bound(intervals.begin(), intervals.end(), cluster_no,
+      [](uint32_t c, Interval const& i) { return c < i.first; }) - intervals.begin();
+
+  while (i > 0 && reach[i - 1] > cluster_no) {
+    Interval const& interval = intervals[--i];
+    if (cluster_no - interval.first >= interval.count)
+      continue;
+
+    Owner owner;
+    owner.dentry = entries[interval.entry_id];
+    owner.cluster = cluster_no;
+    owner.file_offset = (uint64_t)(interval.logical + cluster_no - interval.first) * cluster_size;
+    owner.region = "data";
+    owners.push_back(owner);
+  }
+
+  if (owners.empty()) {
+    Owner owner;
+    owner.cluster = cluster_no;
+    owner.region = "data";
+    owners.push_back(owner);
+  }
+
+  // in interval order
+  reverse(owners.begin(), owners.end());
+
+  return owners;
+}
+
+vector<ClusterMap::Owner> ClusterMap::find_offset(uint64_t offset)
+{
+  SuperBlock *super_block = fat32.get_super_block();
+  uint32_t cluster_no = fat32.cal_cluster_no(offset);
+
+  if (cluster_no == 0) {
+    Owner owner;
+    uint64_t fat_size = (uint64_t)super_block->get_fat_sector_no() * super_block->get_sector_size();
+
+    if (offset < super_block->get_fat_offset())
+      owner.region = "reserved sectors";
+    else if (offset < super_block->get_data_area_addr())
+      owner.region = "FAT #" + to_string((offset - super_block->get_fat_offset()) / fat_size + 1);
+    else
+      owner.region = "past the last cluster";
+
+    return { owner };
+  }
+
+  vector<Owner> owners = find_cluster(cluster_no);
+  for (auto& owner : owners) {
+    if (owner.dentry != nullptr)
+      owner.file_offset += offset - fat32.cal_data_offset(cluster_no);
+  }
+
+  return owners;
+}
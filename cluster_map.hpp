@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fat32.hpp"
+
+using namespace std;
+
+//
+// Cluster -> owning entry index. Each extent of each chain is one interval,
+// sorted by cluster, so a lookup is a binary search and the size follows
+// the number of extents rather than the number of clusters. Intervals
+// overlap where chains are cross-linked; the running maximum of their ends
+// bounds how far back a lookup has to look for all owners.
+//
+class ClusterMap
+{
+  public:
+    struct Owner
+    {
+      DirectoryEntry *dentry = nullptr;   // nullptr: not owned by any entry
+      uint32_t cluster = 0;
+      uint64_t file_offset = 0;           // of the looked up byte (or cluster start) within the file
+      string region;                      // "data", or where a byte before the data area lies
+    };
+
+  public:
+    ClusterMap(FAT32& fat32) : fat32(fat32) {}
+
+  public:
+    // one pass over the chains of every file and directory in the tree
+    void build();
+
+    // every entry owning the cluster (more than one on a cross-linked volume),
+    // or a single Owner with dentry nullptr if none does
+    vector<Owner> find_cluster(uint32_t cluster_no);
+    // by byte offset into the image
+    vector<Owner> find_offset(uint64_t offset);
+
+    size_t get_interval_cnt() { return intervals.size(); }
+    size_t get_memory_size()
+    {
+      return intervals.capacity() * sizeof(Interval) + reach.capacity() * sizeof(uint32_t)
+           + entries.capacity() * sizeof(DirectoryEntry*);
+    }
+
+  private:
+    struct Interval
+    {
+      uint32_t first;
+      uint32_t count;
+      uint32_t entry_id;
+      uint32_t logical;                   // cluster index of first within the file
+    };
+
+    void add_entry(DirectoryEntry *dentry);
+
+  private:
+    FAT32& fat32;
+    vector<Interval> intervals;
+    vector<uint32_t> reach;               // largest first + count of intervals[0..i]
+    vector<DirectoryEntry*> entries;
+};
@@ -0,0 +1,270 @@
+#include "defrag.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "fsck.hpp"
+
+
+// data copied per read/write pair
+static constexpr uint64_t BATCH_BYTES = 8 << 20;
+// moved data after which the old clusters are freed up for reuse
+static constexpr uint64_t CHECKPOINT_BYTES = 256 << 20;
+
+static bool is_contiguous(vector<uint32_t> const& chain)
+{
+  for (size_t i = 1; i < chain.size(); i++) {
+    if (chain[i] != chain[i - 1] + 1)
+      return false;
+  }
+
+  return true;
+}
+
+static uint32_t extent_cnt(vector<uint32_t> const& chain)
+{
+  uint32_t cnt = chain.empty() ? 0 : 1;
+
+  for (size_t i = 1; i < chain.size(); i++)
+    cnt += chain[i] != chain[i - 1] + 1;
+
+  return cnt;
+}
+
+DefragReport Defragmenter::run()
+{
+  TraceSpan span("Defragmenter::run");
+
+  fat32.check_writable();
+
+  if (fat32.get_root_dir() == nullptr)
+    fat32.build();
+
+  // moving clusters of a cross-linked or looping chain would corrupt the other owner
+  FsckReport fsck = Fsck(fat32).run();
+  if (!fsck.is_clean())
+    throw runtime_error(to_string(fsck.issues.size()) + " fsck issues on " + fat32.get_image_path() + ", repair them first");
+
+  DefragReport report;
+  cursor = fat32.get_super_block()->get_root_cluster_addr();
+  defrag_dir(fat32.get_root_dir(), report);
+  checkpoint();
+
+  return report;
+}
+
+void Defragmenter::defrag_dir(DirectoryEntry *dir, DefragReport& report)
+{
+  uint32_t cluster_size = fat32.get_super_block()->get_cluster_size();
+
+  auto dir_chain = fat32.chain(dir->get_start_cluster_no());
+  report.dir_extents_before += extent_cnt(dir_chain);
+
+  if (dir->get_parent() != nullptr && !is_contiguous(dir_chain)) {
+    uint32_t first = move_dir(dir, dir_chain, cursor);
+    if (first != 0) {
+      dir_chain = fat32.chain(first);
+      report.dirs_moved++;
+      report.clusters_moved += dir_chain.size();
+    } else {
+      report.skipped++;
+    }
+  }
+
+  report.dir_extents_after += extent_cnt(dir_chain);
+  if (!dir_chain.empty())
+    cursor = dir_chain.back() + 1;
+
+  // the files right behind their directory, in directory order
+  for (auto child : dir->get_children()) {
+    if (child->is_dir() || child->get_start_cluster_no() == 0)
+      continue;
+
+    auto file_chain = fat32.chain(child->get_start_cluster_no());
+    report.file_extents_before += extent_cnt(file_chain);
+
+    if (!is_contiguous(file_chain)) {
+      uint32_t first = move_file(file_chain, cursor);
+      if (first != 0) {
+        set_start_cluster(child, first);
+        file_chain = fat32.chain(first);
+        cursor = file_chain.back() + 1;
+        report.files_moved++;
+        report.clusters_moved += file_chain.size();
+      } else {
+        report.skipped++;
+      }
+    }
+
+    report.file_extents_after += extent_cnt(file_chain);
+  }
+
+  if ((uint64_t)fat32.pending_free.size() * cluster_size >= CHECKPOINT_BYTES)
+    checkpoint();
+
+  for (auto child : dir->get_children()) {
+    if (child->is_dir())
+      defrag_dir(child, report);
+  }
+}
+
+// a contiguous run of count clusters; when there is none, freeing what has been moved so far may make one
+uint32_t Defragmenter::allocate(uint32_t count, uint32_t hint)
+{
+  uint32_t first = fat32.free_space().allocate_run(count, hint);
+
+  if (first == 0 && !fat32.pending_free.empty()) {
+    checkpoint();
+    first = fat32.free_space().allocate_run(count, hint);
+  }
+
+  return first;
+}
+
+//
+// Reads the old clusters in as few reads as the chain allows, at most
+// BATCH_BYTES at a time, and writes each batch with one sequential write.
+//
+uint32_t Defragmenter::move_file(vector<uint32_t> const& chain, uint32_t hint)
+{
+  TraceSpan span("Defragmenter::move_file", "cluster", chain.front());
+
+  uint32_t first = allocate(chain.size(), hint);
+  if (first == 0)
+    return 0;
+
+  uint32_t cluster_size = fat32.get_super_block()->get_cluster_size();
+  uint32_t batch = max<uint64_t>(1, BATCH_BYTES / cluster_size);
+  vector<uint8_t> buffer((uint64_t)min<size_t>(batch, chain.size()) * cluster_size);
+
+  for (size_t i = 0; i < chain.size(); i += batch) {
+    size_t end = min<size_t>(i + batch, chain.size());
+
+    for (size_t k = i; k < end; ) {
+      size_t run = 1;
+      while (k + run < end && chain[k + run] == chain[k] + run)
+        run++;
+
+      fat32.read_at(&buffer[(k - i) * cluster_size], run * cluster_size, fat32.cal_data_offset(chain[k]));
+      k += run;
+    }
+
+    fat32.write_at(buffer.data(), (end - i) * cluster_size, fat32.cal_data_offset(first + i));
+  }
+
+  fat32.stats.add(FAT32Stats::CLUSTERS_READ, chain.size());
+  relink(chain, first);
+
+  return first;
+}
+
+//
+// Directory clusters move through the cache, they may hold unflushed entries.
+// The "." entry, the ".." entries of the subdirectories and the locations the
+// tree keeps for the children follow the clusters.
+//
+uint32_t Defragmenter::move_dir(DirectoryEntry *dir, vector<uint32_t> const& chain, uint32_t hint)
+{
+  TraceSpan span("Defragmenter::move_dir", "cluster", chain.front());
+
+  uint32_t first = allocate(chain.size(), hint);
+  if (first == 0)
+    return 0;
+
+  uint32_t slot_cnt = fat32.get_super_block()->get_cluster_size() / 0x20;
+  unordered_map<uint32_t, uint32_t> moved;
+
+  for (size_t i = 0; i < chain.size(); i++) {
+    vector<uint8_t> buffer = std::move(fat32.dir_cluster(chain[i]));
+    fat32.dir_cache.erase(chain[i]);
+    fat32.dirty_dir_clusters.erase(chain[i]);
+
+    fat32.dir_cache[first + i] = std::move(buffer);
+    fat32.dirty_dir_clusters.insert(first + i);
+    moved[chain[i]] = first + i;
+  }
+
+  for (size_t i = 0; i < chain.size(); i++) {
+    vector<uint8_t>& buffer = fat32.dir_cache[first + i];
+
+    for (uint32_t slot = 0; slot < slot_cnt; slot++) {
+      uint8_t *entry = &buffer[slot * 0x20];
+      if (entry[0] == 0x00)
+        break;
+      if (entry[0] == 0xE5 || entry[0x0B] == 0x0F || (entry[0x0B] & 0x10) == 0)
+        continue;
+
+      sys::io::byte_buffer bb(entry, 0x20);
+
+      if (memcmp(entry, ".          ", 11) == 0) {
+        bb.put_uint16_le(first >> 16, 0x14);
+        bb.put_uint16_le(first & 0xFFFF, 0x1A);
+        continue;
+      }
+      if (entry[0] == '.')
+        continue;
+
+      // ".." of a subdirectory, hidden ones included
+      uint32_t sub = ((uint32_t)bb.get_uint16_le(0x14) << 16) | bb.get_uint16_le(0x1A);
+      if (sub < 2 || sub > fat32.get_super_block()->get_cluster_cnt() + 1 || moved.count(sub))
+        continue;
+
+      vector<uint8_t>& sub_buffer = fat32.dir_cluster(sub);
+      if (memcmp(&sub_buffer[0x20], "..         ", 11) == 0) {
+        sys::io::byte_buffer sub_bb(&sub_buffer[0x20], 0x20);
+        sub_bb.put_uint16_le(first >> 16, 0x14);
+        sub_bb.put_uint16_le(first & 0xFFFF, 0x1A);
+        fat32.dirty_dir_clusters.insert(sub);
+      }
+    }
+  }
+
+  for (auto child : dir->get_children()) {
+    child->set_location(moved[child->get_entry_cluster()], child->get_entry_slot());
+    for (auto& slot : child->get_lfn_slots())
+      slot.first = moved[slot.first];
+  }
+
+  fat32.dir_free_hint.erase(chain.front());
+  fat32.visited_dirs.erase(chain.front());
+  fat32.visited_dirs.insert(first);
+
+  relink(chain, first);
+  set_start_cluster(dir, first);
+
+  return first;
+}
+
+// the new run replaces chain in the FAT, the old clusters wait for checkpoint()
+void Defragmenter::relink(vector<uint32_t> const& chain, uint32_t first)
+{
+  for (uint32_t c : chain) {
+    fat32.set_fat(c, 0);
+    fat32.pending_free.push_back(c);
+  }
+
+  fat32.link_runs({{first, (uint32_t)chain.size()}}, 0);
+}
+
+// only the start cluster changes, the timestamps of the entry stay as they are
+void Defragmenter::set_start_cluster(DirectoryEntry *dentry, uint32_t first)
+{
+  vector<uint8_t>& buffer = fat32.dir_cluster(dentry->get_entry_cluster());
+  sys::io::byte_buffer bb(&buffer[dentry->get_entry_slot() * 0x20], 0x20);
+
+  bb.put_uint16_le(first >> 16, 0x14);
+  bb.put_uint16_le(first & 0xFFFF, 0x1A);
+  fat32.dirty_dir_clusters.insert(dentry->get_entry_cluster());
+
+  dentry->set_start_cluster_no(first);
+}
+
+void Defragmenter::checkpoint()
+{
+  TraceSpan span("Defragmenter::checkpoint");
+
+  // flush() hands the old clusters back to the free space once the FAT no longer has them
+  fat32.flush();
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fat32.hpp"
+
+using namespace std;
+
+struct DefragReport
+{
+  uint64_t file_extents_before = 0;
+  uint64_t file_extents_after = 0;
+  uint64_t dir_extents_before = 0;
+  uint64_t dir_extents_after = 0;
+
+  uint64_t files_moved = 0;
+  uint64_t dirs_moved = 0;
+  uint64_t clusters_moved = 0;
+  uint64_t skipped = 0;               // fragmented, but no free run was long enough
+};
+
+//
+// Offline defragmenter. Walks the tree depth first; a fragmented directory is
+// moved into the first free run from the end of the previous one, and the
+// fragmented files of a directory into the free space right behind it. Data is
+// copied in large sequential batches before the FAT and the start cluster of
+// the entry are switched over. The old clusters are only handed back to the
+// allocator after the next flush(), so the image never refers to clusters that
+// have been reused. The root directory stays where the boot sector says it is.
+//
+class Defragmenter
+{
+  public:
+    Defragmenter(FAT32& fat32) : fat32(fat32) {}
+
+  public:
+    // the volume has to be writable and check clean (see Fsck)
+    DefragReport run();
+
+  private:
+    void defrag_dir(DirectoryEntry *dir, DefragReport& report);
+
+    // copies chain into a contiguous run, returns its first cluster or 0
+    uint32_t move_file(vector<uint32_t> const& chain, uint32_t hint);
+    uint32_t move_dir(DirectoryEntry *dir, vector<uint32_t> const& chain, uint32_t hint);
+    uint32_t allocate(uint32_t count, uint32_t hint);
+    void relink(vector<uint32_t> const& chain, uint32_t first);
+    void set_start_cluster(DirectoryEntry *dentry, uint32_t first);
+
+    void checkpoint();
+
+  private:
+    FAT32& fat32;
+
+    uint32_t cursor = 2;
+};
@@ -0,0 +1,1699 @@
+#include "fat32.hpp"
+#include "file_reader.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <climits>
+#include <codecvt>
+#include <locale>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+static bool is_short_char(char c)
+{
+  return isalnum((unsigned char)c) || strchr("$%'-_@~`!(){}^#&", c) != nullptr;
+}
+
+// "leaf.jpg" -> "LEAF    JPG", empty if name needs a long name
+static string to_short_name(string const& name)
+{
+  auto dot = name.rfind('.');
+  string base = dot == string::npos ? name : name.substr(0, dot);
+  string ext = dot == string::npos ? "" : name.substr(dot + 1);
+
+  if (base.empty() || base.size() > 8 || ext.size() > 3)
+    return "";
+
+  for (char c : base + ext) {
+    if (!is_short_char(c))
+      return "";
+  }
+
+  string res = base + string(8 - base.size(), ' ') + ext + string(3 - ext.size(), ' ');
+  for (auto& c : res)
+    c = toupper((unsigned char)c);
+
+  return res;
+}
+
+uint8_t lfn_checksum(uint8_t const *short_name)
+{
+  uint8_t sum = 0;
+
+  for (int i = 0; i < 11; i++)
+    sum = ((sum & 1) << 7) + (sum >> 1) + short_name[i];
+
+  return sum;
+}
+
+// collects the 13 characters of one long name entry into lfn
+static void read_lfn_part(uint8_t *slot, u16string& lfn, uint8_t& sum)
+{
+  static constexpr int char_at[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+  sys::io::byte_buffer bb(slot, 0x20);
+
+  uint8_t seq = slot[0];
+  size_t part = (seq & 0x1F);
+  if (part == 0)
+    return;
+
+  // the last part comes first and starts a new name
+  if (seq & 0x40) {
+    lfn.assign(part * 13, 0xFFFF);
+    sum = slot[13];
+  }
+
+  if (part * 13 > lfn.size())
+    return;
+
+  for (int k = 0; k < 13; k++)
+    lfn[(part - 1) * 13 + k] = bb.get_uint16_le(char_at[k]);
+}
+
+string decode_lfn(u16string const& lfn)
+{
+  size_t len = 0;
+  while (len < lfn.size() && lfn[len] != 0x0000 && lfn[len] != 0xFFFF)
+    len++;
+
+  vector<uint8_t> bytes(len * 2);
+  sys::io::byte_buffer bb(bytes.data(), (int)bytes.size());
+  for (size_t i = 0; i < len; i++)
+    bb.put_uint16_le(lfn[i]);
+
+  bb.reset();
+  return bb.get_unicode16_le(len);
+}
+
+static void to_fat_time(time_t t, uint16_t& date, uint16_t& time)
+{
+  tm lt;
+  localtime_r(&t, &lt);
+
+  date = ((lt.tm_year - 80) << 9) | ((lt.tm_mon + 1) << 5) | lt.tm_mday;
+  time = (lt.tm_hour << 11) | (lt.tm_min << 5) | (lt.tm_sec / 2);
+}
+
+time_t from_fat_time(uint16_t date, uint16_t time)
+{
+  if (date == 0)
+    return 0;
+
+  tm lt = {};
+  lt.tm_year = (date >> 9) + 80;
+  lt.tm_mon = ((date >> 5) & 0x0F) - 1;
+  lt.tm_mday = date & 0x1F;
+  lt.tm_hour = time >> 11;
+  lt.tm_min = (time >> 5) & 0x3F;
+  lt.tm_sec = (time & 0x1F) * 2;
+  lt.tm_isdst = -1;
+
+  return mktime(&lt);
+}
+
+static void delete_tree(DirectoryEntry *dentry)
+{
+  if (dentry == nullptr)
+    return;
+
+  for (auto child : dentry->get_loaded_children())
+    delete_tree(child);
+
+  delete dentry;
+}
+
+
+FreeSpace::FreeSpace(vector<uint32_t>& clusters, uint32_t cluster_cnt)
+{
+  max_cluster = cluster_cnt + 1;
+  bits.assign(max_cluster / 64 + 1, 0);
+
+  // 0 and 1 are reserved, anything past the last cluster is never free
+  bits[0] |= 0x3;
+  for (uint32_t c = max_cluster + 1; c < bits.size() * 64; c++)
+    bits[c / 64] |= 1ULL << (c % 64);
+
+  for (uint32_t c = 2; c <= max_cluster; c++) {
+    if ((clusters[c] & 0x0FFFFFFF) != 0)
+      bits[c / 64] |= 1ULL << (c % 64);
+    else
+      free_cnt++;
+  }
+}
+
+bool FreeSpace::is_free(uint32_t cluster_no)
+{
+  if (cluster_no > max_cluster)
+    return false;
+
+  return ((bits[cluster_no / 64] >> (cluster_no % 64)) & 1) == 0;
+}
+
+// first free cluster at or after from, max_cluster + 1 if there is none
+uint32_t FreeSpace::find_free(uint32_t from)
+{
+  size_t w = from / 64;
+  if (w >= bits.size())
+    return max_cluster + 1;
+
+  uint64_t word = ~bits[w] & (~0ULL << (from % 64));
+  while (word == 0) {
+    if (++w >= bits.size())
+      return max_cluster + 1;
+    word = ~bits[w];
+  }
+
+  return min<uint32_t>(w * 64 + countr_zero(word), max_cluster + 1);
+}
+
+// first used cluster at or after from, the scan gives up at limit
+uint32_t FreeSpace::find_used(uint32_t from, uint32_t limit)
+{
+  limit = min(limit, max_cluster + 1);
+  size_t w = from / 64;
+  if (w >= bits.size() || from >= limit)
+    return limit;
+
+  uint64_t word = bits[w] & (~0ULL << (from % 64));
+  while (word == 0) {
+    if (++w >= bits.size() || w * 64 >= limit)
+      return limit;
+    word = bits[w];
+  }
+
+  return min<uint32_t>(w * 64 + countr_zero(word), limit);
+}
+
+void FreeSpace::take(uint32_t first, uint32_t len, vector<pair<uint32_t, uint32_t>>& runs)
+{
+  for (uint32_t c = first; c < first + len; c++)
+    bits[c / 64] |= 1ULL << (c % 64);
+
+  free_cnt -= len;
+  next_free = first + len;
+
+  if (!runs.empty() && runs.back().first + runs.back().second == first)
+    runs.back().second += len;
+  else
+    runs.push_back({first, len});
+}
+
+vector<pair<uint32_t, uint32_t>> FreeSpace::allocate(uint32_t count, uint32_t hint)
+{
+  vector<pair<uint32_t, uint32_t>> runs;
+  uint32_t need = count;
+  uint32_t end = max_cluster + 1;
+
+  if (count == 0)
+    return runs;
+
+  if (count > free_cnt)
+    throw runtime_error("no free clusters left");
+
+  // grow in place right behind the hint (the last cluster of a file)
+  if (hint >= 2 && is_free(hint)) {
+    uint32_t len = find_used(hint, hint + need) - hint;
+    take(hint, len, runs);
+    need -= len;
+  }
+
+  // next fit: the first run long enough after next_free, then from the start
+  for (int pass = 0; pass < 2 && need > 0; pass++) {
+    uint32_t c = pass == 0 ? next_free : 2;
+    uint32_t stop = pass == 0 ? end : next_free;
+
+    while (c < stop) {
+      uint32_t first = find_free(c);
+      if (first >= stop)
+        break;
+
+      uint32_t last = find_used(first, first + need);
+      if (last - first >= need) {
+        take(first, need, runs);
+        return runs;
+      }
+      c = last;
+    }
+  }
+
+  // no run is long enough, fill holes in address order
+  for (uint32_t c = 2; need > 0; ) {
+    uint32_t first = find_free(c);
+    if (first >= end)
+      break;
+
+    uint32_t len = find_used(first, first + need) - first;
+    take(first, len, runs);
+    need -= len;
+    c = first + len;
+  }
+
+  return runs;
+}
+
+uint32_t FreeSpace::allocate_run(uint32_t count, uint32_t hint)
+{
+  uint32_t end = max_cluster + 1;
+  hint = hint < 2 || hint >= end ? 2 : hint;
+
+  if (count == 0 || count > free_cnt)
+    return 0;
+
+  for (int pass = 0; pass < 2; pass++) {
+    uint32_t c = pass == 0 ? hint : 2;
+    uint32_t stop = pass == 0 ? end : hint;
+
+    while (c < stop) {
+      uint32_t first = find_free(c);
+      if (first >= stop)
+        break;
+
+      uint32_t last = find_used(first, first + count);
+      if (last - first >= count) {
+        vector<pair<uint32_t, uint32_t>> runs;
+        take(first, count, runs);
+        return first;
+      }
+      c = last;
+    }
+  }
+
+  return 0;
+}
+
+void FreeSpace::release(uint32_t cluster_no)
+{
+  if (cluster_no < 2 || cluster_no > max_cluster || is_free(cluster_no))
+    return;
+
+  bits[cluster_no / 64] &= ~(1ULL << (cluster_no % 64));
+  free_cnt++;
+}
+
+
+uint32_t FatArea::get_entry(uint32_t cluster_no)
+{
+  if (loaded.load(memory_order_acquire))
+    return clusters_vec[cluster_no];
+
+  lock_guard<mutex> guard(lock);
+  if (loaded.load(memory_order_relaxed))
+    return clusters_vec[cluster_no];
+
+  uint32_t per_sector = sector_size / 4;
+  auto it = sectors.find(cluster_no / per_sector);
+
+  if (it == sectors.end()) {
+    // a walk over much of the FAT is better off with all of it
+    if (sectors.size() == SECTOR_CACHE_MAX) {
+      load_locked();
+      return clusters_vec[cluster_no];
+    }
+
+    vector<uint32_t> entries(per_sector);
+    reader(entries.data(), sector_size, (uint64_t)(cluster_no / per_sector) * sector_size);
+    for (auto& e : entries)
+      e = le32toh(e);
+    it = sectors.emplace(cluster_no / per_sector, std::move(entries)).first;
+  }
+
+  return it->second[cluster_no % per_sector];
+}
+
+void FatArea::load()
+{
+  if (loaded.load(memory_order_acquire))
+    return;
+
+  lock_guard<mutex> guard(lock);
+  load_locked();
+}
+
+void FatArea::load_locked()
+{
+  if (loaded.load(memory_order_relaxed))
+    return;
+
+  clusters_vec.resize(size / 4);
+  reader(clusters_vec.data(), clusters_vec.size() * 4, 0);
+  for (auto& e : clusters_vec)
+    e = le32toh(e);
+
+  sectors.clear();
+  loaded.store(true, memory_order_release);
+}
+
+
+FAT32::FAT32(string path, bool writable)
+  : image_path(path), writable(writable)
+{
+  TraceSpan span("FAT32::FAT32");
+
+  fd = open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    throw runtime_error("error reading file: " + path);
+
+  // a crash during flush() leaves a committed batch behind, apply it before reading anything
+  struct stat st;
+  if (stat((path + ".wal").c_str(), &st) == 0 && st.st_size > 0) {
+    if (writable) {
+      WriteAheadLog log(path + ".wal");
+      if (log.replay(fd))
+        cerr << "replayed write-ahead log " << log.get_path() << endl;
+    } else {
+      cerr << "warning: " << path << ".wal may hold unapplied changes, open writable to replay it" << endl;
+    }
+  }
+
+  // Super Block/Boot Record
+  {
+    FAT32Stats::PhaseTimer timer(stats, FAT32Stats::BOOT_SECTOR);
+    char buffer[96] = {0};
+    read_at(buffer, 96, 0);
+    super_block = new SuperBlock((uint8_t*)buffer, 96);
+  }
+
+  // FAT area, read when it is first needed
+  size_t fat_size = (size_t)super_block->get_fat_sector_no() * super_block->get_sector_size() * super_block->get_fat_no();
+  auto fat_reader = [this](void *buffer, size_t size, uint64_t offset) {
+    FAT32Stats::PhaseTimer timer(stats, FAT32Stats::FAT_LOAD);
+    read_at(buffer, size, super_block->get_fat_offset() + offset);
+  };
+  fat_area = new FatArea(fat_reader, fat_size, super_block->get_fat_no(), super_block->get_sector_size());
+}
+
+FAT32::~FAT32()
+{
+  try {
+    flush();
+  } catch (exception const& e) {
+    cerr << "error flushing " << image_path << ": " << e.what() << endl;
+  }
+
+  if (fd >= 0)
+    close(fd);
+
+  if (wal != nullptr && wal->get_record_cnt() == 0)
+    unlink(wal->get_path().c_str());
+
+  delete wal;
+  delete_tree(root_dir);
+  delete free_map;
+  delete fat_area;
+  delete super_block;
+}
+
+void FAT32::build(bool lazy)
+{
+  TraceSpan span("FAT32::build");
+  FAT32Stats::PhaseTimer timer(stats, FAT32Stats::TREE_BUILD);
+
+  name_index.clear();
+  delete_tree(root_dir);
+
+  root_dir = new DirectoryEntry();
+  root_dir->set_path("root_inode");
+  root_dir->set_attribute(0x10);
+  root_dir->set_file_size(0);
+  root_dir->set_start_cluster_no(super_block->get_root_cluster_addr());
+
+  visited_dirs.clear();
+  visited_dirs.insert(super_block->get_root_cluster_addr());
+  parsed_dir_clusters.clear();
+  this->lazy = lazy;
+
+  build_dir_tree(root_dir, super_block->get_root_cluster_addr());
+}
+
+// reading one directory must not race with another being read or looked up in
+void FAT32::load_children(DirectoryEntry *dir)
+{
+  unique_lock<shared_mutex> guard(tree_lock);
+  FAT32Stats::PhaseTimer timer(stats, FAT32Stats::TREE_BUILD);
+
+  build_dir_tree(dir, dir->get_start_cluster_no());
+}
+
+DirectoryEntry* FAT32::build_subtree(uint32_t cluster_no)
+{
+  if (root_dir == nullptr)
+    build();
+
+  DirectoryEntry *dentry = new DirectoryEntry();
+  dentry->set_attribute(0x10);
+  dentry->set_file_size(0);
+  dentry->set_start_cluster_no(cluster_no);
+
+  if (visited_dirs.insert(cluster_no).second)
+    build_dir_tree(dentry, cluster_no);
+
+  return dentry;
+}
+
+void FAT32::delete_subtree(DirectoryEntry *dentry)
+{
+  if (dentry == nullptr)
+    return;
+
+  for (auto child : dentry->get_loaded_children()) {
+    unindex_entry(child);
+    delete_subtree(child);
+  }
+
+  delete dentry;
+}
+
+Node FAT32::to_node(DirectoryEntry *dentry)
+{
+  Node node = Node();
+  node.set_size(dentry->get_file_size());
+  node.set_extents(to_extents(dentry->get_start_cluster_no()));
+  return node;
+}
+
+vector<Extent> FAT32::to_extents(uint32_t cluster_no)
+{
+  TraceSpan span("FAT32::to_extents", "cluster", cluster_no);
+
+  vector<Extent> extents;
+  uint32_t start = cluster_no;
+  uint32_t max_cluster = super_block->get_cluster_cnt() + 1;
+  uint32_t logical = 0;
+
+  // same stop conditions as chain()
+  uint32_t tortoise = 0, tortoise_at = 0;
+  uint64_t power = 1;
+
+  while (cluster_no >= 2 && cluster_no <= max_cluster) {
+    if (cluster_no == tortoise) {
+      // drop what was walked past the first repeated cluster
+      logical = loop_cut(start, logical - tortoise_at);
+      while (extents.back().logical >= logical)
+        extents.pop_back();
+      extents.back().count = min(extents.back().count, logical - extents.back().logical);
+      break;
+    }
+
+    if (!extents.empty() && extents.back().cluster + extents.back().count == cluster_no)
+      extents.back().count++;
+    else
+      extents.push_back({logical, cluster_no, 1});
+
+    if (logical - tortoise_at == power || logical == 0) {
+      tortoise = cluster_no;
+      tortoise_at = logical;
+      power *= 2;
+    }
+
+    logical++;
+    cluster_no = get_fat(cluster_no);
+  }
+
+  stats.add(FAT32Stats::CHAIN_HOPS, logical);
+
+  return extents;
+}
+
+void FAT32::read_cluster(uint32_t cluster_no, uint8_t *buffer)
+{
+  if (cluster_no < 2 || cluster_no > super_block->get_cluster_cnt() + 1)
+    throw out_of_range("cluster " + to_string(cluster_no) + " is outside the data area");
+
+  read_at(buffer, super_block->get_cluster_size(), cal_data_offset(cluster_no));
+  stats.add(FAT32Stats::CLUSTERS_READ);
+}
+
+void FAT32::read_clusters(uint32_t cluster_no, uint32_t count, uint8_t *buffer)
+{
+  if (cluster_no < 2 || (uint64_t)cluster_no + count - 1 > super_block->get_cluster_cnt() + 1)
+    throw out_of_range("clusters " + to_string(cluster_no) + "+" + to_string(count) + " are outside the data area");
+
+  read_at(buffer, (size_t)count * super_block->get_cluster_size(), cal_data_offset(cluster_no));
+  stats.add(FAT32Stats::CLUSTERS_READ, count);
+}
+
+string FAT32::read_file(DirectoryEntry *dentry)
+{
+  TraceSpan span("FAT32::read_file", "cluster", dentry->get_start_cluster_no());
+  FAT32Stats::PhaseTimer timer(stats, FAT32Stats::EXTRACTION);
+
+  return read_contents(dentry);
+}
+
+string FAT32::read_contents(DirectoryEntry *dentry)
+{
+  if (dentry->is_dir())
+    throw runtime_error("not a file: " + dentry->get_name());
+
+  uint32_t cluster_size = super_block->get_cluster_size();
+  string data(dentry->get_file_size(), '\0');
+
+  for (auto& extent : to_extents(dentry->get_start_cluster_no())) {
+    uint64_t pos = (uint64_t)extent.logical * cluster_size;
+    if (pos >= data.size())
+      break;
+
+    size_t n = min<uint64_t>((uint64_t)extent.count * cluster_size, data.size() - pos);
+    read_at(&data[pos], n, cal_data_offset(extent.cluster));
+    stats.add(FAT32Stats::CLUSTERS_READ, (n + cluster_size - 1) / cluster_size);
+  }
+
+  return data;
+}
+
+void create_dirs(string const& path)
+{
+  string curr_path;
+  size_t pos = 0;
+
+  while (pos <= path.size()) {
+    size_t next = path.find('/', pos);
+    if (next == string::npos)
+      next = path.size();
+
+    curr_path = path.substr(0, next);
+    pos = next + 1;
+
+    struct stat info;
+    if (!curr_path.empty() && stat(curr_path.c_str(), &info) != 0 && mkdir(curr_path.c_str(), 0777) != 0)
+      throw runtime_error("error creating directory " + curr_path + ": " + strerror(errno));
+  }
+}
+
+void write_file(string const& path, string const& data)
+{
+  int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0)
+    throw runtime_error("error creating " + path + ": " + strerror(errno));
+
+  size_t pos = 0;
+  while (pos < data.size()) {
+    ssize_t n = write(out, data.data() + pos, data.size() - pos);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      close(out);
+      throw runtime_error("error writing " + path + ": " + strerror(errno));
+    }
+    pos += n;
+  }
+
+  close(out);
+}
+
+void FAT32::extract(DirectoryEntry *dentry, string const& out_dir, ExtractSink *sink)
+{
+  FAT32Stats::PhaseTimer timer(stats, FAT32Stats::EXTRACTION);
+
+  extract_tree(dentry, out_dir, sink);
+}
+
+// files above this size are extracted in pieces of it
+static constexpr size_t EXTRACT_CHUNK = 1 << 20;
+
+void FAT32::extract_tree(DirectoryEntry *dentry, string const& out_dir, ExtractSink *sink)
+{
+  create_dirs(out_dir);
+
+  if (!dentry->is_dir() && dentry->get_file_size() <= EXTRACT_CHUNK) {
+    TraceSpan span("FAT32::extract file", "cluster", dentry->get_start_cluster_no());
+    string data = read_contents(dentry);
+    write_file(out_dir + "/" + safe_name(dentry->get_name()), data);
+
+    if (sink != nullptr) {
+      sink->begin_file(dentry);
+      sink->file_data(data.data(), data.size());
+      sink->end_file();
+    }
+    return;
+  }
+
+  // a large file goes out a chunk at a time, readahead brings in the next
+  // extents while the last chunk is written
+  if (!dentry->is_dir()) {
+    TraceSpan span("FAT32::extract file", "cluster", dentry->get_start_cluster_no());
+    string path = out_dir + "/" + safe_name(dentry->get_name());
+    int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+      throw runtime_error("error creating " + path + ": " + strerror(errno));
+
+    FileReader reader(*this, dentry);
+    vector<char> buffer(EXTRACT_CHUNK);
+    uint64_t offset = 0;
+
+    if (sink != nullptr)
+      sink->begin_file(dentry);
+
+    for (size_t n; (n = reader.read(offset, buffer.size(), buffer.data())) > 0; offset += n) {
+      if (sink != nullptr)
+        sink->file_data(buffer.data(), n);
+
+      for (size_t pos = 0; pos < n; ) {
+        ssize_t w = write(out, buffer.data() + pos, n - pos);
+        if (w < 0 && errno == EINTR)
+          continue;
+        if (w < 0) {
+          close(out);
+          throw runtime_error("error writing " + path + ": " + strerror(errno));
+        }
+        pos += w;
+      }
+    }
+
+    // a chain shorter than the size leaves zeros, like read_contents()
+    if (offset < dentry->get_file_size() && ftruncate(out, dentry->get_file_size()) != 0) {
+      close(out);
+      throw runtime_error("error writing " + path + ": " + strerror(errno));
+    }
+
+    close(out);
+
+    if (sink != nullptr) {
+      memset(buffer.data(), 0, buffer.size());
+      for (; offset < dentry->get_file_size(); offset += buffer.size())
+        sink->file_data(buffer.data(), min<uint64_t>(buffer.size(), dentry->get_file_size() - offset));
+      sink->end_file();
+    }
+    return;
+  }
+
+  string path = dentry == root_dir ? out_dir : out_dir + "/" + safe_name(dentry->get_name());
+  create_dirs(path);
+
+  for (auto child : dentry->get_children())
+    extract_tree(child, path, sink);
+}
+
+vector<uint32_t> FAT32::chain(uint32_t cluster_no)
+{
+  vector<uint32_t> clusters;
+  uint32_t start = cluster_no;
+  uint32_t max_cluster = super_block->get_cluster_cnt() + 1;
+
+  // stops on end of chain, free/bad/out of range links, and before the first
+  // cluster a loop would repeat (Brent: the loop shows up when the chain
+  // comes back to the cluster kept at the last power of two)
+  uint32_t tortoise = 0;
+  size_t tortoise_at = 0, power = 1;
+
+  while (cluster_no >= 2 && cluster_no <= max_cluster) {
+    if (cluster_no == tortoise) {
+      clusters.resize(loop_cut(start, clusters.size() - tortoise_at));
+      break;
+    }
+
+    clusters.push_back(cluster_no);
+    if (clusters.size() - 1 - tortoise_at == power || clusters.size() == 1) {
+      tortoise = cluster_no;
+      tortoise_at = clusters.size() - 1;
+      power *= 2;
+    }
+
+    cluster_no = get_fat(cluster_no);
+  }
+
+  stats.add(FAT32Stats::CHAIN_HOPS, clusters.size());
+
+  return clusters;
+}
+
+// the number of distinct clusters of a chain from start that loops, with a loop of loop_len clusters
+uint32_t FAT32::loop_cut(uint32_t start, uint32_t loop_len)
+{
+  uint32_t tortoise = start, hare = start;
+  for (uint32_t i = 0; i < loop_len; i++)
+    hare = get_fat(hare);
+
+  uint32_t head_len = 0;
+  for (; tortoise != hare; head_len++) {
+    tortoise = get_fat(tortoise);
+    hare = get_fat(hare);
+  }
+
+  return head_len + loop_len;
+}
+
+DirectoryEntry* FAT32::lookup(string const& path)
+{
+  if (root_dir == nullptr)
+    build();
+
+  DirectoryEntry *dentry = root_dir;
+  size_t pos = 0;
+
+  while (dentry != nullptr && pos < path.size()) {
+    size_t next = path.find('/', pos);
+    if (next == string::npos)
+      next = path.size();
+
+    string name = path.substr(pos, next - pos);
+    pos = next + 1;
+
+    if (name.empty())
+      continue;
+
+    dentry = find_child(dentry, name);
+  }
+
+  return dentry;
+}
+
+void FAT32::build_dir_tree(DirectoryEntry *parent_entry, uint32_t dir_cluster_no)
+{
+  TraceSpan span("FAT32::build_dir_tree", "cluster", dir_cluster_no);
+
+  uint32_t slot_cnt = super_block->get_cluster_size() / 0x20; // directory entry size
+
+  // long name parts seen before the next short entry
+  u16string lfn;
+  uint8_t lfn_sum = 0;
+  vector<pair<uint32_t, uint32_t>> lfn_slots;
+
+  vector<uint32_t> clusters = chain(dir_cluster_no);
+
+  // a directory is read front to back, the clusters after the first one not
+  // cached yet are asked for before the first is parsed, a hint per run
+  uint32_t cluster_size = super_block->get_cluster_size();
+  for (size_t i = 1, j; i < clusters.size(); i = j) {
+    for (j = i; j < clusters.size() && !dir_cache.count(clusters[j]) && clusters[j] == clusters[i] + (j - i); j++)
+      ;
+    if (j > i)
+      prefetch(cal_data_offset(clusters[i]), (uint64_t)(j - i) * cluster_size);
+    else
+      j++;
+  }
+
+  for (uint32_t cluster_no : clusters) {
+    // a cluster cross-linked into another directory's chain is read with that one only
+    if (!parsed_dir_clusters.insert(cluster_no).second)
+      return;
+
+    vector<uint8_t>& buffer = dir_cluster(cluster_no);
+
+    for (uint32_t slot = 0; slot < slot_cnt; slot++) {
+      uint8_t *child_direntry_buffer = &buffer[slot * 0x20];
+
+      // Check for the end of the children list
+      if (child_direntry_buffer[0] == 0x00) {
+        return;
+      }
+
+      uint8_t attribute = child_direntry_buffer[0x0B];
+
+      if (attribute == 0x0F && child_direntry_buffer[0] != 0xE5) { // LFN part
+        read_lfn_part(child_direntry_buffer, lfn, lfn_sum);
+        lfn_slots.push_back({cluster_no, slot});
+        stats.add(FAT32Stats::DENTRY_LFN);
+        continue;
+      }
+
+      bool has_lfn = !lfn.empty() && lfn_checksum(child_direntry_buffer) == lfn_sum;
+      u16string long_name;
+      long_name.swap(lfn);
+      auto long_name_slots = std::move(lfn_slots);
+      lfn_slots.clear();
+
+      if (child_direntry_buffer[0] == 0xE5) { // skip deleted
+        stats.add(FAT32Stats::DENTRY_DELETED);
+        continue;
+      } else if (child_direntry_buffer[0] == '.') { // skip "." or ".."
+        stats.add(FAT32Stats::DENTRY_DOT);
+        continue;
+      } else if (attribute != 0x10 && attribute != 0x20) { // if not dir or file, then skip: {Hidden, Volume Label, LFN}
+        stats.add(FAT32Stats::DENTRY_OTHER);
+        continue;
+      }
+
+      stats.add(attribute == 0x10 ? FAT32Stats::DENTRY_DIR : FAT32Stats::DENTRY_FILE);
+
+      DirectoryEntry* child_direntry = new DirectoryEntry(child_direntry_buffer, 32);
+      child_direntry->set_location(cluster_no, slot);
+
+      if (has_lfn) {
+        child_direntry->set_long_name(decode_lfn(long_name));
+        for (auto [c, s] : long_name_slots)
+          child_direntry->add_lfn_slot(c, s);
+      }
+
+      // if dir, then recursivly traverse (or leave it to the first access when
+      // lazy); a damaged volume may link a directory back to one already
+      // visited, that one is kept as an empty entry
+      if (attribute == 0x10 && visited_dirs.insert(child_direntry->get_start_cluster_no()).second) {
+        if (lazy)
+          child_direntry->set_loader(this);
+        else
+          build_dir_tree(child_direntry, child_direntry->get_start_cluster_no());
+      }
+
+      parent_entry->add_child(child_direntry);
+      index_entry(child_direntry);
+    }
+  }
+}
+
+uint64_t FAT32::get_image_size()
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    throw runtime_error("error reading " + image_path + ": " + strerror(errno));
+
+  return st.st_size;
+}
+
+uint64_t FAT32::cal_data_offset(uint32_t cluster_no)
+{
+  // the data area starts with cluster 2
+  uint64_t data_offset = super_block->get_data_area_addr() + (uint64_t)(cluster_no - 2) * super_block->get_cluster_size();
+  return data_offset;
+}
+
+uint32_t FAT32::cal_cluster_no(uint64_t offset)
+{
+  uint64_t data_area_addr = super_block->get_data_area_addr();
+  if (offset < data_area_addr)
+    return 0;
+
+  uint64_t cluster_no = (offset - data_area_addr) / super_block->get_cluster_size() + 2;
+  return cluster_no <= super_block->get_cluster_cnt() + 1 ? cluster_no : 0;
+}
+
+void FAT32::read_at(void *buffer, size_t size, uint64_t offset)
+{
+  char *p = (char*)buffer;
+
+  while (size > 0) {
+    ssize_t n = pread(fd, p, size, offset);
+    stats.add(FAT32Stats::SYSCALLS);
+    stats.add(FAT32Stats::READ_CALLS);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      throw runtime_error("error reading " + image_path + ": " + (n == 0 ? "unexpected end of file" : strerror(errno)));
+
+    stats.add(FAT32Stats::BYTES_READ, n);
+    p += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+void FAT32::readv_at(iovec *iov, int iov_cnt, uint64_t offset)
+{
+  while (iov_cnt > 0) {
+    ssize_t n = preadv(fd, iov, min(iov_cnt, IOV_MAX), offset);
+    stats.add(FAT32Stats::SYSCALLS);
+    stats.add(FAT32Stats::READ_CALLS);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      throw runtime_error("error reading " + image_path + ": " + (n == 0 ? "unexpected end of file" : strerror(errno)));
+
+    stats.add(FAT32Stats::BYTES_READ, n);
+    offset += n;
+
+    // skip what was filled, a short read leaves the rest of an iovec
+    for (; iov_cnt > 0 && (size_t)n >= iov->iov_len; iov++, iov_cnt--)
+      n -= iov->iov_len;
+    if (iov_cnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+void FAT32::prefetch(uint64_t offset, uint64_t size)
+{
+  // only a hint, when it fails the reads just do not overlap
+  posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+  stats.add(FAT32Stats::SYSCALLS);
+  stats.add(FAT32Stats::READAHEAD_CALLS);
+  stats.add(FAT32Stats::READAHEAD_BYTES, size);
+}
+
+void FAT32::write_at(void const *buffer, size_t size, uint64_t offset)
+{
+  char const *p = (char const*)buffer;
+
+  while (size > 0) {
+    ssize_t n = pwrite(fd, p, size, offset);
+    stats.add(FAT32Stats::SYSCALLS);
+    stats.add(FAT32Stats::WRITE_CALLS);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw runtime_error("error writing " + image_path + ": " + strerror(errno));
+
+    stats.add(FAT32Stats::BYTES_WRITTEN, n);
+    p += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+vector<uint8_t>& FAT32::dir_cluster(uint32_t cluster_no)
+{
+  auto it = dir_cache.find(cluster_no);
+  if (it != dir_cache.end()) {
+    stats.add(FAT32Stats::CACHE_HITS);
+    return it->second;
+  }
+
+  stats.add(FAT32Stats::CACHE_MISSES);
+  stats.add(FAT32Stats::CLUSTERS_READ);
+
+  vector<uint8_t> buffer(super_block->get_cluster_size());
+  read_at(buffer.data(), buffer.size(), cal_data_offset(cluster_no));
+
+  return dir_cache.emplace(cluster_no, std::move(buffer)).first->second;
+}
+
+uint32_t FAT32::get_fat(uint32_t cluster_no)
+{
+  return fat_area->get_entry(cluster_no) & 0x0FFFFFFF;
+}
+
+void FAT32::set_fat(uint32_t cluster_no, uint32_t value)
+{
+  uint32_t& entry = fat_area->get_clusters()[cluster_no];
+
+  // the upper 4 bits are reserved and kept as they are
+  entry = (entry & 0xF0000000) | (value & 0x0FFFFFFF);
+  dirty_fat_sectors.insert(cluster_no * 4 / super_block->get_sector_size());
+}
+
+FreeSpace& FAT32::free_space()
+{
+  if (free_map == nullptr)
+    free_map = new FreeSpace(fat_area->get_clusters(), super_block->get_cluster_cnt());
+
+  return *free_map;
+}
+
+void FAT32::free_chain(uint32_t cluster_no)
+{
+  for (uint32_t c : chain(cluster_no)) {
+    set_fat(c, 0);
+    pending_free.push_back(c);
+  }
+}
+
+vector<pair<uint32_t, uint32_t>> FAT32::allocate(uint32_t count, uint32_t hint)
+{
+  if (count > free_space().get_free_cnt() && !pending_free.empty())
+    flush();
+
+  return free_space().allocate(count, hint);
+}
+
+// the metadata freeing them is on disk (or committed to the log), they may be reused
+void FAT32::release_pending()
+{
+  for (uint32_t c : pending_free)
+    free_space().release(c);
+  pending_free.clear();
+}
+
+// links the allocated runs behind prev (0 for a new chain), returns the first cluster
+uint32_t FAT32::link_runs(vector<pair<uint32_t, uint32_t>> const& runs, uint32_t prev)
+{
+  uint32_t first = 0;
+
+  for (auto [start, len] : runs) {
+    for (uint32_t c = start; c < start + len; c++) {
+      if (prev != 0)
+        set_fat(prev, c);
+      if (first == 0)
+        first = c;
+      prev = c;
+    }
+  }
+
+  if (prev != 0)
+    set_fat(prev, EOC);
+
+  return first;
+}
+
+// writes data[from..] into the runs, the last cluster is padded with zeros
+void FAT32::write_runs(vector<pair<uint32_t, uint32_t>> const& runs, string const& data, size_t from)
+{
+  uint32_t cluster_size = super_block->get_cluster_size();
+  size_t pos = from;
+
+  for (auto [start, len] : runs) {
+    size_t n = min<uint64_t>((uint64_t)len * cluster_size, data.size() - pos);
+    size_t whole = n / cluster_size * cluster_size;
+
+    if (whole > 0)
+      write_at(data.data() + pos, whole, cal_data_offset(start));
+
+    if (n > whole) {
+      vector<char> tail(cluster_size, 0);
+      memcpy(tail.data(), data.data() + pos + whole, n - whole);
+      write_at(tail.data(), cluster_size, cal_data_offset(start) + whole);
+    }
+
+    pos += n;
+  }
+}
+
+// count consecutive unused slots of dir, the directory grows when it is full
+// up to DIR_SLOT_MAX slots
+vector<pair<uint32_t, uint32_t>> FAT32::find_free_slots(DirectoryEntry *dir, uint32_t count)
+{
+  uint32_t slot_cnt = super_block->get_cluster_size() / 0x20;
+  uint32_t max_cluster = super_block->get_cluster_cnt() + 1;
+  vector<pair<uint32_t, uint32_t>> slots;
+
+  auto hint = dir_free_hint.find(dir->get_start_cluster_no());
+  uint32_t cluster_no = dir->get_start_cluster_no();
+  uint32_t slot = 0;
+  if (hint != dir_free_hint.end()) {
+    cluster_no = hint->second.first;
+    slot = hint->second.second;
+  }
+
+  while (true) {
+    vector<uint8_t>& buffer = dir_cluster(cluster_no);
+
+    for (; slot < slot_cnt; slot++) {
+      if (buffer[slot * 0x20] != 0x00 && buffer[slot * 0x20] != 0xE5) {
+        slots.clear();
+        continue;
+      }
+
+      slots.push_back({cluster_no, slot});
+      if (slots.size() == count) {
+        dir_free_hint[dir->get_start_cluster_no()] = {cluster_no, slot + 1};
+        return slots;
+      }
+    }
+
+    uint32_t next = get_fat(cluster_no);
+    if (next < 2 || next > max_cluster)
+      break;
+
+    cluster_no = next;
+    slot = 0;
+  }
+
+  uint32_t grow_cnt = (count - slots.size() + slot_cnt - 1) / slot_cnt;
+  if ((chain(dir->get_start_cluster_no()).size() + grow_cnt) * slot_cnt > DIR_SLOT_MAX)
+    throw runtime_error("directory full: " + dir->get_full_path());
+
+  while (slots.size() < count) {
+    auto runs = allocate(1, cluster_no + 1);
+    cluster_no = link_runs(runs, cluster_no);
+
+    dir_cache[cluster_no] = vector<uint8_t>(super_block->get_cluster_size(), 0);
+    dirty_dir_clusters.insert(cluster_no);
+
+    for (slot = 0; slot < slot_cnt && slots.size() < count; slot++)
+      slots.push_back({cluster_no, slot});
+  }
+
+  dir_free_hint[dir->get_start_cluster_no()] = {cluster_no, slot};
+
+  return slots;
+}
+
+// writes start cluster, size and modification time back into the directory slot
+void FAT32::update_dentry(DirectoryEntry *dentry)
+{
+  vector<uint8_t>& buffer = dir_cluster(dentry->get_entry_cluster());
+  sys::io::byte_buffer bb(&buffer[dentry->get_entry_slot() * 0x20], 0x20);
+
+  uint16_t date, time;
+  to_fat_time(now(), date, time);
+
+  bb.put_uint16_le(dentry->get_start_cluster_no() >> 16, 0x14);
+  bb.put_uint16_le(time, 0x16);
+  bb.put_uint16_le(date, 0x18);
+  bb.put_uint16_le(dentry->get_start_cluster_no() & 0xFFFF, 0x1A);
+  bb.put_uint32_le(dentry->get_file_size(), 0x1C);
+  dentry->set_write_time(date, time);
+
+  dirty_dir_clusters.insert(dentry->get_entry_cluster());
+}
+
+void FAT32::write_short_entry(uint8_t *slot, string const& short_name, uint8_t attribute, uint32_t first, uint32_t size)
+{
+  sys::io::byte_buffer bb(slot, 0x20);
+
+  uint16_t date, time;
+  to_fat_time(now(), date, time);
+
+  bb.put_ascii(short_name, 11, ' ');
+  bb.put_uint8(attribute);
+  bb.put_uint8(0);                    // reserved
+  bb.put_uint8(0);                    // creation time, 10ms units
+  bb.put_uint16_le(time);
+  bb.put_uint16_le(date);
+  bb.put_uint16_le(date);             // last access
+  bb.put_uint16_le(first >> 16);
+  bb.put_uint16_le(time);
+  bb.put_uint16_le(date);
+  bb.put_uint16_le(first & 0xFFFF);
+  bb.put_uint32_le(size);
+}
+
+//
+// "NAME~N.EXT" alias for a long name. The first few tails are sequential,
+// after that a hash of the long name keeps the probing short in big directories.
+//
+string FAT32::make_alias(DirectoryEntry *dir, string const& name)
+{
+  auto dot = name.rfind('.');
+  string base, ext;
+
+  for (size_t i = 0; i < (dot == string::npos || dot == 0 ? name.size() : dot); i++) {
+    char c = name[i];
+    if (c == ' ' || c == '.')
+      continue;
+    base += is_short_char(c) ? toupper((unsigned char)c) : '_';
+  }
+
+  if (dot != string::npos && dot != 0) {
+    for (size_t i = dot + 1; i < name.size() && ext.size() < 3; i++) {
+      char c = name[i];
+      if (c != ' ')
+        ext += is_short_char(c) ? toupper((unsigned char)c) : '_';
+    }
+  }
+
+  if (base.empty())
+    base = "_";
+
+  uint32_t hash = crc32((uint8_t const*)name.data(), name.size());
+
+  for (uint32_t n = 1; n < 1000000; n++) {
+    string stem = base;
+    if (n > 4) {
+      char hex[8];
+      snprintf(hex, sizeof(hex), "%04X", (hash + n) & 0xFFFF);
+      stem = base.substr(0, 2) + hex;
+    }
+
+    string tail = "~" + to_string(n > 4 ? 1 + n / 0x10000 : n);
+    string alias = stem.substr(0, 8 - tail.size()) + tail;
+
+    if (find_child(dir, ext.empty() ? alias : alias + "." + ext) == nullptr)
+      return alias + string(8 - alias.size(), ' ') + ext + string(3 - ext.size(), ' ');
+  }
+
+  throw runtime_error("no short name left for " + name);
+}
+
+//
+// Writes the entry for name into dir, preceded by long name entries when name
+// is not a plain 8.3 name, and adds it to the tree.
+//
+DirectoryEntry* FAT32::add_entry(DirectoryEntry *dir, string const& name, uint8_t attribute, uint32_t first, uint32_t size)
+{
+  if (!is_safe_name(name))
+    throw invalid_argument("invalid file name: " + name);
+
+  string short_name = to_short_name(name);
+  u16string long_name;
+
+  if (short_name.empty()) {
+    wstring_convert<codecvt_utf8_utf16<char16_t>, char16_t> convert;
+    long_name = convert.from_bytes(name);
+
+    if (long_name.empty() || long_name.size() > 255)
+      throw invalid_argument("invalid file name: " + name);
+
+    short_name = make_alias(dir, name);
+  }
+
+  uint32_t lfn_cnt = (long_name.size() + 12) / 13;
+  auto slots = find_free_slots(dir, lfn_cnt + 1);
+  uint8_t sum = lfn_checksum((uint8_t const*)short_name.data());
+
+  // long name parts are stored last part first, each with 13 UTF-16 characters
+  for (uint32_t i = 0; i < lfn_cnt; i++) {
+    uint32_t part = lfn_cnt - i;
+    vector<uint8_t>& buffer = dir_cluster(slots[i].first);
+    sys::io::byte_buffer bb(&buffer[slots[i].second * 0x20], 0x20);
+
+    static constexpr int char_at[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    for (int k = 0; k < 13; k++) {
+      size_t idx = (part - 1) * 13 + k;
+      uint16_t c = idx < long_name.size() ? long_name[idx] : (idx == long_name.size() ? 0x0000 : 0xFFFF);
+      bb.put_uint16_le(c, char_at[k]);
+    }
+
+    bb.put_uint8(part | (i == 0 ? 0x40 : 0), 0);
+    bb.put_uint8(0x0F, 11);
+    bb.put_uint8(0, 12);
+    bb.put_uint8(sum, 13);
+    bb.put_uint16_le(0, 26);
+
+    dirty_dir_clusters.insert(slots[i].first);
+  }
+
+  auto [cluster_no, slot] = slots.back();
+  vector<uint8_t>& buffer = dir_cluster(cluster_no);
+  write_short_entry(&buffer[slot * 0x20], short_name, attribute, first, size);
+  dirty_dir_clusters.insert(cluster_no);
+
+  DirectoryEntry *dentry = new DirectoryEntry(&buffer[slot * 0x20], 0x20);
+  dentry->set_location(cluster_no, slot);
+  if (lfn_cnt > 0) {
+    dentry->set_long_name(name);
+    for (uint32_t i = 0; i < lfn_cnt; i++)
+      dentry->add_lfn_slot(slots[i].first, slots[i].second);
+  }
+
+  dir->add_child(dentry);
+  index_entry(dentry);
+
+  return dentry;
+}
+
+void FAT32::check_writable()
+{
+  if (!writable)
+    throw runtime_error(image_path + " is opened read-only");
+}
+
+time_t FAT32::now()
+{
+  return fixed_time != 0 ? fixed_time : ::time(nullptr);
+}
+
+string fold_name(string name)
+{
+  for (auto& c : name) {
+    if (c >= 'a' && c <= 'z')
+      c -= 'a' - 'A';
+  }
+
+  return name;
+}
+
+bool is_safe_name(string const& name)
+{
+  return !name.empty() && name != "." && name != ".." && name.find_first_of(string("/\0", 2)) == string::npos;
+}
+
+string safe_name(string name)
+{
+  if (name.empty() || name == "." || name == "..")
+    return "_" + name;
+
+  for (auto& c : name) {
+    if (c == '/' || c == '\0')
+      c = '_';
+  }
+
+  return name;
+}
+
+uint32_t entry_slot_cnt(string const& name)
+{
+  if (!to_short_name(name).empty())
+    return 1;
+
+  wstring_convert<codecvt_utf8_utf16<char16_t>, char16_t> convert;
+  return (convert.from_bytes(name).size() + 12) / 13 + 1;
+}
+
+DirectoryEntry* FAT32::find_child(DirectoryEntry *dir, string const& name)
+{
+  dir->get_children();      // a lazy directory is read first
+  shared_lock<shared_mutex> guard(tree_lock);
+
+  auto it = name_index.find({ dir, fold_name(name) });
+
+  return it != name_index.end() ? it->second : nullptr;
+}
+
+// a damaged directory may hold a name twice, the first entry keeps it
+void FAT32::index_entry(DirectoryEntry *dentry)
+{
+  DirectoryEntry *parent = dentry->get_parent();
+
+  name_index.emplace(NameKey{ parent, fold_name(dentry->get_short_name()) }, dentry);
+  if (dentry->get_name() != dentry->get_short_name())
+    name_index.emplace(NameKey{ parent, fold_name(dentry->get_name()) }, dentry);
+}
+
+void FAT32::unindex_entry(DirectoryEntry *dentry)
+{
+  for (string const& name : { dentry->get_short_name(), dentry->get_name() }) {
+    auto it = name_index.find({ dentry->get_parent(), fold_name(name) });
+    if (it != name_index.end() && it->second == dentry)
+      name_index.erase(it);
+  }
+}
+
+// (parent directory, last component) of path
+pair<DirectoryEntry*, string> FAT32::split_path(string const& path)
+{
+  size_t slash = path.rfind('/');
+  string dir_path = slash == string::npos ? "" : path.substr(0, slash);
+  string name = slash == string::npos ? path : path.substr(slash + 1);
+
+  DirectoryEntry *dir = lookup(dir_path);
+  if (dir == nullptr)
+    throw runtime_error("no such directory: " + dir_path);
+
+  return {dir, name};
+}
+
+DirectoryEntry* FAT32::create_file(string const& path, string const& data)
+{
+  auto [dir, name] = split_path(path);
+
+  return create_file(dir, name, data);
+}
+
+DirectoryEntry* FAT32::create_file(DirectoryEntry *dir, string const& name, string const& data)
+{
+  check_writable();
+
+  if (!dir->is_dir())
+    throw runtime_error("not a directory: " + dir->get_name());
+
+  if (data.size() > 0xFFFFFFFF)
+    throw runtime_error("file too large for FAT32: " + name);
+
+  if (!is_safe_name(name))
+    throw invalid_argument("invalid file name: " + name);
+
+  if (find_child(dir, name) != nullptr)
+    throw runtime_error("file exists: " + name);
+
+  uint32_t cluster_size = super_block->get_cluster_size();
+  uint32_t cluster_cnt = (data.size() + cluster_size - 1) / cluster_size;
+  uint32_t first = 0;
+
+  if (cluster_cnt > 0) {
+    auto runs = allocate(cluster_cnt, 0);
+    write_runs(runs, data, 0);
+    first = link_runs(runs, 0);
+  }
+
+  DirectoryEntry *dentry = add_entry(dir, name, 0x20, first, data.size());
+  commit_if_due();
+
+  return dentry;
+}
+
+DirectoryEntry* FAT32::create_dir(string const& path)
+{
+  auto [dir, name] = split_path(path);
+
+  return create_dir(dir, name);
+}
+
+DirectoryEntry* FAT32::create_dir(DirectoryEntry *dir, string const& name)
+{
+  check_writable();
+
+  if (!dir->is_dir())
+    throw runtime_error("not a directory: " + dir->get_name());
+
+  if (!is_safe_name(name))
+    throw invalid_argument("invalid file name: " + name);
+
+  if (find_child(dir, name) != nullptr)
+    throw runtime_error("file exists: " + name);
+
+  auto runs = allocate(1, 0);
+  uint32_t first = link_runs(runs, 0);
+
+  // "." and "..", the root is referred to as cluster 0
+  vector<uint8_t> buffer(super_block->get_cluster_size(), 0);
+  write_short_entry(&buffer[0x00], ".", 0x10, first, 0);
+  write_short_entry(&buffer[0x20], "..", 0x10, dir->get_parent() == nullptr ? 0 : dir->get_start_cluster_no(), 0);
+
+  dir_cache[first] = std::move(buffer);
+  dirty_dir_clusters.insert(first);
+
+  DirectoryEntry *dentry = add_entry(dir, name, 0x10, first, 0);
+  commit_if_due();
+
+  return dentry;
+}
+
+void FAT32::append(string const& path, string const& data)
+{
+  DirectoryEntry *dentry = lookup(path);
+  if (dentry == nullptr)
+    throw runtime_error("no such file: " + path);
+
+  append(dentry, data);
+}
+
+void FAT32::append(DirectoryEntry *dentry, string const& data)
+{
+  check_writable();
+
+  if (dentry->is_dir())
+    throw runtime_error("not a file: " + dentry->get_name());
+
+  uint64_t size = dentry->get_file_size();
+  if (size + data.size() > 0xFFFFFFFF)
+    throw runtime_error("file too large for FAT32: " + dentry->get_name());
+
+  if (data.empty())
+    return;
+
+  uint32_t cluster_size = super_block->get_cluster_size();
+  uint32_t last = 0;
+  size_t pos = 0;
+
+  // fill the slack of the clusters the file already has
+  if (dentry->get_start_cluster_no() != 0) {
+    auto clusters = chain(dentry->get_start_cluster_no());
+    last = clusters.back();
+
+    size_t idx = size / cluster_size;
+    uint32_t off = size % cluster_size;
+    while (pos < data.size() && idx < clusters.size()) {
+      size_t n = min<size_t>(cluster_size - off, data.size() - pos);
+      write_at(data.data() + pos, n, cal_data_offset(clusters[idx]) + off);
+      pos += n;
+      idx++;
+      off = 0;
+    }
+  }
+
+  if (pos < data.size()) {
+    uint32_t cluster_cnt = (data.size() - pos + cluster_size - 1) / cluster_size;
+    auto runs = allocate(cluster_cnt, last == 0 ? 0 : last + 1);
+    write_runs(runs, data, pos);
+
+    uint32_t first = link_runs(runs, last);
+    if (last == 0)
+      dentry->set_start_cluster_no(first);
+  }
+
+  dentry->set_file_size(size + data.size());
+  update_dentry(dentry);
+  commit_if_due();
+}
+
+void FAT32::truncate(string const& path, uint32_t size)
+{
+  DirectoryEntry *dentry = lookup(path);
+  if (dentry == nullptr)
+    throw runtime_error("no such file: " + path);
+
+  truncate(dentry, size);
+}
+
+void FAT32::truncate(DirectoryEntry *dentry, uint32_t size)
+{
+  check_writable();
+
+  if (dentry->is_dir())
+    throw runtime_error("not a file: " + dentry->get_name());
+
+  // growing fills with zeros
+  if (size >= dentry->get_file_size()) {
+    if (size > dentry->get_file_size())
+      append(dentry, string(size - dentry->get_file_size(), '\0'));
+    return;
+  }
+
+  uint32_t cluster_size = super_block->get_cluster_size();
+  uint32_t keep = (size + cluster_size - 1) / cluster_size;
+
+  if (dentry->get_start_cluster_no() != 0) {
+    auto clusters = chain(dentry->get_start_cluster_no());
+
+    if (keep == 0) {
+      free_chain(clusters.front());
+      dentry->set_start_cluster_no(0);
+    } else if (keep < clusters.size()) {
+      free_chain(clusters[keep]);
+      set_fat(clusters[keep - 1], EOC);
+    }
+  }
+
+  dentry->set_file_size(size);
+  update_dentry(dentry);
+  commit_if_due();
+}
+
+void FAT32::remove(string const& path)
+{
+  DirectoryEntry *dentry = lookup(path);
+  if (dentry == nullptr)
+    throw runtime_error("no such file: " + path);
+
+  remove(dentry);
+}
+
+void FAT32::remove(DirectoryEntry *dentry)
+{
+  check_writable();
+
+  if (dentry->is_dir() || dentry->get_parent() == nullptr)
+    throw runtime_error("not a file: " + dentry->get_name());
+
+  if (dentry->get_start_cluster_no() != 0)
+    free_chain(dentry->get_start_cluster_no());
+
+  vector<uint8_t>& buffer = dir_cluster(dentry->get_entry_cluster());
+  buffer[dentry->get_entry_slot() * 0x20] = 0xE5;
+  dirty_dir_clusters.insert(dentry->get_entry_cluster());
+
+  for (auto [cluster_no, slot] : dentry->get_lfn_slots()) {
+    dir_cluster(cluster_no)[slot * 0x20] = 0xE5;
+    dirty_dir_clusters.insert(cluster_no);
+  }
+
+  DirectoryEntry *parent = dentry->get_parent();
+  unindex_entry(dentry);
+  parent->remove_child(dentry);
+  dir_free_hint.erase(parent->get_start_cluster_no());
+
+  delete dentry;
+  commit_if_due();
+}
+
+void FAT32::enable_wal()
+{
+  check_writable();
+
+  if (wal == nullptr)
+    wal = new WriteAheadLog(image_path + ".wal");
+}
+
+void FAT32::commit_if_due()
+{
+  if (group_commit_bytes == 0)
+    return;
+
+  size_t dirty = dirty_fat_sectors.size() * super_block->get_sector_size() * super_block->get_fat_no()
+    + dirty_dir_clusters.size() * super_block->get_cluster_size();
+
+  if (dirty >= group_commit_bytes)
+    flush();
+}
+
+//
+// FAT sectors go first, in one sorted pass per FAT copy with adjacent sectors
+// merged into one write, then the directory clusters, then FSInfo.
+//
+void FAT32::collect_metadata(vector<MetaWrite>& writes)
+{
+  uint32_t sector_size = super_block->get_sector_size();
+  uint64_t fat_size = (uint64_t)super_block->get_fat_sector_no() * sector_size;
+  uint8_t *fat = (uint8_t*)fat_area->get_clusters().data();
+
+  for (uint32_t k = 0; k < super_block->get_fat_no(); k++) {
+    uint64_t copy_offset = super_block->get_fat_offset() + k * fat_size;
+
+    for (auto it = dirty_fat_sectors.begin(); it != dirty_fat_sectors.end(); ) {
+      uint32_t first = *it, last = *it;
+      for (++it; it != dirty_fat_sectors.end() && *it == last + 1; ++it)
+        last = *it;
+
+      uint64_t from = (uint64_t)first * sector_size;
+      uint64_t len = (uint64_t)(last - first + 1) * sector_size;
+      writes.push_back({copy_offset + from, fat + from, len});
+
+      // the in-memory mirrors follow FAT #1
+      if (k > 0)
+        memcpy(fat + k * fat_size + from, fat + from, len);
+    }
+  }
+
+  for (uint32_t cluster_no : dirty_dir_clusters) {
+    vector<uint8_t>& buffer = dir_cache[cluster_no];
+    writes.push_back({cal_data_offset(cluster_no), buffer.data(), buffer.size()});
+  }
+
+  uint16_t fs_info = super_block->get_fs_info_sector();
+  if (free_map != nullptr && fs_info != 0 && fs_info != 0xFFFF) {
+    fs_info_buffer.resize(sector_size);
+    read_at(fs_info_buffer.data(), sector_size, (uint64_t)fs_info * sector_size);
+
+    sys::io::byte_buffer bb(fs_info_buffer.data(), sector_size);
+    if (bb.get_uint32_le(0) == 0x41615252 && bb.get_uint32_le(0x1E4) == 0x61417272) {
+      bb.put_uint32_le(free_map->get_free_cnt() + pending_free.size(), 0x1E8);
+      bb.put_uint32_le(free_map->get_next_free(), 0x1EC);
+      writes.push_back({(uint64_t)fs_info * sector_size, fs_info_buffer.data(), sector_size});
+    }
+  }
+}
+
+//
+// Without a log the metadata is written in place. With one, the data clusters
+// (written in place as files grow) are synced first, the whole metadata batch
+// is logged with one fsync, then applied in a single pass ordered by offset.
+//
+void FAT32::flush()
+{
+  if (!writable || (dirty_fat_sectors.empty() && dirty_dir_clusters.empty()))
+    return;
+
+  FAT32Stats::PhaseTimer timer(stats, FAT32Stats::FLUSH);
+  TraceSpan span("FAT32::flush");
+
+  vector<MetaWrite> writes;
+  collect_metadata(writes);
+
+  if (wal == nullptr) {
+    for (auto& w : writes)
+      write_at(w.data, w.size, w.offset);
+  } else {
+    stats.add(FAT32Stats::SYSCALLS);
+    stats.add(FAT32Stats::SYNC_CALLS);
+    if (fdatasync(fd) != 0)
+      throw runtime_error("error syncing " + image_path + ": " + strerror(errno));
+
+    for (auto& w : writes)
+      wal->add(w.offset, w.data, w.size);
+    wal->commit();
+
+    sort(writes.begin(), writes.end(),
+        [](MetaWrite const& a, MetaWrite const& b) { return a.offset < b.offset; });
+
+    for (auto& w : writes)
+      write_at(w.data, w.size, w.offset);
+
+    stats.add(FAT32Stats::SYSCALLS);
+    stats.add(FAT32Stats::SYNC_CALLS);
+    if (fsync(fd) != 0)
+      throw runtime_error("error syncing " + image_path + ": " + strerror(errno));
+
+    wal->checkpoint();
+  }
+
+  dirty_fat_sectors.clear();
+  dirty_dir_clusters.clear();
+  release_pending();
+}
@@ -0,0 +1,686 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <ctime>
+
+#include "byte_buffer.hpp"
+#include "fat32_stats.hpp"
+#include "trace.hpp"
+#include "wal.hpp"
+
+using namespace std;
+
+
+inline std::string& rtrim(std::string& s, const char* t = " \t\n\r\f\v")
+{
+  s.erase(s.find_last_not_of(t) + 1);
+  return s;
+}
+
+class SuperBlock
+{
+  public:
+    SuperBlock() {}
+
+    SuperBlock(uint8_t *buffer, int size)
+    {
+      sys::io::byte_buffer bb((uint8_t*)buffer, 0, size);
+      bb.skip(0x0B);
+
+      sector_size = bb.get_uint16_le();
+      sector_per_cluster = bb.get_uint8();
+      cluster_size = sector_size * sector_per_cluster;
+      rsvd_sector_cnt = bb.get_uint16_le();
+
+      fat_no = bb.get_uint8();
+      bb.skip(0x13);
+      fat_offset = rsvd_sector_cnt * sector_size;
+      fat_sector_no = bb.get_uint32_le();
+      fat_area_size = fat_sector_no * sector_size * fat_no;
+
+      data_area_addr = fat_offset + fat_area_size;
+      bb.skip(0x04);
+      root_cluster_addr = bb.get_uint32_le();
+      fs_info_sector = bb.get_uint16_le();
+
+      total_sector_no = bb.get_uint32_le(0x20);
+    }
+
+    // fresh volume geometry, root directory at cluster 2 and FSInfo at sector 1
+    SuperBlock(uint16_t sector_size, uint8_t sector_per_cluster, uint16_t rsvd_sector_cnt,
+               uint8_t fat_no, uint32_t fat_sector_no, uint32_t total_sector_no)
+      : sector_size(sector_size), sector_per_cluster(sector_per_cluster),
+        rsvd_sector_cnt(rsvd_sector_cnt), fat_no(fat_no),
+        fat_sector_no(fat_sector_no), total_sector_no(total_sector_no)
+    {
+      cluster_size = sector_size * sector_per_cluster;
+      fat_offset = rsvd_sector_cnt * sector_size;
+      fat_area_size = fat_sector_no * sector_size * fat_no;
+      data_area_addr = fat_offset + fat_area_size;
+      root_cluster_addr = 2;
+      fs_info_sector = 1;
+    }
+
+  public:
+    // boot sector with the BPB, the inverse of SuperBlock(buffer, size)
+    void encode(uint8_t *buffer, string const& label, uint32_t volume_id)
+    {
+      sys::io::byte_buffer bb(buffer, 0, sector_size);
+      bb.fill(0, sector_size, 0);
+
+      bb.put_bytes((uint8_t const*)"\xEB\x58\x90", 3);
+      bb.put_ascii("MSWIN4.1", 8, ' ');
+      bb.put_uint16_le(sector_size);
+      bb.put_uint8(sector_per_cluster);
+      bb.put_uint16_le(rsvd_sector_cnt);
+      bb.put_uint8(fat_no);
+      bb.put_uint16_le(0);                  // root entries, FAT12/16 only
+      bb.put_uint16_le(0);                  // 16 bit total sectors
+      bb.put_uint8(0xF8);                   // media: fixed disk
+      bb.put_uint16_le(0);                  // 16 bit FAT size
+      bb.put_uint16_le(63);                 // sectors per track
+      bb.put_uint16_le(255);                // heads
+      bb.put_uint32_le(0);                  // hidden sectors
+      bb.put_uint32_le(total_sector_no);
+      bb.put_uint32_le(fat_sector_no);
+      bb.put_uint16_le(0);                  // ext flags: all FATs mirrored
+      bb.put_uint16_le(0);                  // version 0.0
+      bb.put_uint32_le(root_cluster_addr);
+      bb.put_uint16_le(fs_info_sector);
+      bb.put_uint16_le(6);                  // backup boot sector
+      bb.skip(12);
+      bb.put_uint8(0x80);                   // drive number
+      bb.put_uint8(0);
+      bb.put_uint8(0x29);                   // extended boot signature
+      bb.put_uint32_le(volume_id);
+      bb.put_ascii(label, 11, ' ');
+      bb.put_ascii("FAT32   ");
+
+      bb.put_uint16_le(0xAA55, 510);
+    }
+
+    uint32_t get_cluster_size()       { return cluster_size; }
+    uint16_t get_rsvd_sector_cnt()    { return rsvd_sector_cnt; }
+    uint16_t get_sector_size()        { return sector_size; }
+    uint8_t get_sector_per_cluster()  { return sector_per_cluster; }
+    uint8_t get_fat_no()              { return fat_no; }
+    uint32_t get_fat_offset()         { return fat_offset; }
+    uint32_t get_fat_sector_no()      { return fat_sector_no; }
+    uint32_t get_fat_area_size()      { return fat_area_size; }
+    uint32_t get_data_area_addr()     { return data_area_addr; }
+    uint32_t get_root_cluster_addr()  { return root_cluster_addr; }
+    uint16_t get_fs_info_sector()     { return fs_info_sector; }
+    uint32_t get_total_sector_no()    { return total_sector_no; }
+
+    // entries in one FAT copy
+    uint32_t get_fat_entry_cnt()      { return fat_sector_no * sector_size / 4; }
+
+    // number of data clusters, limited by what one FAT copy can address
+    uint32_t get_cluster_cnt()
+    {
+      uint32_t data_sectors = total_sector_no - data_area_addr / sector_size;
+      uint32_t by_size = data_sectors / sector_per_cluster;
+      uint32_t by_fat = fat_sector_no * sector_size / 4 - 2;
+
+      return by_size < by_fat ? by_size : by_fat;
+    }
+
+  private:
+    uint16_t sector_size;
+    uint8_t sector_per_cluster;
+    uint32_t cluster_size;
+    uint16_t rsvd_sector_cnt;
+    uint8_t fat_no;
+    uint32_t fat_offset;
+    uint32_t fat_sector_no;
+    uint32_t fat_area_size;
+    uint32_t data_area_addr;
+    uint32_t root_cluster_addr;
+    uint16_t fs_info_sector;
+    uint32_t total_sector_no;
+};
+
+//
+// The FAT copies of an image. Nothing is read up front: get_entry() reads
+// FAT #1 a sector at a time while only a few sectors have been asked for,
+// so opening a volume and listing a directory costs a handful of reads
+// whatever its size. get_clusters() and get_copy() read every copy in one
+// go, the first time they are called (and get_entry() does, once the
+// sector cache is full); after that everything is served from memory.
+//
+class FatArea
+{
+  public:
+    // reads size bytes at offset from the start of FAT #1
+    using Reader = function<void(void *buffer, size_t size, uint64_t offset)>;
+
+    static constexpr size_t SECTOR_CACHE_MAX = 64;
+
+  public:
+    FatArea() {}
+    // size bytes holding copy_cnt FAT copies back to back
+    FatArea(Reader reader, size_t size, uint32_t copy_cnt, uint32_t sector_size)
+      : reader(std::move(reader)), size(size), copy_cnt(copy_cnt == 0 ? 1 : copy_cnt),
+        sector_size(sector_size), entry_cnt(size / 4 / this->copy_cnt) {}
+    FatArea(FatArea const&) = delete;
+
+  public:
+    // raw FAT #1 entry, reserved bits included; safe to call from several threads
+    uint32_t get_entry(uint32_t cluster_no);
+
+    // every FAT copy, one after the other; FAT #1 comes first
+    vector<uint32_t>& get_clusters() { load(); return clusters_vec; }
+
+    uint32_t* get_copy(uint32_t copy_no) { load(); return clusters_vec.data() + (size_t)copy_no * entry_cnt; }
+    uint32_t get_copy_cnt()  { return copy_cnt; }
+    uint32_t get_entry_cnt() { return entry_cnt; }
+    bool is_loaded()         { return loaded.load(memory_order_acquire); }
+
+  private:
+    void load();
+    void load_locked();
+
+  private:
+    Reader reader;
+    size_t size = 0;
+    uint32_t copy_cnt = 1;
+    uint32_t sector_size = 512;
+    uint32_t entry_cnt = 0;         // per copy
+
+    vector<uint32_t> clusters_vec;
+    atomic<bool> loaded{false};
+    mutex lock;
+    unordered_map<uint32_t, vector<uint32_t>> sectors;   // of FAT #1, until loaded
+};
+
+class FAT32;
+struct iovec;
+
+class DirectoryEntry
+{
+  public:
+    DirectoryEntry() {}
+
+    DirectoryEntry(sys::io::byte_buffer& bb)
+    {
+      file_name_hex = bb.get_uint64_le();
+      bb.reset();
+
+      file_name = bb.get_ascii(8);
+      file_ext = bb.get_ascii(3);
+      attribute = bb.get_uint8();
+
+      bb.skip(0x08);
+      start_cluster_hi = bb.get_uint16_le();
+      write_time = bb.get_uint16_le();
+      write_date = bb.get_uint16_le();
+      start_cluster_lo = bb.get_uint16_le();
+
+      start_cluster_no = ((uint32_t)start_cluster_hi << 16) | start_cluster_lo;
+
+      file_size = bb.get_uint32_le();
+    }
+
+    DirectoryEntry(uint8_t *buffer, int size)
+    {
+      sys::io::byte_buffer bb((uint8_t*)buffer, 0, size);
+
+      file_name_hex = bb.get_uint64_le();
+      bb.reset();
+
+      file_name = bb.get_ascii(8);
+      file_ext = bb.get_ascii(3);
+      attribute = bb.get_uint8();
+
+      bb.skip(0x08);
+      start_cluster_hi = bb.get_uint16_le();
+      write_time = bb.get_uint16_le();
+      write_date = bb.get_uint16_le();
+      start_cluster_lo = bb.get_uint16_le();
+
+      // Combine cluster numbers
+      start_cluster_no = ((uint32_t)start_cluster_hi << 16) | start_cluster_lo;
+
+      file_size = bb.get_uint32_le();
+    }
+
+  public:
+    bool is_deleted_file()
+    {
+      uint8_t first_byte = static_cast<uint8_t>(file_name_hex & 0xFF);
+      return (first_byte == 0xE5);
+    }
+
+    bool is_dir() { return attribute == 0x10; }
+
+  public:
+    void set_end_cluster_no(vector<uint32_t> clusters)
+    {
+      for (int i = start_cluster_no; i < clusters.size(); i++) {
+        if (clusters.at(i) == 0x0FFFFFFF) {
+          end_cluster_no = i;
+          return;
+        }
+      }
+    }
+
+    void add_child(DirectoryEntry *child)
+    {
+      children.push_back(child);
+      child->parent = this;
+    }
+
+    void remove_child(DirectoryEntry *child)
+    {
+      for (auto it = children.begin(); it != children.end(); it++) {
+        if (*it == child) {
+          children.erase(it);
+          return;
+        }
+      }
+    }
+
+    // where the 32 byte entry lives: cluster of the parent directory and slot in it
+    void set_location(uint32_t cluster, uint32_t slot)
+    {
+      entry_cluster = cluster;
+      entry_slot = slot;
+    }
+
+    void set_end_cluster_no() { end_cluster_no = file_size; }
+    void set_file_name(string str) { file_name = str; }
+    void set_path(string path) { this->path = path; }
+    void set_attribute(uint8_t attr) { attribute = attr; }
+    void set_file_size(uint32_t size) { file_size = size; }
+    void set_start_cluster_no(uint32_t cluster_no)
+    {
+      start_cluster_no = cluster_no;
+      start_cluster_hi = cluster_no >> 16;
+      start_cluster_lo = cluster_no & 0xFFFF;
+    }
+
+    // the long name if there is one, otherwise the 8.3 name
+    string get_name()
+    {
+      return long_name.empty() ? get_short_name() : long_name;
+    }
+
+    // "LEAF.JPG" from "LEAF    " + "JPG"
+    string get_short_name()
+    {
+      string name = file_name;
+      string ext = file_ext;
+      rtrim(name);
+      rtrim(ext);
+      return ext.empty() ? name : name + "." + ext;
+    }
+
+    // "/DIR1/LEAF.JPG", "/" for the root
+    string get_full_path()
+    {
+      if (parent == nullptr)
+        return "/";
+
+      string res;
+      for (DirectoryEntry *d = this; d->parent != nullptr; d = d->parent)
+        res = "/" + d->get_name() + res;
+      return res;
+    }
+
+    void set_write_time(uint16_t date, uint16_t time)
+    {
+      write_date = date;
+      write_time = time;
+    }
+
+    void set_long_name(string name) { long_name = name; }
+    void add_lfn_slot(uint32_t cluster, uint32_t slot) { lfn_slots.push_back({cluster, slot}); }
+    vector<pair<uint32_t, uint32_t>>& get_lfn_slots() { return lfn_slots; }
+
+    string get_file_name()          { return file_name; }
+    string get_file_ext()           { return file_ext; }
+    uint8_t get_attribute()         { return attribute; }
+    uint32_t get_start_cluster_no() { return start_cluster_no; }
+    uint32_t get_end_cluster_no()   { return end_cluster_no; }
+    uint32_t get_file_size()        { return file_size; }
+    // last modification, FAT date and time (local time, 2 second steps), see from_fat_time()
+    uint16_t get_write_date()       { return write_date; }
+    uint16_t get_write_time()       { return write_time; }
+    uint32_t get_entry_cluster()    { return entry_cluster; }
+    uint32_t get_entry_slot()       { return entry_slot; }
+    DirectoryEntry* get_parent()    { return parent; }
+    // a directory of a lazily built tree reads its entries here the first time
+    vector<DirectoryEntry*>& get_children() { load_children(); return children; }
+    // the children as they are, nothing is read (tearing a tree down)
+    vector<DirectoryEntry*>& get_loaded_children() { return children; }
+
+    // entries are read by fat32 on first access, see FAT32::build()
+    void set_loader(FAT32 *fat32) { loader = fat32; }
+
+  private:
+    void load_children();
+
+  private:
+    string file_name;
+    uint64_t file_name_hex;
+    string file_ext;
+    uint8_t attribute;
+    uint16_t start_cluster_hi;
+    uint16_t start_cluster_lo;
+    uint32_t start_cluster_no;
+    uint32_t end_cluster_no;
+    uint32_t file_size;
+    uint16_t write_time = 0;
+    uint16_t write_date = 0;
+
+    uint32_t entry_cluster = 0;
+    uint32_t entry_slot = 0;
+
+    string long_name;
+    vector<pair<uint32_t, uint32_t>> lfn_slots;
+
+    string path;
+    DirectoryEntry *parent = nullptr;
+    vector<DirectoryEntry*> children;
+
+    FAT32 *loader = nullptr;
+    once_flag loaded;
+};
+
+// count clusters starting at cluster hold the file from cluster index logical on
+struct Extent
+{
+  uint32_t logical;
+  uint32_t cluster;
+  uint32_t count;
+};
+
+class Node
+{
+  public:
+    void set_size(uint32_t size) { this->size = size; }
+    void set_extents(vector<Extent> extents)
+    {
+      this->extents = std::move(extents);
+    }
+
+    uint32_t get_size() { return size; }
+    vector<Extent>& get_extents() { return extents; }
+
+  private:
+    uint32_t size = 0;
+    vector<Extent> extents;
+};
+
+// Bitmap of the data clusters (1 = in use), allocation prefers contiguous runs
+class FreeSpace
+{
+  public:
+    FreeSpace() {}
+    FreeSpace(vector<uint32_t>& clusters, uint32_t cluster_cnt);
+
+  public:
+    // returns (first cluster, length) runs covering count clusters
+    vector<pair<uint32_t, uint32_t>> allocate(uint32_t count, uint32_t hint);
+    // count contiguous clusters, the first run found from hint on (wrapping around), 0 if there is none
+    uint32_t allocate_run(uint32_t count, uint32_t hint);
+    void release(uint32_t cluster_no);
+    bool is_free(uint32_t cluster_no);
+
+    uint32_t get_free_cnt()     { return free_cnt; }
+    uint32_t get_next_free()    { return next_free; }
+    uint32_t get_max_cluster()  { return max_cluster; }
+
+  private:
+    uint32_t find_free(uint32_t from);
+    uint32_t find_used(uint32_t from, uint32_t limit = 0xFFFFFFFF);
+    void take(uint32_t first, uint32_t len, vector<pair<uint32_t, uint32_t>>& runs);
+
+  private:
+    vector<uint64_t> bits;
+    uint32_t max_cluster = 0;
+    uint32_t free_cnt = 0;
+    uint32_t next_free = 2;
+};
+
+// told about every file an extraction writes, with its contents in order, in pieces
+class ExtractSink
+{
+  public:
+    virtual ~ExtractSink() {}
+
+    virtual void begin_file(DirectoryEntry *dentry) = 0;
+    virtual void file_data(void const *data, size_t size) = 0;
+    virtual void end_file() = 0;
+};
+
+class FAT32
+{
+  friend class Defragmenter;
+  friend class DirectoryEntry;
+  friend class FatMirror;
+  friend class FileReader;
+
+  public:
+    static constexpr uint32_t EOC = 0x0FFFFFFF;
+    // a directory holds at most this many 32 byte slots (2 MiB), the FAT32 limit
+    static constexpr uint32_t DIR_SLOT_MAX = 65536;
+
+    FAT32(string path, bool writable = false);
+    FAT32(FAT32 const&) = delete;
+    ~FAT32();
+
+  public:
+    // lazy: only the root directory is read now, every other directory the
+    // first time its children are asked for (get_children(), lookup()), once
+    // even when several threads ask at the same time
+    void build(bool lazy = false);
+
+    Node to_node(DirectoryEntry *dentry);
+    // the chain from cluster_no as runs of contiguous clusters
+    vector<Extent> to_extents(uint32_t cluster_no);
+
+    // cluster numbers of the chain starting at cluster_no
+    vector<uint32_t> chain(uint32_t cluster_no);
+
+    SuperBlock* get_super_block() { return super_block; }
+    FatArea* get_fat_area() { return fat_area; }
+    DirectoryEntry* get_root_dir() { return root_dir; }
+    // the entry at a '/' separated path from the root, nullptr if there is none;
+    // one hash lookup per component, names match case-insensitively (see fold_name)
+    DirectoryEntry* lookup(string const& path);
+    // the tree below a directory the root does not reach, released with delete_subtree();
+    // directories already in a tree are not descended into again
+    DirectoryEntry* build_subtree(uint32_t cluster_no);
+    void delete_subtree(DirectoryEntry *dentry);
+
+    // image offset of a data cluster, and the cluster holding an image offset
+    // (0 if the offset lies before the data area or past the last cluster)
+    uint64_t cal_data_offset(uint32_t cluster_no);
+    uint32_t cal_cluster_no(uint64_t offset);
+
+    // raw contents of one data cluster, cluster size bytes
+    void read_cluster(uint32_t cluster_no, uint8_t *buffer);
+    // count contiguous clusters with one read, safe to call from several threads
+    void read_clusters(uint32_t cluster_no, uint32_t count, uint8_t *buffer);
+
+    // contents of a file, one read per extent
+    string read_file(DirectoryEntry *dentry);
+    // writes dentry (a file, or a directory recursively) below out_dir;
+    // sink sees the same bytes as they are written, without another read
+    void extract(DirectoryEntry *dentry, string const& out_dir, ExtractSink *sink = nullptr);
+
+  public:
+    // Write path, needs writable = true. Paths are '/' separated from the root,
+    // names that are not 8.3 get long name entries and a NAME~N alias.
+    // FAT and directory changes are kept in memory until flush().
+    DirectoryEntry* create_file(string const& path, string const& data = "");
+    DirectoryEntry* create_file(DirectoryEntry *dir, string const& name, string const& data = "");
+    DirectoryEntry* create_dir(string const& path);
+    DirectoryEntry* create_dir(DirectoryEntry *dir, string const& name);
+    void append(string const& path, string const& data);
+    void append(DirectoryEntry *dentry, string const& data);
+    void truncate(string const& path, uint32_t size);
+    void truncate(DirectoryEntry *dentry, uint32_t size);
+    void remove(string const& path);
+    void remove(DirectoryEntry *dentry);
+
+    void flush();
+
+    // metadata goes through <image>.wal from now on, see WriteAheadLog
+    void enable_wal();
+    // flush on its own once this much metadata is dirty, 0 = only on flush()
+    void set_group_commit(size_t max_dirty_bytes) { group_commit_bytes = max_dirty_bytes; }
+    // timestamp for new and modified entries, 0 = current time
+    void set_timestamp(time_t t) { fixed_time = t; }
+
+    // I/O, cache and parse counters and phase timings of this instance
+    FAT32Stats& get_stats() { return stats; }
+    string get_image_path() { return image_path; }
+    // bytes in the image file, a truncated image holds fewer clusters than the boot sector says
+    uint64_t get_image_size();
+
+  private:
+    struct MetaWrite
+    {
+      uint64_t offset;
+      uint8_t const *data;
+      size_t size;
+    };
+
+    void collect_metadata(vector<MetaWrite>& writes);
+    void commit_if_due();
+
+    void build_dir_tree(DirectoryEntry *parent_entry, uint32_t dir_cluster_no);
+    void load_children(DirectoryEntry *dir);
+    string read_contents(DirectoryEntry *dentry);
+    void extract_tree(DirectoryEntry *dentry, string const& out_dir, ExtractSink *sink);
+
+    void read_at(void *buffer, size_t size, uint64_t offset);
+    // one contiguous stretch of the image scattered over iov, iov is consumed
+    void readv_at(iovec *iov, int iov_cnt, uint64_t offset);
+    // asks the kernel to start reading size bytes at offset, returns at once
+    void prefetch(uint64_t offset, uint64_t size);
+    void write_at(void const *buffer, size_t size, uint64_t offset);
+
+    vector<uint8_t>& dir_cluster(uint32_t cluster_no);
+
+    uint32_t get_fat(uint32_t cluster_no);
+    uint32_t loop_cut(uint32_t start, uint32_t loop_len);
+    void set_fat(uint32_t cluster_no, uint32_t value);
+    void free_chain(uint32_t cluster_no);
+    FreeSpace& free_space();
+    // FreeSpace::allocate(), flushing first when only clusters freed since the last flush() would do
+    vector<pair<uint32_t, uint32_t>> allocate(uint32_t count, uint32_t hint);
+    void release_pending();
+
+    uint32_t link_runs(vector<pair<uint32_t, uint32_t>> const& runs, uint32_t prev);
+    void write_runs(vector<pair<uint32_t, uint32_t>> const& runs, string const& data, size_t from);
+    vector<pair<uint32_t, uint32_t>> find_free_slots(DirectoryEntry *dir, uint32_t count);
+    void update_dentry(DirectoryEntry *dentry);
+    void write_short_entry(uint8_t *slot, string const& short_name, uint8_t attribute, uint32_t first, uint32_t size);
+    string make_alias(DirectoryEntry *dir, string const& name);
+    DirectoryEntry* add_entry(DirectoryEntry *dir, string const& name, uint8_t attribute, uint32_t first, uint32_t size);
+    DirectoryEntry* find_child(DirectoryEntry *dir, string const& name);
+    void index_entry(DirectoryEntry *dentry);
+    void unindex_entry(DirectoryEntry *dentry);
+    pair<DirectoryEntry*, string> split_path(string const& path);
+    void check_writable();
+    time_t now();
+
+  private:
+    SuperBlock *super_block;
+    FatArea *fat_area;
+    DirectoryEntry *root_dir = nullptr;
+
+    string image_path;
+    int fd = -1;
+    bool writable;
+
+    FreeSpace *free_map = nullptr;
+
+    // directory clusters read so far, the dirty ones are written on flush()
+    unordered_map<uint32_t, vector<uint8_t>> dir_cache;
+    set<uint32_t> dirty_dir_clusters;
+
+    // FAT sectors (relative to the start of a FAT copy) changed since flush()
+    set<uint32_t> dirty_fat_sectors;
+
+    WriteAheadLog *wal = nullptr;
+    size_t group_commit_bytes = 0;
+    time_t fixed_time = 0;
+    vector<uint8_t> fs_info_buffer;
+
+    // per directory (by start cluster) the (cluster, slot) to look for a free slot from
+    unordered_map<uint32_t, pair<uint32_t, uint32_t>> dir_free_hint;
+
+    // clusters freed since the last flush(): the FAT and directory on disk
+    // still refer to them, so they are not handed out again before that
+    vector<uint32_t> pending_free;
+
+    // start clusters of the directories build() has descended into (or, lazily, found)
+    unordered_set<uint32_t> visited_dirs;
+    // directory clusters build_dir_tree() has parsed, each is parsed once
+    unordered_set<uint32_t> parsed_dir_clusters;
+    bool lazy = false;
+
+    // taken exclusively while a lazy directory is read, shared by lookups
+    shared_mutex tree_lock;
+
+    // (parent, folded name) of every entry in the tree, long and 8.3 name both
+    struct NameKey
+    {
+      DirectoryEntry *parent;
+      string name;
+
+      bool operator==(NameKey const& other) const { return parent == other.parent && name == other.name; }
+    };
+
+    struct NameKeyHash
+    {
+      size_t operator()(NameKey const& key) const
+      {
+        return hash<string>()(key.name) ^ (hash<DirectoryEntry*>()(key.parent) * 0x9E3779B97F4A7C15ULL);
+      }
+    };
+
+    unordered_map<NameKey, DirectoryEntry*, NameKeyHash> name_index;
+
+    FAT32Stats stats;
+};
+
+inline void DirectoryEntry::load_children()
+{
+  if (loader != nullptr)
+    call_once(loaded, [this] { loader->load_children(this); });
+}
+
+// checksum of an 11 byte 8.3 name, as stored in its long name entries
+uint8_t lfn_checksum(uint8_t const *short_name);
+// UTF-8 of a long name, up to the 0x0000 terminator or 0xFFFF padding
+string decode_lfn(u16string const& lfn);
+// FAT matches names without regard to case: ASCII letters fold to upper case,
+// like 8.3 names are stored; other characters compare as they are
+string fold_name(string name);
+// a name from the image can be anything: "..", or with '/' or NUL in it. is_safe_name()
+// tells whether it is a single path component, safe_name() makes it one ("_..", '/' -> '_')
+bool is_safe_name(string const& name);
+string safe_name(string name);
+// directory slots an entry named name takes: the 8.3 entry and one per 13 characters of a long name
+uint32_t entry_slot_cnt(string const& name);
+// time_t of a FAT date and time, 0 for a date of 0 (never set)
+time_t from_fat_time(uint16_t date, uint16_t time);
+// mkdir -p
+void create_dirs(string const& path);
+// creates or replaces path with data
+void write_file(string const& path, string const& data);
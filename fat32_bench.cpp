@@ -0,0 +1,401 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "byte_buffer.hpp"
+#include "fat32.hpp"
+#include "fat_mirror.hpp"
+#include "file_reader.hpp"
+#include "fat32_format.hpp"
+#include "hash.hpp"
+#include "image_generator.hpp"
+
+using namespace std;
+
+//
+// Micro and end-to-end benchmarks. Images are generated once per process
+// under $TMPDIR and removed on exit. Besides the console table,
+//
+//   fat32_bench --benchmark_out=result.json --benchmark_out_format=json
+//               --benchmark_repetitions=10
+//
+// gives the JSON the regression dashboards read.
+//
+
+static string tmp_dir()
+{
+  char const *dir = getenv("TMPDIR");
+  return dir != nullptr && *dir != '\0' ? dir : "/tmp";
+}
+
+// generated images keyed by (file count, fragmentation in percent)
+class BenchImages
+{
+  public:
+    ~BenchImages()
+    {
+      for (auto& [key, path] : images)
+        unlink(path.c_str());
+    }
+
+    string const& get(uint64_t file_cnt, int frag_pct)
+    {
+      auto it = images.find({file_cnt, frag_pct});
+      if (it != images.end())
+        return it->second;
+
+      string path = tmp_dir() + "/fat32_bench_" + to_string(getpid()) + "_"
+          + to_string(file_cnt) + "_" + to_string(frag_pct) + ".img";
+
+      GeneratorOptions options;
+      options.size = max<uint64_t>(1ULL << 30, file_cnt * (32ULL << 10));
+      options.file_cnt = file_cnt;
+      options.depth = 2;
+      options.fanout = 8;
+      options.min_size = 0;
+      options.max_size = 16 << 10;
+      options.dist = SizeDistribution::UNIFORM;
+      options.frag = frag_pct / 100.0;
+      options.lfn = 0.3;
+      options.deleted = 0.05;
+      options.seed = 42;
+      generate_image(path, options);
+
+      return images.emplace(make_pair(file_cnt, frag_pct), path).first->second;
+    }
+
+  private:
+    map<pair<uint64_t, int>, string> images;
+};
+
+static BenchImages bench_images;
+
+static void walk(DirectoryEntry *dir, vector<DirectoryEntry*>& files, uint64_t& entry_cnt)
+{
+  for (auto child : dir->get_children()) {
+    entry_cnt++;
+    if (child->is_dir())
+      walk(child, files, entry_cnt);
+    else
+      files.push_back(child);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// decoding
+//
+////////////////////////////////////////////////////////////////////////////////
+
+static void BM_ByteBufferGetUint32(benchmark::State& state)
+{
+  vector<uint8_t> data(4096);
+  mt19937 rng(1);
+  for (auto& b : data)
+    b = rng();
+
+  for (auto _ : state) {
+    sys::io::byte_buffer bb(data.data(), (int)data.size());
+    uint32_t sum = 0;
+    for (int i = 0; i < 1024; i++)
+      sum += bb.get_uint32_le();
+    benchmark::DoNotOptimize(sum);
+  }
+
+  state.SetItemsProcessed(state.iterations() * 1024);
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ByteBufferGetUint32);
+
+static void BM_ByteBufferGetUint16At(benchmark::State& state)
+{
+  vector<uint8_t> data(4096, 0x5A);
+
+  for (auto _ : state) {
+    sys::io::byte_buffer bb(data.data(), (int)data.size());
+    uint32_t sum = 0;
+    for (int at = 0; at < 4096; at += 2)
+      sum += bb.get_uint16_le(at);
+    benchmark::DoNotOptimize(sum);
+  }
+
+  state.SetItemsProcessed(state.iterations() * 2048);
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ByteBufferGetUint16At);
+
+static void BM_SuperBlockDecode(benchmark::State& state)
+{
+  vector<uint8_t> sector(512, 0);
+  SuperBlock geometry(512, 8, 32, 2, 2048, 4 << 20);
+  geometry.encode(sector.data(), "BENCH", 0x1234);
+
+  for (auto _ : state) {
+    SuperBlock super_block(sector.data(), 96);
+    benchmark::DoNotOptimize(super_block.get_fat_offset());
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SuperBlockDecode);
+
+static void BM_DirectoryEntryDecode(benchmark::State& state)
+{
+  // one 4K directory cluster of plain file entries
+  vector<uint8_t> cluster(4096, 0);
+  for (int slot = 0; slot < 128; slot++) {
+    sys::io::byte_buffer bb(&cluster[slot * 0x20], 0x20);
+    char name[12];
+    snprintf(name, sizeof(name), "F%07d", slot);
+    bb.put_ascii(name, 8, ' ').put_ascii("DAT", 3, ' ');
+    bb.put_uint8(0x20, 0x0B).put_uint16_le(slot + 2, 0x1A).put_uint32_le(slot * 100, 0x1C);
+  }
+
+  for (auto _ : state) {
+    for (int slot = 0; slot < 128; slot++) {
+      DirectoryEntry dentry(&cluster[slot * 0x20], 0x20);
+      benchmark::DoNotOptimize(dentry.get_start_cluster_no());
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * 128);
+  state.SetBytesProcessed(state.iterations() * cluster.size());
+}
+BENCHMARK(BM_DirectoryEntryDecode);
+
+static void BM_Utf16Decode(benchmark::State& state)
+{
+  int len = state.range(0);
+  vector<uint8_t> data(len * 2);
+  sys::io::byte_buffer writer(data.data(), (int)data.size());
+  for (int i = 0; i < len; i++)
+    writer.put_uint16_le(i % 5 == 0 ? 0x00E9 : 'a' + i % 26);
+
+  for (auto _ : state) {
+    sys::io::byte_buffer bb(data.data(), (int)data.size());
+    benchmark::DoNotOptimize(bb.get_unicode16_le(len));
+  }
+
+  state.SetItemsProcessed(state.iterations() * len);
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Utf16Decode)->Arg(13)->Arg(255);
+
+// two identical FAT copies of range(0) entries, the common case of a healthy mirror
+static void BM_FatMismatch(benchmark::State& state)
+{
+  vector<uint32_t> a(state.range(0)), b;
+  for (size_t i = 0; i < a.size(); i++)
+    a[i] = i + 1;
+  b = a;
+
+  for (auto _ : state)
+    benchmark::DoNotOptimize(fat_mismatch(a.data(), b.data(), 0, a.size()));
+
+  state.SetLabel(fat_mismatch_isa());
+  state.SetBytesProcessed(state.iterations() * a.size() * 8);
+}
+BENCHMARK(BM_FatMismatch)->Arg(1 << 20)->Arg(1 << 24);
+
+// SHA-256 of SHA256_LANES buffers of range(0) bytes, one after the other or in lanes
+static void BM_Sha256(benchmark::State& state)
+{
+  vector<string> buffers(SHA256_LANES, string(state.range(0), 'x'));
+  bool lanes = state.range(1) != 0;
+
+  vector<pair<void const*, size_t>> messages;
+  for (auto& b : buffers)
+    messages.push_back({ b.data(), b.size() });
+  vector<array<uint8_t, 32>> digests;
+
+  for (auto _ : state) {
+    if (lanes) {
+      sha256_lanes(messages, digests);
+    } else {
+      for (auto& b : buffers) {
+        Sha256 sha256;
+        sha256.update(b.data(), b.size());
+        benchmark::DoNotOptimize(sha256.finish());
+      }
+    }
+  }
+
+  state.SetLabel(lanes ? sha256_lanes_isa() : "scalar");
+  state.SetBytesProcessed(state.iterations() * buffers.size() * state.range(0));
+}
+BENCHMARK(BM_Sha256)->Args({4096, 0})->Args({4096, 1})->Args({65536, 0})->Args({65536, 1});
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// generated images
+//
+////////////////////////////////////////////////////////////////////////////////
+
+static void BM_ChainWalk(benchmark::State& state)
+{
+  FAT32 fat32(bench_images.get(state.range(0), state.range(1)));
+  fat32.build();
+
+  vector<DirectoryEntry*> files;
+  uint64_t entry_cnt = 0;
+  walk(fat32.get_root_dir(), files, entry_cnt);
+
+  uint64_t hops = 0;
+  for (auto _ : state) {
+    for (auto file : files) {
+      auto clusters = fat32.chain(file->get_start_cluster_no());
+      hops += clusters.size();
+      benchmark::DoNotOptimize(clusters.data());
+    }
+  }
+
+  state.counters["hops/s"] = benchmark::Counter(hops, benchmark::Counter::kIsRate);
+  state.SetItemsProcessed(state.iterations() * files.size());
+}
+BENCHMARK(BM_ChainWalk)->Args({10000, 0})->Args({10000, 50})->Unit(benchmark::kMicrosecond);
+
+static void BM_ToExtents(benchmark::State& state)
+{
+  FAT32 fat32(bench_images.get(state.range(0), state.range(1)));
+  fat32.build();
+
+  vector<DirectoryEntry*> files;
+  uint64_t entry_cnt = 0;
+  walk(fat32.get_root_dir(), files, entry_cnt);
+
+  for (auto _ : state) {
+    for (auto file : files)
+      benchmark::DoNotOptimize(fat32.to_node(file).get_extents().size());
+  }
+
+  state.SetItemsProcessed(state.iterations() * files.size());
+}
+BENCHMARK(BM_ToExtents)->Args({10000, 0})->Args({10000, 50})->Unit(benchmark::kMicrosecond);
+
+static void BM_BuildTree(benchmark::State& state)
+{
+  string const& path = bench_images.get(state.range(0), 0);
+  uint64_t entry_cnt = 0;
+
+  for (auto _ : state) {
+    FAT32 fat32(path);
+    fat32.build();
+
+    vector<DirectoryEntry*> files;
+    entry_cnt = 0;
+    walk(fat32.get_root_dir(), files, entry_cnt);
+  }
+
+  state.counters["entries/s"] = benchmark::Counter(entry_cnt * state.iterations(), benchmark::Counter::kIsRate);
+  state.counters["entries"] = entry_cnt;
+}
+BENCHMARK(BM_BuildTree)->Arg(1000)->Arg(10000)->Arg(50000)->Unit(benchmark::kMillisecond);
+
+// every file by its full path
+static void BM_Lookup(benchmark::State& state)
+{
+  FAT32 fat32(bench_images.get(state.range(0), 0));
+  fat32.build();
+
+  vector<DirectoryEntry*> files;
+  uint64_t entry_cnt = 0;
+  walk(fat32.get_root_dir(), files, entry_cnt);
+
+  vector<string> paths;
+  for (auto file : files)
+    paths.push_back(file->get_full_path());
+
+  for (auto _ : state) {
+    for (auto& path : paths)
+      benchmark::DoNotOptimize(fat32.lookup(path));
+  }
+
+  state.counters["lookups/s"] = benchmark::Counter(paths.size() * state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Lookup)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+static void BM_ReadAllFiles(benchmark::State& state)
+{
+  FAT32 fat32(bench_images.get(state.range(0), state.range(1)));
+  fat32.build();
+
+  vector<DirectoryEntry*> files;
+  uint64_t entry_cnt = 0;
+  walk(fat32.get_root_dir(), files, entry_cnt);
+
+  uint64_t bytes = 0;
+  for (auto _ : state) {
+    for (auto file : files) {
+      string data = fat32.read_file(file);
+      bytes += data.size();
+      benchmark::DoNotOptimize(data.data());
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * files.size());
+  state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_ReadAllFiles)->Args({10000, 0})->Args({10000, 50})->Unit(benchmark::kMillisecond);
+
+// the first and last 4 KB of every file, one readv each
+static void BM_ReadHeadTail(benchmark::State& state)
+{
+  FAT32 fat32(bench_images.get(state.range(0), state.range(1)));
+  fat32.build();
+
+  vector<DirectoryEntry*> files;
+  uint64_t entry_cnt = 0;
+  walk(fat32.get_root_dir(), files, entry_cnt);
+
+  vector<uint8_t> head(4096), tail(4096);
+  uint64_t bytes = 0;
+
+  for (auto _ : state) {
+    for (auto file : files) {
+      FileReader reader(fat32, file);
+      vector<ReadRequest> requests = {
+        { 0, head.size(), head.data() },
+        { reader.get_size() - min<uint64_t>(reader.get_size(), tail.size()), tail.size(), tail.data() },
+      };
+      bytes += reader.readv(requests);
+    }
+  }
+
+  state.SetBytesProcessed(bytes);
+  state.SetItemsProcessed(state.iterations() * files.size());
+}
+BENCHMARK(BM_ReadHeadTail)->Args({10000, 0})->Args({10000, 50})->Unit(benchmark::kMillisecond);
+
+static void BM_Extract(benchmark::State& state)
+{
+  string const& path = bench_images.get(state.range(0), 0);
+  string out_dir = tmp_dir() + "/fat32_bench_out_" + to_string(getpid());
+  uint64_t bytes = 0;
+
+  for (auto _ : state) {
+    FAT32 fat32(path);
+    fat32.build();
+    fat32.extract(fat32.get_root_dir(), out_dir);
+
+    state.PauseTiming();
+    vector<DirectoryEntry*> files;
+    uint64_t entry_cnt = 0;
+    walk(fat32.get_root_dir(), files, entry_cnt);
+    for (auto file : files)
+      bytes += file->get_file_size();
+    system(("rm -rf '" + out_dir + "'").c_str());
+    state.ResumeTiming();
+  }
+
+  state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_Extract)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,133 @@
+#include "fat32_format.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fat32.hpp"
+
+
+// FAT32 defaults for 512 byte sectors
+static uint32_t default_cluster_size(uint64_t size)
+{
+  uint64_t gb = 1ULL << 30;
+
+  if (size <= 8 * gb)  return 4096;
+  if (size <= 16 * gb) return 8192;
+  if (size <= 32 * gb) return 16384;
+  return 32768;
+}
+
+// smallest FAT that can address every cluster left after it
+static uint32_t fat_sectors(uint32_t total, uint32_t rsvd, uint32_t spc, uint32_t sector_size, uint32_t fat_no)
+{
+  uint64_t per_sector = sector_size / 4;
+  uint64_t fat = ((uint64_t)(total - rsvd) + 2 * spc) / (spc * per_sector + fat_no) + 1;
+
+  while (true) {
+    uint64_t clusters = (total - rsvd - fat * fat_no) / spc;
+    if (fat * per_sector >= clusters + 2)
+      return fat;
+    fat++;
+  }
+}
+
+static void write_all(int fd, void const *buffer, size_t size, uint64_t offset)
+{
+  if (pwrite(fd, buffer, size, offset) != (ssize_t)size)
+    throw runtime_error(string("format: write failed: ") + strerror(errno));
+}
+
+// the boot sector holds the sector count in 32 bits, larger sectors make room for larger volumes
+static uint32_t default_sector_size(uint64_t size)
+{
+  uint32_t ss = 512;
+  while (ss < 4096 && size / ss > 0xFFFFFFFF)
+    ss *= 2;
+
+  return ss;
+}
+
+void format_image(string const& path, FormatOptions const& options)
+{
+  uint32_t ss = options.sector_size ? options.sector_size : default_sector_size(options.size);
+  uint32_t cluster_size = options.cluster_size ? options.cluster_size : max(default_cluster_size(options.size), ss);
+
+  if (ss < 512 || ss > 4096 || (ss & (ss - 1)) != 0)
+    throw invalid_argument("format: sector size must be a power of two in 512..4096");
+  if (cluster_size < ss || cluster_size / ss > 128 || (cluster_size & (cluster_size - 1)) != 0)
+    throw invalid_argument("format: cluster size must be a power of two, 1..128 sectors of " + to_string(ss) + " bytes");
+  if (options.size / ss > 0xFFFFFFFF)
+    throw invalid_argument("format: " + to_string(options.size / ss) + " sectors of " + to_string(ss)
+                           + " bytes, the boot sector counts at most 4294967295"
+                           + (ss < 4096 ? ", use larger sectors" : ", the image is too large for FAT32"));
+
+  uint32_t spc = cluster_size / ss;
+  uint32_t total = options.size / ss;
+  uint32_t rsvd = options.rsvd_sector_cnt;
+
+  if (total <= rsvd + 2 * spc)
+    throw invalid_argument("format: image too small");
+
+  uint32_t fat = fat_sectors(total, rsvd, spc, ss, options.fat_no);
+  SuperBlock sb(ss, spc, rsvd, options.fat_no, fat, total);
+
+  uint32_t clusters = sb.get_cluster_cnt();
+  if (clusters < 65525)
+    throw invalid_argument("format: " + to_string(clusters) + " clusters is too few for FAT32, use smaller clusters");
+  if (clusters > 0x0FFFFFF5)
+    throw invalid_argument("format: " + to_string(clusters) + " clusters, FAT32 allows at most 268435445, use larger clusters");
+
+  uint32_t volume_id = options.volume_id ? options.volume_id : (uint32_t)time(nullptr);
+
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw runtime_error("format: can not create " + path + ": " + strerror(errno));
+
+  try {
+    if (ftruncate(fd, (uint64_t)total * ss) != 0)
+      throw runtime_error(string("format: ftruncate failed: ") + strerror(errno));
+
+    // reserved area up to the backups: boot, FSInfo, ..., backup boot, backup FSInfo
+    vector<uint8_t> head(8 * ss, 0);
+    sb.encode(&head[0], options.label, volume_id);
+
+    sys::io::byte_buffer fs_info(&head[ss], ss);
+    fs_info.put_uint32_le(0x41615252, 0);
+    fs_info.put_uint32_le(0x61417272, 484);
+    fs_info.put_uint32_le(clusters - 1, 488);   // all free but the root directory
+    fs_info.put_uint32_le(3, 492);
+    fs_info.put_uint32_le(0xAA550000, 508);
+
+    memcpy(&head[6 * ss], &head[0], 2 * ss);
+    write_all(fd, head.data(), head.size(), 0);
+
+    // FAT head: media descriptor, clean-shutdown flags, end of the root chain
+    vector<uint8_t> fat_head(ss, 0);
+    sys::io::byte_buffer fb(fat_head.data(), ss);
+    fb.put_uint32_le(0x0FFFFFF8);
+    fb.put_uint32_le(0x0FFFFFFF);
+    fb.put_uint32_le(0x0FFFFFFF);
+
+    for (uint32_t k = 0; k < options.fat_no; k++)
+      write_all(fd, fat_head.data(), ss, sb.get_fat_offset() + (uint64_t)k * fat * ss);
+
+    // root directory, only the volume label if there is one
+    if (options.label != "NO NAME" && !options.label.empty()) {
+      vector<uint8_t> root(32, 0);
+      sys::io::byte_buffer rb(root.data(), 32);
+      rb.put_ascii(options.label, 11, ' ');
+      rb.put_uint8(0x08);
+      write_all(fd, root.data(), root.size(), sb.get_data_area_addr());
+    }
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+
+  close(fd);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+struct FormatOptions
+{
+  uint64_t size = 0;                 // image size in bytes
+  uint16_t sector_size = 0;          // 0: the smallest of 512..4096 that keeps the sector count in 32 bits
+  uint32_t cluster_size = 0;         // 0: by volume size, like the Windows format defaults
+  uint8_t fat_no = 2;
+  uint16_t rsvd_sector_cnt = 32;
+  string label = "NO NAME";
+  uint32_t volume_id = 0;            // 0: derived from the current time
+};
+
+//
+// Creates a FAT32 image: boot sector, FSInfo and their backups, the head of
+// every FAT copy and the root directory. The image is sized with ftruncate
+// and everything else is left as a hole, so the cost does not depend on
+// the volume size. The file is replaced if it exists.
+//
+void format_image(string const& path, FormatOptions const& options);
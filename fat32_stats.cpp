@@ -0,0 +1,117 @@
+#include "fat32_stats.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+static char const *COUNTER_NAMES[FAT32Stats::COUNTER_CNT] = {
+  "syscalls", "read_calls", "write_calls", "sync_calls", "bytes_read", "bytes_written",
+  "clusters_read", "cache_hits", "cache_misses", "chain_hops",
+  "dentry_file", "dentry_dir", "dentry_lfn", "dentry_deleted", "dentry_dot", "dentry_other",
+  "readahead_calls", "readahead_bytes",
+};
+
+static char const *PHASE_NAMES[FAT32Stats::PHASE_CNT] = {
+  "boot_sector", "fat_load", "tree_build", "extraction", "flush",
+};
+
+char const* FAT32Stats::counter_name(Counter counter)
+{
+  return COUNTER_NAMES[counter];
+}
+
+char const* FAT32Stats::phase_name(Phase phase)
+{
+  return PHASE_NAMES[phase];
+}
+
+void FAT32Stats::reset()
+{
+  for (auto& c : counters)
+    c.store(0, memory_order_relaxed);
+  for (auto& t : phase_ns)
+    t.store(0, memory_order_relaxed);
+}
+
+string FAT32Stats::to_json()
+{
+  string res = "{\n  \"counters\": {\n";
+
+  for (int i = 0; i < COUNTER_CNT; i++) {
+    res += "    \"" + string(COUNTER_NAMES[i]) + "\": " + to_string(get((Counter)i));
+    res += i + 1 < COUNTER_CNT ? ",\n" : "\n";
+  }
+
+  res += "  },\n  \"phase_ns\": {\n";
+
+  for (int i = 0; i < PHASE_CNT; i++) {
+    res += "    \"" + string(PHASE_NAMES[i]) + "\": " + to_string(get_time_ns((Phase)i));
+    res += i + 1 < PHASE_CNT ? ",\n" : "\n";
+  }
+
+  res += "  }\n}\n";
+
+  return res;
+}
+
+// backslash, quote and newline are the only escapes in label values
+static string escape_label(string const& value)
+{
+  string res;
+
+  for (char c : value) {
+    if (c == '\n')
+      res += "\\n";
+    else if (c == '\\' || c == '"')
+      res += string("\\") + c;
+    else
+      res += c;
+  }
+
+  return res;
+}
+
+string FAT32Stats::to_prometheus(string const& image)
+{
+  string label = "image=\"" + escape_label(image) + "\"";
+  string res;
+
+  for (int i = 0; i < COUNTER_CNT; i++) {
+    string metric = "fat32_" + string(COUNTER_NAMES[i]) + "_total";
+    res += "# TYPE " + metric + " counter\n";
+    res += metric + "{" + label + "} " + to_string(get((Counter)i)) + "\n";
+  }
+
+  res += "# TYPE fat32_phase_seconds_total counter\n";
+
+  for (int i = 0; i < PHASE_CNT; i++) {
+    char value[32];
+    snprintf(value, sizeof(value), "%.9f", get_time_ns((Phase)i) / 1e9);
+    res += "fat32_phase_seconds_total{" + label + ",phase=\"" + PHASE_NAMES[i] + "\"} " + value + "\n";
+  }
+
+  return res;
+}
+
+void FAT32Stats::dump(string const& path, string const& image)
+{
+  bool prometheus = path.size() >= 5 && path.compare(path.size() - 5, 5, ".prom") == 0;
+  string text = prometheus ? to_prometheus(image) : to_json();
+  string tmp = path + ".tmp";
+
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw runtime_error("error creating " + tmp + ": " + strerror(errno));
+
+  bool ok = write(fd, text.data(), text.size()) == (ssize_t)text.size();
+  ok = close(fd) == 0 && ok;
+
+  // scrapers never see a half written file
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    throw runtime_error("error writing " + path + ": " + strerror(errno));
+  }
+}
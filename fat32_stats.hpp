@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+//
+// Counters of one FAT32 instance. Updates are relaxed atomic adds, so they
+// may be read (and dumped) while another thread is using the image.
+//
+class FAT32Stats
+{
+  public:
+    enum Counter
+    {
+      SYSCALLS,               // pread, pwrite, fsync, fdatasync, fadvise on the image
+      READ_CALLS,
+      WRITE_CALLS,
+      SYNC_CALLS,
+      BYTES_READ,
+      BYTES_WRITTEN,
+      CLUSTERS_READ,          // data and directory clusters
+      CACHE_HITS,             // directory cluster cache
+      CACHE_MISSES,
+      CHAIN_HOPS,             // FAT links followed
+      DENTRY_FILE,            // directory entries parsed, by type
+      DENTRY_DIR,
+      DENTRY_LFN,
+      DENTRY_DELETED,
+      DENTRY_DOT,
+      DENTRY_OTHER,           // volume label, hidden, system
+      READAHEAD_CALLS,        // posix_fadvise(WILLNEED) hints, see FAT32::prefetch()
+      READAHEAD_BYTES,
+      COUNTER_CNT
+    };
+
+    enum Phase
+    {
+      BOOT_SECTOR,
+      FAT_LOAD,
+      TREE_BUILD,
+      EXTRACTION,
+      FLUSH,
+      PHASE_CNT
+    };
+
+    // adds the time from construction to destruction to phase, less the time
+    // of timers nested inside it on the same thread (a lazy TREE_BUILD during
+    // EXTRACTION counts as TREE_BUILD only), so the phases do not overlap
+    class PhaseTimer
+    {
+      public:
+        PhaseTimer(FAT32Stats& stats, Phase phase)
+          : stats(stats), phase(phase), start(chrono::steady_clock::now()), outer(current)
+        {
+          current = this;
+        }
+
+        ~PhaseTimer()
+        {
+          uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+          stats.add_time(phase, ns - min(ns, nested_ns));
+
+          if (outer != nullptr && &outer->stats == &stats)
+            outer->nested_ns += ns;
+          current = outer;
+        }
+
+      private:
+        FAT32Stats& stats;
+        Phase phase;
+        chrono::steady_clock::time_point start;
+        uint64_t nested_ns = 0;
+        PhaseTimer *outer;
+
+        static inline thread_local PhaseTimer *current = nullptr;
+    };
+
+  public:
+    void add(Counter counter, uint64_t n = 1) { counters[counter].fetch_add(n, memory_order_relaxed); }
+    void add_time(Phase phase, uint64_t ns)   { phase_ns[phase].fetch_add(ns, memory_order_relaxed); }
+
+    uint64_t get(Counter counter)             { return counters[counter].load(memory_order_relaxed); }
+    uint64_t get_time_ns(Phase phase)         { return phase_ns[phase].load(memory_order_relaxed); }
+
+    void reset();
+
+    static char const* counter_name(Counter counter);
+    static char const* phase_name(Phase phase);
+
+    string to_json();
+    // Prometheus text exposition format, every sample labelled with image
+    string to_prometheus(string const& image);
+    // replaces path atomically, Prometheus format if it ends in ".prom"
+    void dump(string const& path, string const& image);
+
+  private:
+    atomic<uint64_t> counters[COUNTER_CNT] = {};
+    atomic<uint64_t> phase_ns[PHASE_CNT] = {};
+};
@@ -0,0 +1,1096 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fat32.hpp"
+#include "carver.hpp"
+#include "cluster_map.hpp"
+#include "defrag.hpp"
+#include "fat32_format.hpp"
+#include "fat_mirror.hpp"
+#include "file_reader.hpp"
+#include "fsck.hpp"
+#include "hash.hpp"
+#include "image_generator.hpp"
+#include "recovery.hpp"
+#include "tar_export.hpp"
+#include "wal.hpp"
+
+using namespace std;
+
+//
+// Round trips through the write path: each test formats a scratch image,
+// changes it, reopens it and checks the result. Run by ctest; exits with 1
+// when a check fails.
+//
+
+static vector<pair<string, function<void()>>> tests;
+static int failed_cnt = 0;
+
+#define TEST(name) \
+  static void name(); \
+  static bool name##_added = (tests.push_back({ #name, name }), true); \
+  static void name()
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) \
+      throw runtime_error(string(__FILE__) + ":" + to_string(__LINE__) + ": " + #cond); \
+  } while (0)
+
+// a formatted image under $TMPDIR, removed with its log at the end of the test
+struct ScratchImage
+{
+  string path;
+
+  ScratchImage(uint64_t size = 64 << 20, uint32_t cluster_size = 512)
+  {
+    char const *dir = getenv("TMPDIR");
+    path = string(dir != nullptr ? dir : "/tmp") + "/fat32_test." + to_string(getpid()) + ".img";
+
+    FormatOptions options;
+    options.size = size;
+    options.cluster_size = cluster_size;
+    options.volume_id = 0x12345678;
+    format_image(path, options);
+  }
+
+  ~ScratchImage()
+  {
+    unlink(path.c_str());
+    unlink((path + ".wal").c_str());
+  }
+};
+
+static string pattern(size_t size, char seed)
+{
+  string data(size, 0);
+  for (size_t i = 0; i < size; i++)
+    data[i] = seed + i % 23;
+  return data;
+}
+
+static string read_whole(string const& path)
+{
+  ifstream in(path, ios::binary);
+  stringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+static void write_whole(string const& path, string const& data)
+{
+  ofstream out(path, ios::binary | ios::trunc);
+  out.write(data.data(), data.size());
+}
+
+static bool fsck_clean(string const& path)
+{
+  FAT32 fat32(path);
+  fat32.build();
+
+  FsckReport report = Fsck(fat32).run();
+  for (auto& issue : report.issues)
+    cerr << "  " << Fsck::kind_name(issue.kind) << " " << issue.path << " " << issue.cluster << " " << issue.detail << endl;
+
+  return report.is_clean();
+}
+
+TEST(create_remove_flush_reopen)
+{
+  ScratchImage image;
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    fat32.create_dir("/docs");
+    fat32.create_file("/docs/keep.txt", pattern(5000, 'a'));
+    fat32.create_file("/docs/gone.txt", pattern(3000, 'b'));
+    fat32.create_file("/a rather long file name.bin", pattern(70000, 'c'));
+    fat32.create_file("/short.txt", pattern(9000, 'd'));
+    fat32.flush();
+
+    fat32.remove("/docs/gone.txt");
+    fat32.truncate("/short.txt", 1000);
+    fat32.append("/docs/keep.txt", pattern(2000, 'e'));
+    fat32.create_file("/docs/new.txt", pattern(4000, 'f'));
+    fat32.flush();
+  }
+
+  CHECK(fsck_clean(image.path));
+
+  FAT32 fat32(image.path);
+  fat32.build();
+  CHECK(fat32.lookup("/docs/gone.txt") == nullptr);
+  CHECK(fat32.read_file(fat32.lookup("/docs/keep.txt")) == pattern(5000, 'a') + pattern(2000, 'e'));
+  CHECK(fat32.read_file(fat32.lookup("/docs/new.txt")) == pattern(4000, 'f'));
+  CHECK(fat32.read_file(fat32.lookup("/a rather long file name.bin")) == pattern(70000, 'c'));
+  CHECK(fat32.read_file(fat32.lookup("/short.txt")) == pattern(1000, 'd'));
+}
+
+// the image still points at a removed file's clusters until flush(), new data must go elsewhere
+TEST(freed_clusters_wait_for_flush)
+{
+  ScratchImage image;
+
+  FAT32 fat32(image.path, true);
+  fat32.build();
+  fat32.create_file("/grow.bin", pattern(512, 'a'));
+  DirectoryEntry *old_file = fat32.create_file("/old.bin", pattern(8192, 'b'));
+  vector<uint32_t> old_chain = fat32.chain(old_file->get_start_cluster_no());
+  fat32.create_file("/big.bin", pattern(65536, 'c'));
+  fat32.flush();
+
+  // appending to grow.bin looks for clusters right where old.bin was
+  fat32.remove("/old.bin");
+  fat32.truncate("/big.bin", 0);
+  fat32.append("/grow.bin", pattern(8192, 'd'));
+  vector<uint32_t> grown_chain = fat32.chain(fat32.lookup("/grow.bin")->get_start_cluster_no());
+  for (uint32_t c : old_chain)
+    CHECK(find(grown_chain.begin(), grown_chain.end(), c) == grown_chain.end());
+
+  // what is on disk now, as a crash would leave it: the old file, intact
+  {
+    FAT32 on_disk(image.path);
+    on_disk.build();
+    CHECK(on_disk.read_file(on_disk.lookup("/old.bin")) == pattern(8192, 'b'));
+    CHECK(on_disk.read_file(on_disk.lookup("/big.bin")) == pattern(65536, 'c'));
+  }
+
+  fat32.flush();
+  fat32.create_file("/reused.bin", pattern(65536, 'e'));
+  fat32.flush();
+
+  CHECK(fsck_clean(image.path));
+}
+
+// a committed batch is applied by replay(), a torn or uncommitted one is dropped and the image left alone
+TEST(wal_replay_committed_only)
+{
+  ScratchImage image;
+  string log_path = image.path + ".wal";
+  string before = read_whole(image.path);
+
+  {
+    WriteAheadLog log(log_path);
+    log.add(4096, (uint8_t const*)"first record", 12);
+    log.add(1024, (uint8_t const*)"second", 6);
+    log.commit();
+  }
+  string committed = read_whole(log_path);
+
+  auto replay = [&](string const& log_bytes) {
+    write_whole(image.path, before);
+    write_whole(log_path, log_bytes);
+    WriteAheadLog log(log_path);
+    int fd = open(image.path.c_str(), O_RDWR);
+    bool replayed = log.replay(fd);
+    close(fd);
+    CHECK(!log.has_pending());
+    return replayed;
+  };
+
+  CHECK(replay(committed));
+  string after = read_whole(image.path);
+  CHECK(after.substr(4096, 12) == "first record");
+  CHECK(after.substr(1024, 6) == "second");
+
+  // torn in the middle of a record
+  CHECK(!replay(committed.substr(0, 24 + 16 + 5)));
+  CHECK(read_whole(image.path) == before);
+
+  // every record there, the commit trailer missing
+  CHECK(!replay(committed.substr(0, committed.size() - 16)));
+  CHECK(read_whole(image.path) == before);
+
+  // a record's data damaged
+  string damaged = committed;
+  damaged[24 + 16] ^= 1;
+  CHECK(!replay(damaged));
+  CHECK(read_whole(image.path) == before);
+}
+
+// a crash after the log commit but before the image writes: opening the image writable finishes the flush
+TEST(wal_replay_on_open)
+{
+  ScratchImage image;
+  string log_path = image.path + ".wal";
+  string unflushed, flushed;
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    fat32.enable_wal();
+    fat32.create_dir("/logs");
+    fat32.create_file("/logs/a long name.txt", pattern(20000, 'a'));
+    unflushed = read_whole(image.path);
+    fat32.flush();
+    flushed = read_whole(image.path);
+  }
+
+  // the batch flush() logged: the sectors it changed
+  string log_bytes;
+  {
+    WriteAheadLog log(log_path);
+    for (size_t offset = 0; offset < flushed.size(); offset += 512) {
+      if (flushed.compare(offset, 512, unflushed, offset, 512) != 0)
+        log.add(offset, (uint8_t const*)&flushed[offset], 512);
+    }
+    CHECK(log.get_record_cnt() > 0);
+    log.commit();
+  }
+  log_bytes = read_whole(log_path);
+
+  write_whole(image.path, unflushed);
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    CHECK(fat32.read_file(fat32.lookup("/logs/a long name.txt")) == pattern(20000, 'a'));
+  }
+  CHECK(read_whole(image.path) == flushed);
+  CHECK(fsck_clean(image.path));
+
+  // the same batch without its trailer was never applied: nothing of it shows up
+  write_whole(image.path, unflushed);
+  write_whole(log_path, log_bytes.substr(0, log_bytes.size() - 16));
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    CHECK(fat32.lookup("/logs") == nullptr);
+  }
+  CHECK(read_whole(image.path) == unflushed);
+  CHECK(fsck_clean(image.path));
+}
+
+static bool exists(string const& path)
+{
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+// the one part long name starting "abc" in the directory at dir_offset becomes ".."
+static void set_dotdot_name(string const& path, uint64_t dir_offset)
+{
+  string bytes = read_whole(path);
+  size_t lfn = bytes.find(string("a\0b\0c\0", 6), dir_offset) - 1;
+  CHECK(lfn >= dir_offset && lfn < dir_offset + 512);
+
+  char16_t name[13] = { u'.', u'.', 0, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF };
+  memcpy(&bytes[lfn + 1], name, 10);
+  memcpy(&bytes[lfn + 14], name + 5, 12);
+  memcpy(&bytes[lfn + 28], name + 11, 4);
+  write_whole(path, bytes);
+}
+
+// names that would leave the output directory are refused when written and renamed when extracted
+TEST(unsafe_names)
+{
+  ScratchImage image;
+  uint64_t root_offset;
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    for (string name : vector<string>{ ".", "..", "a/b", string("nul\0name", 8) }) {
+      bool refused = false;
+      try {
+        fat32.create_file(fat32.get_root_dir(), name, "x");
+      } catch (invalid_argument const&) {
+        refused = true;
+      }
+      CHECK(refused);
+    }
+
+    fat32.create_dir("/abc.defghijk");
+    fat32.create_file("/abc.defghijk/INSIDE.TXT", "escaped?");
+    fat32.flush();
+    root_offset = fat32.cal_data_offset(fat32.get_root_dir()->get_start_cluster_no());
+  }
+
+  // the directory's long name becomes ".." on disk
+  set_dotdot_name(image.path, root_offset);
+
+  string out = image.path + ".out";
+  {
+    FAT32 fat32(image.path);
+    fat32.build();
+    fat32.extract(fat32.get_root_dir(), out + "/inner");
+  }
+
+  bool escaped = exists(out + "/INSIDE.TXT");
+  bool renamed = exists(out + "/inner/_../INSIDE.TXT");
+  unlink((out + "/INSIDE.TXT").c_str());
+  unlink((out + "/inner/_../INSIDE.TXT").c_str());
+  rmdir((out + "/inner/_..").c_str());
+  rmdir((out + "/inner").c_str());
+  rmdir(out.c_str());
+
+  CHECK(!escaped);
+  CHECK(renamed);
+}
+
+// the same for deleted files below such a directory
+TEST(unsafe_names_recovered)
+{
+  ScratchImage image;
+  uint64_t root_offset;
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    fat32.create_dir("/abc.defghijk");
+    fat32.create_file("/abc.defghijk/INSIDE.TXT", "escaped?");
+    fat32.flush();
+    fat32.remove("/abc.defghijk/INSIDE.TXT");
+    fat32.flush();
+    root_offset = fat32.cal_data_offset(fat32.get_root_dir()->get_start_cluster_no());
+  }
+
+  set_dotdot_name(image.path, root_offset);
+
+  string out = image.path + ".out";
+  {
+    FAT32 fat32(image.path);
+    fat32.build();
+    Recovery recovery(fat32);
+    vector<DeletedEntry> entries = recovery.scan();
+    CHECK(entries.size() == 1 && entries[0].path == "/_../_NSIDE.TXT");
+    CHECK(recovery.recover(entries, out + "/inner") == 1);
+  }
+
+  // deleting took the first character of the 8.3 name
+  bool escaped = exists(out + "/_NSIDE.TXT");
+  bool renamed = exists(out + "/inner/_../_NSIDE.TXT");
+  unlink((out + "/_NSIDE.TXT").c_str());
+  unlink((out + "/inner/_../_NSIDE.TXT").c_str());
+  rmdir((out + "/inner/_..").c_str());
+  rmdir((out + "/inner").c_str());
+  rmdir(out.c_str());
+
+  CHECK(!escaped);
+  CHECK(renamed);
+}
+
+TEST(stats_labels_and_phases)
+{
+  ScratchImage image;
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    for (int d = 0; d < 20; d++) {
+      DirectoryEntry *dir = fat32.create_dir(fat32.get_root_dir(), "dir" + to_string(d));
+      for (int f = 0; f < 20; f++)
+        fat32.create_file(dir, "file" + to_string(f) + ".txt", pattern(100 * f, 'a'));
+    }
+    fat32.flush();
+  }
+
+  FAT32 fat32(image.path);
+  CHECK(fat32.get_stats().to_prometheus("a \"b\"\\c\nd").find("image=\"a \\\"b\\\"\\\\c\\nd\"") != string::npos);
+
+  // directories read while extracting count as TREE_BUILD, not twice
+  string out = image.path + ".out";
+  auto start = chrono::steady_clock::now();
+  fat32.build(true);
+  fat32.extract(fat32.get_root_dir(), out);
+  uint64_t wall = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+  system(("rm -rf '" + out + "'").c_str());
+
+  FAT32Stats& stats = fat32.get_stats();
+  CHECK(stats.get_time_ns(FAT32Stats::TREE_BUILD) + stats.get_time_ns(FAT32Stats::EXTRACTION) <= wall);
+}
+
+// writes one entry of every FAT copy, or of only one, straight into the image
+static void set_fat_raw(string const& path, uint32_t cluster_no, uint32_t value, int only_copy = -1)
+{
+  FAT32 fat32(path);
+  SuperBlock *sb = fat32.get_super_block();
+
+  int fd = open(path.c_str(), O_RDWR);
+  for (uint32_t k = 0; k < sb->get_fat_no(); k++) {
+    if (only_copy >= 0 && k != (uint32_t)only_copy)
+      continue;
+    uint64_t offset = sb->get_fat_offset() + (uint64_t)k * sb->get_fat_sector_no() * sb->get_sector_size() + cluster_no * 4;
+    CHECK(pwrite(fd, &value, 4, offset) == 4);
+  }
+  close(fd);
+}
+
+// a loop of allocated clusters no entry refers to and nothing links into from outside
+TEST(fsck_headless_loop)
+{
+  ScratchImage image;
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    fat32.create_file("/a.txt", pattern(3000, 'a'));
+    fat32.flush();
+  }
+  CHECK(fsck_clean(image.path));
+
+  set_fat_raw(image.path, 1000, 1001);
+  set_fat_raw(image.path, 1001, 1002);
+  set_fat_raw(image.path, 1002, 1000);
+
+  // and a lost chain with a head whose end loops
+  set_fat_raw(image.path, 2000, 2001);
+  set_fat_raw(image.path, 2001, 2002);
+  set_fat_raw(image.path, 2002, 2001);
+
+  FAT32 fat32(image.path);
+  fat32.build();
+  FsckReport report = Fsck(fat32, 2).run();
+
+  CHECK(!report.is_clean());
+  CHECK(report.lost_cluster_cnt == 6);
+
+  bool headless = false, headed = false;
+  for (auto& issue : report.issues) {
+    if (issue.kind != FsckIssue::LOST_CLUSTERS)
+      continue;
+    headless |= issue.cluster >= 1000 && issue.cluster <= 1002 && issue.count == 3;
+    headed |= issue.cluster == 2000 && issue.count == 3;
+  }
+  CHECK(headless);
+  CHECK(headed);
+}
+
+// FAT #2 lost a link, FAT #1 another one: each range is repaired from the copy that still has it
+TEST(fat_mirror_repair)
+{
+  ScratchImage image;
+  uint32_t first, second;
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    first = fat32.create_file("/first.bin", pattern(4000, 'a'))->get_start_cluster_no();
+    fat32.create_file("/gap.bin", pattern(40000, 'b'));
+    second = fat32.create_file("/second.bin", pattern(4000, 'c'))->get_start_cluster_no();
+    fat32.flush();
+  }
+
+  set_fat_raw(image.path, first + 1, 0, 1);
+  set_fat_raw(image.path, second + 2, 0, 0);
+  CHECK(!fsck_clean(image.path));
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    FatMirror mirror(fat32);
+    auto ranges = mirror.compare();
+    CHECK(ranges.size() == 2);
+    CHECK(ranges[0].trusted_copy == 0 && ranges[1].trusted_copy == 1);
+
+    fat32.enable_wal();
+    mirror.apply(ranges);
+    fat32.flush();
+  }
+
+  CHECK(fsck_clean(image.path));
+
+  FAT32 fat32(image.path);
+  fat32.build();
+  CHECK(FatMirror(fat32).compare().empty());
+  CHECK(fat32.read_file(fat32.lookup("/first.bin")) == pattern(4000, 'a'));
+  CHECK(fat32.read_file(fat32.lookup("/second.bin")) == pattern(4000, 'c'));
+}
+
+// a chain that runs into the middle of another has both entries as owners there
+TEST(cluster_map_cross_link)
+{
+  ScratchImage image;
+  uint32_t a, b;
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    a = fat32.create_file("/a.bin", pattern(10 * 512, 'a'))->get_start_cluster_no();
+    b = fat32.create_file("/b.bin", pattern(2 * 512, 'b'))->get_start_cluster_no();
+    fat32.flush();
+  }
+
+  set_fat_raw(image.path, b, a + 3);
+
+  FAT32 fat32(image.path);
+  ClusterMap map(fat32);
+  map.build();
+
+  auto owner_names = [&](uint32_t cluster_no) {
+    vector<string> names;
+    for (auto& owner : map.find_cluster(cluster_no))
+      names.push_back(owner.dentry != nullptr ? owner.dentry->get_name() : "");
+    sort(names.begin(), names.end());
+    return names;
+  };
+
+  CHECK(owner_names(a + 1) == vector<string>{ "A.BIN" });
+  CHECK(owner_names(a + 5) == (vector<string>{ "A.BIN", "B.BIN" }));
+  CHECK(owner_names(a + 9) == (vector<string>{ "A.BIN", "B.BIN" }));
+  CHECK(owner_names(b) == vector<string>{ "B.BIN" });
+  CHECK(owner_names(b + 1) == vector<string>{ "" });
+
+  for (auto& owner : map.find_cluster(a + 5))
+    CHECK(owner.file_offset == (owner.dentry->get_name() == "A.BIN" ? 5 : 3) * 512);
+}
+
+// chains that loop back stop before the first repeated cluster, and a directory
+// cluster is parsed once even when another directory's chain runs into it
+TEST(chain_loops)
+{
+  ScratchImage image;
+  uint32_t a, d, root;
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    a = fat32.create_file("/a.bin", pattern(10 * 512, 'a'))->get_start_cluster_no();
+    fat32.create_dir("/d");
+    d = fat32.lookup("/d")->get_start_cluster_no();
+    fat32.create_file("/d/x.txt", "x");
+    root = fat32.get_super_block()->get_root_cluster_addr();
+    fat32.flush();
+  }
+
+  set_fat_raw(image.path, a + 9, a + 4);
+  set_fat_raw(image.path, root, root);
+  set_fat_raw(image.path, d, root);
+
+  FAT32 fat32(image.path);
+  vector<uint32_t> clusters = fat32.chain(a);
+  CHECK(clusters.size() == 10);
+  for (uint32_t i = 0; i < 10; i++)
+    CHECK(clusters[i] == a + i);
+
+  vector<Extent> extents = fat32.to_extents(a);
+  CHECK(extents.size() == 1);
+  CHECK(extents[0].logical == 0 && extents[0].cluster == a && extents[0].count == 10);
+
+  CHECK(fat32.chain(root) == vector<uint32_t>{ root });
+
+  fat32.build();
+  CHECK(fat32.get_root_dir()->get_children().size() == 2);
+  vector<DirectoryEntry*>& children = fat32.lookup("/d")->get_children();
+  CHECK(children.size() == 1 && children[0]->get_name() == "X.TXT");
+}
+
+// 3276 names of 20 slots each and "." and ".." fill all but 14 of the 65536 slots
+TEST(directory_slot_limit)
+{
+  ScratchImage image;
+
+  FAT32 fat32(image.path, true);
+  fat32.build();
+  DirectoryEntry *dir = fat32.create_dir("/d");
+
+  auto long_name = [](uint32_t i) {
+    string digits = to_string(i);
+    return string(7 - digits.size(), '0') + digits + string(240, 'n');
+  };
+
+  for (uint32_t i = 0; i < 3276; i++)
+    fat32.create_file(dir, long_name(i), "");
+
+  bool full = false;
+  try {
+    fat32.create_file(dir, long_name(3276), "");
+  } catch (runtime_error const&) {
+    full = true;
+  }
+  CHECK(full);
+
+  // short names still fit in what is left
+  fat32.create_file(dir, "last.txt", "x");
+  fat32.flush();
+  CHECK(fat32.chain(dir->get_start_cluster_no()).size() * 512 / 0x20 == FAT32::DIR_SLOT_MAX);
+  CHECK(fsck_clean(image.path));
+}
+
+// a deleted file of several chunks comes back whole, read a chunk at a time rather than a cluster
+TEST(recovery_in_chunks)
+{
+  ScratchImage image;
+  string data = pattern(5 * 512 * 1024 + 300, 'r');
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    fat32.create_file("/big.bin", data);
+    fat32.flush();
+    fat32.remove("/big.bin");
+    fat32.flush();
+  }
+
+  FAT32 fat32(image.path);
+  fat32.build();
+  Recovery recovery(fat32);
+  vector<DeletedEntry> entries = recovery.scan();
+  CHECK(entries.size() == 1 && entries[0].state == DeletedEntry::RECOVERABLE);
+
+  FAT32Stats& stats = fat32.get_stats();
+  uint64_t calls = stats.get(FAT32Stats::READ_CALLS);
+  CHECK(recovery.read(entries[0]) == data);
+  CHECK(stats.get(FAT32Stats::READ_CALLS) - calls <= 3);
+
+  string out = image.path + ".out";
+  CHECK(recovery.recover(entries, out) == 1);
+  string recovered = read_whole(out + "/_IG.BIN");
+  unlink((out + "/_IG.BIN").c_str());
+  rmdir(out.c_str());
+  CHECK(recovered == data);
+}
+
+// path -> contents of every file below dir
+static void collect_files(FAT32& fat32, DirectoryEntry *dir, map<string, string>& files)
+{
+  for (auto child : dir->get_children()) {
+    if (child->is_dir())
+      collect_files(fat32, child, files);
+    else
+      files[child->get_full_path()] = fat32.read_file(child);
+  }
+}
+
+TEST(defrag_keeps_contents)
+{
+  ScratchImage image;
+
+  GeneratorOptions options;
+  options.size = 64 << 20;
+  options.cluster_size = 512;
+  options.file_cnt = 600;
+  options.max_size = 32 << 10;
+  options.frag = 0.6;
+  options.lfn = 0.3;
+  options.deleted = 0.1;
+  CHECK(generate_image(image.path, options).fragmented_cnt > 0);
+  CHECK(fsck_clean(image.path));
+
+  map<string, string> before, after;
+  {
+    FAT32 fat32(image.path);
+    fat32.build();
+    collect_files(fat32, fat32.get_root_dir(), before);
+  }
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    DefragReport report = Defragmenter(fat32).run();
+    CHECK(report.files_moved > 0);
+    CHECK(report.file_extents_after < report.file_extents_before);
+  }
+
+  CHECK(fsck_clean(image.path));
+
+  FAT32 fat32(image.path);
+  fat32.build();
+  collect_files(fat32, fat32.get_root_dir(), after);
+  CHECK(before.size() > 0 && after == before);
+}
+
+// opening a volume and listing its root reads a few sectors of the FAT, not all of it
+TEST(lazy_open_reads_little)
+{
+  ScratchImage image(2ULL << 40, 32768);
+
+  FAT32 fat32(image.path);
+  fat32.build(true);
+  CHECK(fat32.get_root_dir()->get_children().empty());
+  CHECK(!fat32.get_fat_area()->is_loaded());
+  CHECK(fat32.get_stats().get(FAT32Stats::BYTES_READ) < 256 << 10);
+
+  CHECK(fat32.chain(fat32.get_root_dir()->get_start_cluster_no()).size() == 1);
+}
+
+// two files grown a cluster at a time in turns: every cluster of each is an extent of its own
+TEST(file_reader_extents)
+{
+  ScratchImage image;
+  uint32_t b_start;
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    DirectoryEntry *a = fat32.create_file("/a.bin");
+    DirectoryEntry *b = fat32.create_file("/b.bin");
+    string a_data = pattern(20 * 512, 'a'), b_data = pattern(20 * 512 - 100, 'b');
+    for (size_t pos = 0; pos < a_data.size(); pos += 512) {
+      fat32.append(a, a_data.substr(pos, 512));
+      fat32.append(b, b_data.substr(pos, 512));
+    }
+    b_start = b->get_start_cluster_no();
+    fat32.flush();
+  }
+
+  // /b.bin loses the clusters after its tenth
+  set_fat_raw(image.path, b_start + 18, FAT32::EOC);
+
+  FAT32 fat32(image.path);
+  fat32.build();
+  DirectoryEntry *a = fat32.lookup("/a.bin");
+  string a_data = fat32.read_file(a);
+  CHECK(a_data == pattern(20 * 512, 'a'));
+
+  FileReader reader(fat32, a);
+  CHECK(reader.get_node().get_extents().size() == 20);
+  FAT32Stats& stats = fat32.get_stats();
+
+  // single reads across extent boundaries, and past the end
+  for (uint64_t offset : { 0, 500, 511, 512, 1000, 5000, 10000, 10239 }) {
+    string buffer(1500, 0);
+    size_t n = reader.read(offset, buffer.size(), buffer.data());
+    CHECK(n == min<uint64_t>(1500, a_data.size() - offset));
+    CHECK(buffer.substr(0, n) == a_data.substr(offset, n));
+  }
+  CHECK(reader.read(a_data.size(), 10, nullptr) == 0);
+
+  // the whole file in one preadv: the 512 byte holes of /b.bin are read into scratch space
+  string whole(a_data.size(), 0);
+  vector<ReadRequest> requests = { { 0, whole.size(), whole.data() } };
+  uint64_t calls = stats.get(FAT32Stats::READ_CALLS);
+  CHECK(reader.readv(requests) == a_data.size());
+  CHECK(stats.get(FAT32Stats::READ_CALLS) == calls + 1);
+  CHECK(whole == a_data);
+
+  // overlapping and out of order requests, the same bytes twice cost a second read
+  string x(3000, 0), y(3000, 0), z(100, 0);
+  requests = { { 4000, x.size(), x.data() }, { 300, y.size(), y.data() }, { 4100, z.size(), z.data() } };
+  calls = stats.get(FAT32Stats::READ_CALLS);
+  CHECK(reader.readv(requests) == 6100);
+  CHECK(stats.get(FAT32Stats::READ_CALLS) == calls + 2);
+  CHECK(x == a_data.substr(4000, 3000) && y == a_data.substr(300, 3000) && z == a_data.substr(4100, 100));
+
+  // reads that follow each other grow the window, a jump drops it
+  FileReader stream(fat32, a);
+  string buffer(1024, 0);
+  stream.read(0, 1024, buffer.data());
+  CHECK(stream.get_window() == FileReader::MIN_WINDOW);
+  stream.read(1024, 1024, buffer.data());
+  CHECK(stream.get_window() == 2 * FileReader::MIN_WINDOW);
+  stream.read(2048, 1024, buffer.data());
+  CHECK(stream.get_window() == 4 * FileReader::MIN_WINDOW);
+  stream.read(8000, 1024, buffer.data());
+  CHECK(stream.get_window() == 0);
+
+  // a chain shorter than the size in the entry clamps the file to the chain
+  DirectoryEntry *b = fat32.lookup("/b.bin");
+  FileReader short_reader(fat32, b);
+  CHECK(b->get_file_size() == 20 * 512 - 100);
+  CHECK(short_reader.get_size() == 10 * 512);
+  string tail(1000, 0);
+  CHECK(short_reader.read(10 * 512 - 200, tail.size(), tail.data()) == 200);
+  CHECK(tail.substr(0, 200) == pattern(20 * 512 - 100, 'b').substr(10 * 512 - 200, 200));
+  CHECK(short_reader.read(10 * 512, tail.size(), tail.data()) == 0);
+}
+
+// the same paths, in any case and by long name or 8.3 alias, find the same
+// entries whether the tree is read up front or a directory at a time
+// ("notes.txt" fits 8.3 and is stored as NOTES.TXT)
+TEST(lookup_eager_and_lazy)
+{
+  vector<string> queries = {
+    "/photos archive/summer trip.jpg", "/PHOTOS~1/SUMMER~1.JPG", "/Photos Archive/readme.txt",
+    "/docs/NOTES.TXT", "/DOCS/notes.txt", "//docs//notes.txt", "/docs/notes.txt/x", "/nothing",
+  };
+  vector<string> before = {
+    "/Photos Archive/Summer Trip.JPG", "/Photos Archive/Summer Trip.JPG", "/Photos Archive/README.TXT",
+    "/DOCS/NOTES.TXT", "/DOCS/NOTES.TXT", "/DOCS/NOTES.TXT", "", "",
+  };
+  vector<string> after = before;
+  after[0] = after[1] = "";
+
+  vector<vector<string>> results;
+
+  for (bool lazy : { false, true }) {
+    ScratchImage image;
+
+    {
+      FAT32 fat32(image.path, true);
+      fat32.build();
+      fat32.create_dir("/Photos Archive");
+      fat32.create_file("/Photos Archive/Summer Trip.JPG", "jpg");
+      fat32.create_file("/Photos Archive/README.TXT", "txt");
+      fat32.create_dir("/DOCS");
+      fat32.create_file("/DOCS/notes.txt", "notes");
+      fat32.flush();
+    }
+
+    FAT32 fat32(image.path, true);
+    fat32.build(lazy);
+
+    auto look = [&]() {
+      vector<string> found;
+      for (auto& query : queries) {
+        DirectoryEntry *dentry = fat32.lookup(query);
+        found.push_back(dentry != nullptr ? dentry->get_full_path() : "");
+      }
+      return found;
+    };
+
+    results.push_back(look());
+    CHECK(results.back() == before);
+
+    // neither the long name nor the alias finds a removed entry
+    fat32.remove(fat32.lookup("/photos archive/summer trip.jpg"));
+    results.push_back(look());
+    CHECK(results.back() == after);
+
+    fat32.create_file("/Photos Archive/summer trip.jpg", "again");
+    CHECK(fat32.lookup("/PHOTOS ARCHIVE/SUMMER TRIP.JPG")->get_name() == "summer trip.jpg");
+    fat32.flush();
+  }
+
+  CHECK(results[0] == results[2] && results[1] == results[3]);
+}
+
+// a path of more than 100 bytes goes into prefix and name, one of more than 255 into a pax header
+TEST(tar_long_paths)
+{
+  ScratchImage image;
+  string mid_dir = string(60, 'm'), mid_file = string(50, 'f') + ".txt";
+  string deep_dir = string(130, 'd') + "/" + string(120, 'e'), deep_file = string(30, 'g') + ".bin";
+
+  FAT32 fat32(image.path, true);
+  fat32.build();
+  fat32.create_dir("/" + mid_dir);
+  fat32.create_file("/" + mid_dir + "/" + mid_file, "mid");
+  fat32.create_dir("/" + string(130, 'd'));
+  fat32.create_dir("/" + deep_dir);
+  fat32.create_file("/" + deep_dir + "/" + deep_file, "deep");
+
+  string out = image.path + ".tar";
+  int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK(fd >= 0);
+  TarExport(fat32, fd).write(fat32.get_root_dir());
+  close(fd);
+  string tar = read_whole(out);
+  unlink(out.c_str());
+
+  // path -> (header offset, pax path record or "")
+  map<string, pair<size_t, string>> entries;
+  string pax;
+
+  for (size_t pos = 0; pos + 512 <= tar.size(); pos += 512) {
+    char const *h = &tar[pos];
+    if (h[0] == 0)
+      break;
+
+    // the checksum is the byte sum with its own field read as spaces
+    unsigned sum = 0;
+    for (size_t i = 0; i < 512; i++)
+      sum += i >= 148 && i < 156 ? ' ' : (uint8_t)h[i];
+    CHECK(strtoul(string(h + 148, 8).c_str(), nullptr, 8) == sum);
+    CHECK(string(h + 257, 6) == string("ustar", 6));
+
+    size_t size = strtoull(string(h + 124, 12).c_str(), nullptr, 8);
+    if (h[156] == 'x') {
+      pax = tar.substr(pos + 512, size);
+    } else {
+      string name(h, strnlen(h, 100)), prefix(h + 345, strnlen(h + 345, 155));
+      entries[prefix.empty() ? name : prefix + "/" + name] = { pos, pax };
+      pax.clear();
+    }
+    pos += (size + 511) / 512 * 512;
+  }
+
+  string mid = mid_dir + "/" + mid_file;
+  CHECK(mid.size() > 100);
+  CHECK(entries.count(mid) == 1 && entries[mid].second.empty());
+  size_t at = entries[mid].first;
+  CHECK(string(&tar[at + 345]) == mid_dir && string(&tar[at], 100).find('/') == string::npos);
+  CHECK(tar.substr(at + 512, 3) == "mid");
+
+  // the ustar header keeps the first 100 bytes, the pax record has the whole path
+  string deep = deep_dir + "/" + deep_file;
+  CHECK(deep.size() > 255);
+  CHECK(entries.count(deep.substr(0, 100)) == 1);
+  string record = entries[deep.substr(0, 100)].second;
+  string body = " path=" + deep + "\n";
+  CHECK(record == to_string(body.size() + 3) + body);
+  CHECK(tar.substr(entries[deep.substr(0, 100)].first + 512, 4) == "deep");
+}
+
+// a JPEG with a thumbnail whose SOI spans a cluster boundary, ZIPs whose end of
+// central directory does, and a JPEG planted across the first boundary between
+// the parts of a three thread scan: carved the same with one thread and three
+TEST(carver_signatures)
+{
+  ScratchImage image;
+
+  string jpeg = string("\xFF\xD8\xFF\xE0", 4) + pattern(506, 'j') + string("\xFF\xD8\xFF\xDB", 4)
+      + pattern(300, 't') + string("\xFF\xD9", 2) + pattern(700, 'j') + string("\xFF\xD9", 2);
+  string eocd = string("PK\x05\x06", 4) + string(16, '\0') + string("\x07\x00", 2) + "comment";
+  string zip = string("PK\x03\x04", 4) + pattern(1018, 'a') + eocd;
+
+  {
+    FAT32 fat32(image.path, true);
+    fat32.build();
+    fat32.create_file("/photo.jpg", jpeg);
+    fat32.create_file("/keep.bin", pattern(2000, 'k'));
+    fat32.create_file("/archive.zip", zip);
+    fat32.flush();
+    fat32.remove("/photo.jpg");
+    fat32.remove("/archive.zip");
+    fat32.flush();
+  }
+
+  // the free cluster that starts the second part, the stream being split in three
+  uint32_t part_cluster = 0;
+  {
+    FAT32 fat32(image.path);
+    uint32_t *fat = fat32.get_fat_area()->get_copy(0);
+    uint32_t max_cluster = fat32.get_super_block()->get_cluster_cnt() + 1;
+    uint64_t free_cnt = 0;
+    for (uint32_t c = 2; c <= max_cluster; c++)
+      free_cnt += (fat[c] & 0x0FFFFFFF) == 0;
+
+    uint64_t step = (free_cnt + 2) / 3, index = 0;
+    for (uint32_t c = 2; part_cluster == 0; c++) {
+      if ((fat[c] & 0x0FFFFFFF) == 0 && index++ == step)
+        part_cluster = c;
+    }
+
+    int fd = open(image.path.c_str(), O_RDWR);
+    CHECK(pwrite(fd, jpeg.data(), jpeg.size(), fat32.cal_data_offset(part_cluster) - 2) == (ssize_t)jpeg.size());
+    close(fd);
+  }
+
+  FAT32 fat32(image.path);
+  vector<CarveReport> reports;
+
+  for (unsigned thread_cnt : { 1, 3 }) {
+    Carver carver(fat32, thread_cnt);
+    reports.push_back(carver.run());
+    CarveReport& report = reports.back();
+
+    CHECK(report.files.size() == 3);
+    CHECK(report.files[0].type == "jpeg" && report.files[0].complete && carver.read(report.files[0]) == jpeg);
+    CHECK(report.files[1].type == "zip" && report.files[1].complete && carver.read(report.files[1]) == zip);
+    CHECK(report.files[2].type == "jpeg" && report.files[2].complete && carver.read(report.files[2]) == jpeg);
+    CHECK(report.files[2].offset == fat32.cal_data_offset(part_cluster) - 2);
+  }
+
+  CHECK(reports[0].match_cnt == reports[1].match_cnt);
+  for (size_t i = 0; i < 3; i++)
+    CHECK(reports[0].files[i].offset == reports[1].files[i].offset && reports[0].files[i].size == reports[1].files[i].size);
+}
+
+// FIPS 180-4 / RFC 1321 values of "abc" and of runs of 'a' around the padding boundaries
+static vector<tuple<string, string, string>> hash_answers()
+{
+  vector<tuple<string, string, string>> answers = {
+    { "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", "900150983cd24fb0d6963f7d28e17f72" },
+  };
+
+  vector<tuple<size_t, string, string>> runs = {
+    { 0, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", "d41d8cd98f00b204e9800998ecf8427e" },
+    { 55, "9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318", "ef1772b6dff9a122358552954ad0df65" },
+    { 56, "b35439a4ac6f0948b6d6f9e3c6af0f5f590ce20f1bde7090ef7970686ec6738a", "3b0c8ac703f828b04c6c197006d17218" },
+    { 63, "7d3e74a05d7db15bce4ad9ec0658ea98e3f06eeecf16b4c6fff2da457ddc2f34", "b06521f39153d618550606be297466d5" },
+    { 64, "ffe054fe7ae0cb6dc65c3af9b61d5209f439851db43d0ba5997337df154668eb", "014842d480b571495a4a0363793f7367" },
+    { 65, "635361c48bb9eab14198e76ea8ab7f1a41685d6ad62aa9146d301d4f17eb0ae0", "c743a45e0d2e6a95cb859adae0248435" },
+    { 119, "31eba51c313a5c08226adf18d4a359cfdfd8d2e816b13f4af952f7ea6584dcfb", "8a7bd0732ed6a28ce75f6dabc90e1613" },
+    { 120, "2f3d335432c70b580af0e8e1b3674a7c020d683aa5f73aaaedfdc55af904c21c", "5f61c0ccad4cac44c75ff505e1f1e537" },
+    { 100000, "6d1cf22d7cc09b085dfc25ee1a1f3ae0265804c607bc2074ad253bcc82fd81ee", "1af6d6f2f682f76f80e606aeaaee1680" },
+  };
+
+  for (auto& [size, sha256, md5] : runs)
+    answers.push_back({ string(size, 'a'), sha256, md5 });
+
+  return answers;
+}
+
+TEST(hash_known_answers)
+{
+  for (auto& [data, sha256, md5] : hash_answers()) {
+    Sha256 whole;
+    whole.update(data.data(), data.size());
+    auto digest = whole.finish();
+    CHECK(to_hex(digest.data(), digest.size()) == sha256);
+
+    // in uneven pieces, across block boundaries
+    Sha256 pieces;
+    for (size_t pos = 0, n = 1; pos < data.size(); pos += n, n = n * 3 % 97 + 1)
+      pieces.update(data.data() + pos, min(n, data.size() - pos));
+    CHECK(pieces.finish() == digest);
+
+    Md5 md;
+    md.update(data.data(), data.size());
+    auto md_digest = md.finish();
+    CHECK(to_hex(md_digest.data(), md_digest.size()) == md5);
+  }
+}
+
+// every lane of a batch of mixed lengths agrees with Sha256, on each path this CPU has
+TEST(sha256_lanes_match)
+{
+  auto answers = hash_answers();
+  vector<string> isas = { "generic" };
+  if (set_sha256_lanes_isa("avx2"))
+    isas.push_back("avx2");
+
+  for (auto& isa : isas) {
+    CHECK(set_sha256_lanes_isa(isa));
+    CHECK(sha256_lanes_isa() == isa);
+
+    // the answers in batches of up to SHA256_LANES, then lengths 0..200 eight at a time
+    for (size_t from = 0; from < answers.size(); from += SHA256_LANES) {
+      vector<pair<void const*, size_t>> messages;
+      for (size_t i = from; i < min(answers.size(), from + SHA256_LANES); i++)
+        messages.push_back({ get<0>(answers[i]).data(), get<0>(answers[i]).size() });
+
+      vector<array<uint8_t, 32>> digests;
+      sha256_lanes(messages, digests);
+      for (size_t i = 0; i < messages.size(); i++)
+        CHECK(to_hex(digests[i].data(), 32) == get<1>(answers[from + i]));
+    }
+
+    string data = pattern(200, 'h');
+    for (size_t size = 0; size <= 200; size += SHA256_LANES) {
+      vector<pair<void const*, size_t>> messages;
+      for (size_t l = 0; l < SHA256_LANES; l++)
+        messages.push_back({ data.data() + l, (size + 37 * l) % 201 });
+
+      vector<array<uint8_t, 32>> digests;
+      sha256_lanes(messages, digests);
+      for (size_t l = 0; l < SHA256_LANES; l++) {
+        Sha256 one;
+        one.update(messages[l].first, messages[l].second);
+        CHECK(digests[l] == one.finish());
+      }
+    }
+  }
+
+  set_sha256_lanes_isa(isas.back());
+}
+
+int main()
+{
+  for (auto& [name, test] : tests) {
+    try {
+      test();
+      cout << "ok   " << name << endl;
+    } catch (exception const& e) {
+      cout << "FAIL " << name << ": " << e.what() << endl;
+      failed_cnt++;
+    }
+  }
+
+  return failed_cnt == 0 ? 0 : 1;
+}
@@ -0,0 +1,230 @@
+#include "fat_mirror.hpp"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_MIRROR_X86 1
+#endif
+
+
+static uint32_t mismatch_scalar(uint32_t const *a, uint32_t const *b, uint32_t from, uint32_t to)
+{
+  while (from < to && a[from] == b[from])
+    from++;
+
+  return from;
+}
+
+#ifdef FAT_MIRROR_X86
+__attribute__((target("sse2")))
+static uint32_t mismatch_sse2(uint32_t const *a, uint32_t const *b, uint32_t from, uint32_t to)
+{
+  // 64 bytes per step, the exact entry is found by the scalar tail
+  while (from + 16 <= to) {
+    __m128i d0 = _mm_xor_si128(_mm_loadu_si128((__m128i const*)(a + from)),      _mm_loadu_si128((__m128i const*)(b + from)));
+    __m128i d1 = _mm_xor_si128(_mm_loadu_si128((__m128i const*)(a + from + 4)),  _mm_loadu_si128((__m128i const*)(b + from + 4)));
+    __m128i d2 = _mm_xor_si128(_mm_loadu_si128((__m128i const*)(a + from + 8)),  _mm_loadu_si128((__m128i const*)(b + from + 8)));
+    __m128i d3 = _mm_xor_si128(_mm_loadu_si128((__m128i const*)(a + from + 12)), _mm_loadu_si128((__m128i const*)(b + from + 12)));
+    __m128i any = _mm_or_si128(_mm_or_si128(d0, d1), _mm_or_si128(d2, d3));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF)
+      break;
+    from += 16;
+  }
+
+  return mismatch_scalar(a, b, from, to);
+}
+
+__attribute__((target("avx2")))
+static uint32_t mismatch_avx2(uint32_t const *a, uint32_t const *b, uint32_t from, uint32_t to)
+{
+  // 128 bytes per step
+  while (from + 32 <= to) {
+    __m256i d0 = _mm256_xor_si256(_mm256_loadu_si256((__m256i const*)(a + from)),      _mm256_loadu_si256((__m256i const*)(b + from)));
+    __m256i d1 = _mm256_xor_si256(_mm256_loadu_si256((__m256i const*)(a + from + 8)),  _mm256_loadu_si256((__m256i const*)(b + from + 8)));
+    __m256i d2 = _mm256_xor_si256(_mm256_loadu_si256((__m256i const*)(a + from + 16)), _mm256_loadu_si256((__m256i const*)(b + from + 16)));
+    __m256i d3 = _mm256_xor_si256(_mm256_loadu_si256((__m256i const*)(a + from + 24)), _mm256_loadu_si256((__m256i const*)(b + from + 24)));
+    __m256i any = _mm256_or_si256(_mm256_or_si256(d0, d1), _mm256_or_si256(d2, d3));
+
+    if (!_mm256_testz_si256(any, any))
+      break;
+    from += 32;
+  }
+
+  return mismatch_sse2(a, b, from, to);
+}
+#endif
+
+struct MismatchImpl
+{
+  uint32_t (*fn)(uint32_t const*, uint32_t const*, uint32_t, uint32_t);
+  char const *isa;
+};
+
+// picked once, by what the CPU running us supports
+static MismatchImpl const& mismatch_impl()
+{
+  static MismatchImpl const impl = [] {
+#ifdef FAT_MIRROR_X86
+    if (__builtin_cpu_supports("avx2"))
+      return MismatchImpl{ mismatch_avx2, "avx2" };
+    if (__builtin_cpu_supports("sse2"))
+      return MismatchImpl{ mismatch_sse2, "sse2" };
+#endif
+    return MismatchImpl{ mismatch_scalar, "scalar" };
+  }();
+
+  return impl;
+}
+
+uint32_t fat_mismatch(uint32_t const *a, uint32_t const *b, uint32_t from, uint32_t to)
+{
+  return mismatch_impl().fn(a, b, from, to);
+}
+
+char const* fat_mismatch_isa()
+{
+  return mismatch_impl().isa;
+}
+
+static void mark_starts(DirectoryEntry *dir, vector<bool>& start_cluster, uint32_t max_cluster)
+{
+  for (auto child : dir->get_children()) {
+    uint32_t c = child->get_start_cluster_no();
+    if (c >= 2 && c <= max_cluster)
+      start_cluster[c] = true;
+    if (child->is_dir())
+      mark_starts(child, start_cluster, max_cluster);
+  }
+}
+
+// whether following the chain from c comes back to c within a few thousand links
+template<typename NextOf>
+static bool loops_back(uint32_t c, NextOf next_of, uint32_t max_cluster)
+{
+  uint32_t k = next_of(c);
+
+  for (int hops = 0; hops < 4096 && k >= 2 && k <= max_cluster; hops++) {
+    if (k == c)
+      return true;
+    k = next_of(k);
+  }
+
+  return false;
+}
+
+vector<FatDiffRange> FatMirror::compare()
+{
+  TraceSpan span("FatMirror::compare");
+
+  FatArea *fat_area = fat32.get_fat_area();
+  uint32_t copy_cnt = fat_area->get_copy_cnt();
+  uint32_t entry_cnt = fat_area->get_entry_cnt();
+  uint32_t max_cluster = fat32.get_super_block()->get_cluster_cnt() + 1;
+  uint32_t *primary = fat_area->get_copy(0);
+
+  // differing ranges of any copy against FAT #1, merged
+  vector<pair<uint32_t, uint32_t>> spans;
+  for (uint32_t k = 1; k < copy_cnt; k++) {
+    uint32_t *mirror = fat_area->get_copy(k);
+
+    for (uint32_t c = fat_mismatch(primary, mirror, 0, entry_cnt); c < entry_cnt; c = fat_mismatch(primary, mirror, c, entry_cnt)) {
+      uint32_t end = c;
+      while (end < entry_cnt && primary[end] != mirror[end])
+        end++;
+
+      spans.push_back({c, end});
+      c = end;
+    }
+  }
+
+  sort(spans.begin(), spans.end());
+
+  vector<FatDiffRange> ranges;
+  for (auto [first, end] : spans) {
+    if (!ranges.empty() && first <= ranges.back().first + ranges.back().count)
+      ranges.back().count = max(ranges.back().count, end - ranges.back().first);
+    else
+      ranges.push_back({first, end - first, 0, {}});
+  }
+
+  if (ranges.empty())
+    return ranges;
+
+  // link targets of the entries all copies agree on, and start clusters of the tree
+  vector<bool> agreed_target(max_cluster + 1, false);
+  vector<bool> start_cluster(max_cluster + 1, false);
+
+  if (fat32.get_root_dir() != nullptr)
+    mark_starts(fat32.get_root_dir(), start_cluster, max_cluster);
+
+  size_t r = 0;
+  for (uint32_t c = 2; c <= max_cluster && c < entry_cnt; c++) {
+    while (r < ranges.size() && ranges[r].first + ranges[r].count <= c)
+      r++;
+    if (r < ranges.size() && c >= ranges[r].first)
+      continue;
+
+    uint32_t value = primary[c] & 0x0FFFFFFF;
+    if (value >= 2 && value <= max_cluster)
+      agreed_target[value] = true;
+  }
+
+  for (auto& range : ranges) {
+    range.implausible.assign(copy_cnt, 0);
+
+    for (uint32_t k = 0; k < copy_cnt; k++) {
+      uint32_t *fat = fat_area->get_copy(k);
+      uint32_t end = range.first + range.count;
+
+      // this copy inside the range, FAT #1 (which agrees) outside
+      auto next_of = [&](uint32_t c) { return (c >= range.first && c < end ? fat[c] : primary[c]) & 0x0FFFFFFF; };
+
+      // links from inside the range, as this copy has them
+      vector<bool> own_target(range.count, false);
+      for (uint32_t c = range.first; c < end; c++) {
+        uint32_t value = fat[c] & 0x0FFFFFFF;
+        if (value >= range.first && value < end)
+          own_target[value - range.first] = true;
+      }
+
+      for (uint32_t c = range.first; c < end; c++) {
+        if (c < 2 || c > max_cluster)
+          continue;
+
+        uint32_t value = fat[c] & 0x0FFFFFFF;
+
+        if (value == 0) {
+          // free, but something links here
+          if (agreed_target[c] || start_cluster[c] || own_target[c - range.first])
+            range.implausible[k]++;
+        } else if (value < 0x0FFFFFF7) {
+          // out of range, into a free cluster, into another chain, or around in a circle
+          if (value < 2 || value > max_cluster || next_of(value) == 0
+              || agreed_target[value] || start_cluster[value] || loops_back(c, next_of, max_cluster))
+            range.implausible[k]++;
+        }
+      }
+    }
+
+    range.trusted_copy = min_element(range.implausible.begin(), range.implausible.end()) - range.implausible.begin();
+  }
+
+  return ranges;
+}
+
+void FatMirror::apply(vector<FatDiffRange> const& ranges)
+{
+  fat32.check_writable();
+
+  FatArea *fat_area = fat32.get_fat_area();
+
+  // a range FAT #1 is trusted for is marked dirty all the same, the mirrors are rewritten from it
+  for (auto& range : ranges) {
+    uint32_t *trusted = fat_area->get_copy(range.trusted_copy);
+
+    for (uint32_t c = range.first; c < range.first + range.count; c++)
+      fat32.set_fat(c, trusted[c]);
+  }
+}
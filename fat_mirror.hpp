@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fat32.hpp"
+
+using namespace std;
+
+// first index in [from, to) where a and b differ, to if none; vector compares where available
+uint32_t fat_mismatch(uint32_t const *a, uint32_t const *b, uint32_t from, uint32_t to);
+
+// "avx2", "sse2" or "scalar", whichever fat_mismatch() runs with
+char const* fat_mismatch_isa();
+
+struct FatDiffRange
+{
+  uint32_t first;             // FAT entry (= cluster number)
+  uint32_t count;
+  uint32_t trusted_copy;      // 0 = FAT #1
+  vector<uint32_t> implausible; // per copy, entries in the range that contradict the rest of the FAT
+};
+
+//
+// Compares all FAT copies against FAT #1. For each range where any copy
+// differs, the copy to trust is the one with the fewest implausible entries:
+// links outside the data area, into free clusters, into another chain or
+// around in a loop, and free entries that something links to. With a built
+// tree, the start clusters of its entries count as linked. Ties go to FAT #1.
+//
+class FatMirror
+{
+  public:
+    FatMirror(FAT32& fat32) : fat32(fat32) {}
+
+  public:
+    vector<FatDiffRange> compare();
+
+    // FAT #1 takes the trusted copy's entries for every range, and the next
+    // flush() writes them to all copies, through the write-ahead log if it is
+    // enabled. Needs a writable FAT32 that has not allocated anything yet.
+    void apply(vector<FatDiffRange> const& ranges);
+
+  private:
+    FAT32& fat32;
+};
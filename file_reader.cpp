@@ -0,0 +1,149 @@
+#include "file_reader.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <sys/uio.h>
+
+
+FileReader::FileReader(FAT32& fat32, Node node)
+  : fat32(fat32), node(std::move(node)), cluster_size(fat32.get_super_block()->get_cluster_size())
+{
+  uint64_t mapped = 0;
+  for (auto& extent : this->node.get_extents())
+    mapped = max<uint64_t>(mapped, (uint64_t)(extent.logical + extent.count) * cluster_size);
+
+  size = min<uint64_t>(this->node.get_size(), mapped);
+}
+
+FileReader::FileReader(FAT32& fat32, DirectoryEntry *dentry)
+  : FileReader(fat32, fat32.to_node(dentry))
+{
+  if (dentry->is_dir())
+    throw runtime_error("not a file: " + dentry->get_name());
+}
+
+// fn(image offset, length) for the part of every extent in [offset, offset + len), in file order
+template<typename Fn>
+void FileReader::for_each_piece(uint64_t offset, uint64_t len, Fn fn)
+{
+  vector<Extent>& extents = node.get_extents();
+  uint64_t pos = offset;
+  uint64_t end = offset + len;
+  if (pos >= end)
+    return;
+
+  // the last extent starting at or before the cluster of pos
+  auto it = upper_bound(extents.begin(), extents.end(), pos / cluster_size,
+                        [](uint64_t c, Extent const& e) { return c < e.logical; });
+
+  for (--it; pos < end; ++it) {
+    uint64_t extent_end = (uint64_t)(it->logical + it->count) * cluster_size;
+    uint64_t n = min(end, extent_end) - pos;
+
+    fn(fat32.cal_data_offset(it->cluster) + pos - (uint64_t)it->logical * cluster_size, n);
+    pos += n;
+  }
+}
+
+size_t FileReader::read(uint64_t offset, size_t len, void *dst)
+{
+  vector<ReadRequest> requests = { { offset, len, dst } };
+  readv(requests);
+  readahead(offset, requests[0].done);
+
+  return requests[0].done;
+}
+
+//
+// Like the kernel does for files: a read that starts where the last one ended
+// doubles the window (from MIN_WINDOW, up to MAX_WINDOW), anything else drops
+// it. The window ahead of the read is hinted, only the part not hinted before.
+//
+void FileReader::readahead(uint64_t offset, size_t done)
+{
+  uint64_t from, to;
+  {
+    lock_guard<mutex> guard(readahead_lock);
+
+    if (offset != next_offset || done == 0) {
+      window = 0;
+      next_offset = hinted_end = offset + done;
+      return;
+    }
+
+    window = window == 0 ? max<uint64_t>(MIN_WINDOW, 2 * done) : min<uint64_t>(2 * window, MAX_WINDOW);
+    next_offset = offset + done;
+
+    from = max(hinted_end, next_offset);
+    to = min(size, next_offset + window);
+    if (to <= from)
+      return;
+    hinted_end = to;
+  }
+
+  // one hint per extent, neighbouring extents merged
+  uint64_t start = 0, end = 0;
+  for_each_piece(from, to - from, [&](uint64_t disk, uint64_t len) {
+    if (disk != end) {
+      if (end > start)
+        fat32.prefetch(start, end - start);
+      start = disk;
+    }
+    end = disk + len;
+  });
+  if (end > start)
+    fat32.prefetch(start, end - start);
+}
+
+uint64_t FileReader::readv(vector<ReadRequest>& requests)
+{
+  TraceSpan span("FileReader::readv", "requests", requests.size());
+
+  // a piece of a request that lies in one extent
+  struct Piece
+  {
+    uint64_t disk;
+    size_t len;
+    uint8_t *dst;
+  };
+
+  vector<Piece> pieces;
+  uint64_t total = 0;
+
+  for (auto& request : requests) {
+    request.done = request.offset < size ? min<uint64_t>(request.len, size - request.offset) : 0;
+    total += request.done;
+
+    uint8_t *dst = (uint8_t*)request.dst;
+    for_each_piece(request.offset, request.done, [&](uint64_t disk, uint64_t len) {
+      pieces.push_back({ disk, len, dst });
+      dst += len;
+    });
+  }
+
+  stable_sort(pieces.begin(), pieces.end(), [](Piece const& a, Piece const& b) { return a.disk < b.disk; });
+
+  vector<iovec> iov;
+  vector<uint8_t> scratch;
+
+  for (size_t i = 0; i < pieces.size(); ) {
+    uint64_t start = pieces[i].disk;
+    uint64_t pos = start;
+    iov.clear();
+
+    // pieces overlapping what is already queued (two requests for the same bytes) start a new read
+    for (; i < pieces.size() && pieces[i].disk >= pos && pieces[i].disk - pos <= MAX_GAP; i++) {
+      if (pieces[i].disk > pos) {
+        scratch.resize(max<size_t>(scratch.size(), MAX_GAP));
+        iov.push_back({ scratch.data(), pieces[i].disk - pos });
+      }
+      iov.push_back({ pieces[i].dst, pieces[i].len });
+      pos = pieces[i].disk + pieces[i].len;
+    }
+
+    fat32.readv_at(iov.data(), iov.size(), start);
+    fat32.stats.add(FAT32Stats::CLUSTERS_READ, fat32.cal_cluster_no(pos - 1) - fat32.cal_cluster_no(start) + 1);
+  }
+
+  return total;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "fat32.hpp"
+
+using namespace std;
+
+struct ReadRequest
+{
+  uint64_t offset;            // in the file
+  size_t len;
+  void *dst;
+
+  size_t done = 0;            // bytes read, less than len at the end of the file
+};
+
+//
+// Random access to the contents of one file, like pread on the file itself.
+// File offsets go through the extent map of the node to image offsets. A
+// readv() sorts the pieces of all its requests by image offset and reads
+// every run of pieces that follow each other on disk with one preadv; holes
+// of up to MAX_GAP bytes between pieces are read into scratch space rather
+// than costing a read of their own. Nothing is cached, and a FileReader may
+// be used from several threads at once.
+//
+// read() also watches for a sequential stream: reads that continue where the
+// last one ended grow a readahead window, and the extents ahead of the stream
+// are hinted to the kernel (posix_fadvise WILLNEED) so that the next read
+// finds them in the page cache, even across a jump to another extent. Reads
+// from several threads interleaved look random and get no readahead.
+//
+class FileReader
+{
+  public:
+    static constexpr uint64_t MAX_GAP = 32 << 10;
+    static constexpr uint64_t MIN_WINDOW = 128 << 10;
+    static constexpr uint64_t MAX_WINDOW = 8 << 20;
+
+    FileReader(FAT32& fat32, Node node);
+    FileReader(FAT32& fat32, DirectoryEntry *dentry);
+
+  public:
+    // up to len bytes from offset into dst, returns how many (0 at or past the end)
+    size_t read(uint64_t offset, size_t len, void *dst);
+    // all requests, with as few reads of the image as the layout allows;
+    // returns the bytes read in total
+    uint64_t readv(vector<ReadRequest>& requests);
+
+    // the file size, or less when the chain ends before it
+    uint64_t get_size() { return size; }
+    Node& get_node() { return node; }
+    // current readahead window, 0 when the reads do not look sequential
+    uint64_t get_window() { lock_guard<mutex> guard(readahead_lock); return window; }
+
+  private:
+    void readahead(uint64_t offset, size_t done);
+    template<typename Fn>
+    void for_each_piece(uint64_t offset, uint64_t len, Fn fn);
+
+  private:
+    FAT32& fat32;
+    Node node;
+    uint32_t cluster_size;
+    uint64_t size;
+
+    mutex readahead_lock;
+    uint64_t next_offset = 0;       // where a sequential read would start
+    uint64_t window = 0;
+    uint64_t hinted_end = 0;        // file offset the hints reach to
+};
@@ -0,0 +1,131 @@
+#include "fragmentation.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+
+
+void Histogram::add(uint64_t value)
+{
+  size_t bucket = bit_width(value);
+
+  if (buckets.size() <= bucket)
+    buckets.resize(bucket + 1, 0);
+
+  buckets[bucket]++;
+}
+
+string Histogram::bucket_label(size_t bucket)
+{
+  if (bucket <= 1)
+    return to_string(bucket);
+
+  uint64_t lo = 1ULL << (bucket - 1);
+  return to_string(lo) + "-" + to_string(2 * lo - 1);
+}
+
+static void collect(FAT32& fat32, DirectoryEntry *dir, FragmentationReport& report)
+{
+  for (auto child : dir->get_children()) {
+    if (child->is_dir()) {
+      collect(fat32, child, report);
+      continue;
+    }
+
+    Node node = fat32.to_node(child);
+    auto& extents = node.get_extents();
+
+    FileFragmentation f = { child, (uint32_t)extents.size(), 0, 0, 0, 0 };
+
+    for (size_t i = 0; i < extents.size(); i++) {
+      f.cluster_cnt += extents[i].count;
+      report.run_length.add(extents[i].count);
+
+      if (i > 0) {
+        uint64_t prev_end = (uint64_t)extents[i - 1].cluster + extents[i - 1].count;
+        uint64_t start = extents[i].cluster;
+        uint64_t seek = start >= prev_end ? start - prev_end : prev_end - start;
+
+        f.seek_total += seek;
+        f.seek_max = max(f.seek_max, seek);
+        report.seek_distance.add(seek);
+      }
+    }
+
+    f.avg_run = extents.empty() ? 0 : double(f.cluster_cnt) / extents.size();
+
+    report.file_cnt++;
+    report.fragmented_cnt += extents.size() > 1;
+    report.extent_cnt += extents.size();
+    report.cluster_cnt += f.cluster_cnt;
+    report.extents_per_file.add(extents.size());
+    report.files.push_back(f);
+  }
+}
+
+FragmentationReport analyze_fragmentation(FAT32& fat32)
+{
+  TraceSpan span("analyze_fragmentation");
+
+  if (fat32.get_root_dir() == nullptr)
+    fat32.build();
+
+  FragmentationReport report;
+  collect(fat32, fat32.get_root_dir(), report);
+
+  sort(report.files.begin(), report.files.end(), [](FileFragmentation const& a, FileFragmentation const& b) {
+    return a.extent_cnt != b.extent_cnt ? a.extent_cnt > b.extent_cnt : a.seek_total > b.seek_total;
+  });
+
+  return report;
+}
+
+static void print_histogram(string& out, char const *title, Histogram const& h)
+{
+  char line[128];
+  uint64_t total = 0;
+  for (auto n : h.buckets)
+    total += n;
+
+  out += string(title) + "\n";
+
+  for (size_t b = 0; b < h.buckets.size(); b++) {
+    if (h.buckets[b] == 0)
+      continue;
+
+    int bar = total == 0 ? 0 : (int)(40 * h.buckets[b] / total);
+    snprintf(line, sizeof(line), "  %15s %10llu  %s\n", Histogram::bucket_label(b).c_str(),
+        (unsigned long long)h.buckets[b], string(bar, '#').c_str());
+    out += line;
+  }
+}
+
+string FragmentationReport::to_text(size_t top)
+{
+  char line[256];
+  string out;
+
+  snprintf(line, sizeof(line), "%llu files, %llu fragmented (%.1f%%), %llu extents for %llu clusters, %.2f extents per file\n\n",
+      (unsigned long long)file_cnt, (unsigned long long)fragmented_cnt,
+      file_cnt == 0 ? 0.0 : 100.0 * fragmented_cnt / file_cnt,
+      (unsigned long long)extent_cnt, (unsigned long long)cluster_cnt,
+      file_cnt == 0 ? 0.0 : double(extent_cnt) / file_cnt);
+  out += line;
+
+  print_histogram(out, "extents per file", extents_per_file);
+  print_histogram(out, "run length (clusters)", run_length);
+  print_histogram(out, "seek distance (clusters)", seek_distance);
+
+  out += "\nworst fragmented\n";
+  snprintf(line, sizeof(line), "  %8s %10s %10s %12s %12s  %s\n", "extents", "clusters", "avg run", "seek total", "seek max", "path");
+  out += line;
+
+  for (size_t i = 0; i < files.size() && i < top && files[i].extent_cnt > 1; i++) {
+    auto& f = files[i];
+    snprintf(line, sizeof(line), "  %8u %10u %10.1f %12llu %12llu  ", f.extent_cnt, f.cluster_cnt, f.avg_run,
+        (unsigned long long)f.seek_total, (unsigned long long)f.seek_max);
+    out += line + f.dentry->get_full_path() + "\n";
+  }
+
+  return out;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fat32.hpp"
+
+using namespace std;
+
+struct FileFragmentation
+{
+  DirectoryEntry *dentry;
+  uint32_t extent_cnt;
+  uint32_t cluster_cnt;
+  double avg_run;             // clusters per extent
+  uint64_t seek_total;        // clusters skipped between consecutive extents, backwards counts too
+  uint64_t seek_max;
+};
+
+// power of two buckets: [0] = 0, [1] = 1, [2] = 2..3, [3] = 4..7, ...
+struct Histogram
+{
+  vector<uint64_t> buckets;
+
+  void add(uint64_t value);
+  static string bucket_label(size_t bucket);
+};
+
+struct FragmentationReport
+{
+  vector<FileFragmentation> files;   // worst first: most extents, then longest seeks
+
+  uint64_t file_cnt = 0;
+  uint64_t fragmented_cnt = 0;       // more than one extent
+  uint64_t extent_cnt = 0;
+  uint64_t cluster_cnt = 0;
+
+  Histogram extents_per_file;
+  Histogram run_length;              // clusters per extent
+  Histogram seek_distance;           // clusters between consecutive extents
+
+  // summary, histograms and the top worst files
+  string to_text(size_t top = 20);
+};
+
+// every file of the tree, from its extent map (FAT32::to_node)
+FragmentationReport analyze_fragmentation(FAT32& fat32);
@@ -0,0 +1,347 @@
+#include "fsck.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+#include "fat_mirror.hpp"
+#include "parallel.hpp"
+
+
+static constexpr uint32_t FAT_BAD = 0x0FFFFFF7;
+static constexpr uint32_t FAT_EOC_MIN = 0x0FFFFFF8;
+
+class AtomicBitmap
+{
+  public:
+    AtomicBitmap(size_t bit_cnt) : words(new atomic<uint64_t>[(bit_cnt + 63) / 64]), word_cnt((bit_cnt + 63) / 64)
+    {
+      for (size_t i = 0; i < word_cnt; i++)
+        words[i].store(0, memory_order_relaxed);
+    }
+
+    // returns whether the bit was set before
+    bool test_and_set(size_t bit)
+    {
+      uint64_t mask = 1ULL << (bit % 64);
+      return words[bit / 64].fetch_or(mask, memory_order_relaxed) & mask;
+    }
+
+    bool test(size_t bit) { return words[bit / 64].load(memory_order_relaxed) & (1ULL << (bit % 64)); }
+
+  private:
+    unique_ptr<atomic<uint64_t>[]> words;
+    size_t word_cnt;
+};
+
+// file or directory found in the raw directory walk
+struct FsckEntry
+{
+  string path;
+  uint32_t start;
+  uint32_t size;
+  bool is_dir;
+  bool read_dir;              // false for a directory that is already listed under another entry
+};
+
+//
+// Every entry that owns clusters, hidden and system ones included (the tree
+// FAT32::build() makes skips those). Directories are read breadth first from
+// the raw clusters, each at most once.
+//
+static vector<FsckEntry> collect(FAT32& fat32, uint32_t const *fat, uint32_t max_cluster)
+{
+  SuperBlock *super_block = fat32.get_super_block();
+  uint32_t cluster_size = super_block->get_cluster_size();
+  uint32_t max_dir_clusters = 65536 * 0x20 / cluster_size + 1;   // 65536 entries at most
+
+  vector<FsckEntry> entries = { { "/", super_block->get_root_cluster_addr(), 0, true, true } };
+  unordered_set<uint32_t> visited = { super_block->get_root_cluster_addr() };
+  vector<uint8_t> buffer(cluster_size);
+
+  for (size_t d = 0; d < entries.size(); d++) {
+    if (!entries[d].read_dir)
+      continue;
+
+    uint32_t cluster_no = entries[d].start;
+    bool end = false;
+
+    for (uint32_t n = 0; !end && n < max_dir_clusters && cluster_no >= 2 && cluster_no <= max_cluster; n++) {
+      fat32.read_cluster(cluster_no, buffer.data());
+
+      for (uint32_t slot = 0; slot < cluster_size / 0x20; slot++) {
+        uint8_t *e = &buffer[slot * 0x20];
+        uint8_t attribute = e[0x0B];
+
+        if (e[0] == 0x00) {
+          end = true;
+          break;
+        }
+
+        if (e[0] == 0xE5 || e[0] == '.' || attribute == 0x0F || (attribute & 0x08))  // deleted, dot, LFN, label
+          continue;
+
+        DirectoryEntry dentry(e, 0x20);
+        string path = (d == 0 ? "" : entries[d].path) + "/" + dentry.get_short_name();
+        bool is_dir = attribute & 0x10;
+        uint32_t start = dentry.get_start_cluster_no();
+
+        // a directory linked twice is listed twice but read once
+        bool read_dir = is_dir && start != 0 && visited.insert(start).second;
+
+        entries.push_back({ path, start, is_dir ? 0 : dentry.get_file_size(), is_dir, read_dir });
+      }
+
+      cluster_no = fat[cluster_no] & 0x0FFFFFFF;
+    }
+  }
+
+  return entries;
+}
+
+char const* Fsck::kind_name(FsckIssue::Kind kind)
+{
+  switch (kind) {
+    case FsckIssue::CROSS_LINK:    return "cross-linked";
+    case FsckIssue::FREE_IN_CHAIN: return "free cluster in chain";
+    case FsckIssue::BAD_LINK:      return "bad link";
+    case FsckIssue::LOOP:          return "loop";
+    case FsckIssue::LOST_CLUSTERS: return "lost clusters";
+    case FsckIssue::SIZE_MISMATCH: return "size mismatch";
+    case FsckIssue::FAT_MISMATCH:  return "FAT copies differ";
+  }
+
+  return "?";
+}
+
+Fsck::Fsck(FAT32& fat32, unsigned thread_cnt)
+  : fat32(fat32), thread_cnt(thread_cnt != 0 ? thread_cnt : max(1u, thread::hardware_concurrency()))
+{
+}
+
+FsckReport Fsck::run()
+{
+  TraceSpan span("Fsck::run");
+
+  FsckReport report;
+  mutex report_lock;
+  auto add_issue = [&](FsckIssue issue) {
+    lock_guard<mutex> guard(report_lock);
+    report.issues.push_back(std::move(issue));
+  };
+
+  SuperBlock *super_block = fat32.get_super_block();
+  uint32_t max_cluster = super_block->get_cluster_cnt() + 1;
+  uint32_t entry_cnt = super_block->get_fat_entry_cnt();
+  uint32_t cluster_size = super_block->get_cluster_size();
+  uint32_t *fat = fat32.get_fat_area()->get_copy(0);
+
+  auto next_of = [&](uint32_t cluster_no) { return fat[cluster_no] & 0x0FFFFFFF; };
+  auto is_link = [&](uint32_t value) { return value >= 2 && value <= max_cluster; };
+
+  // 1. FAT scan: allocated entries, links out of range, two links to one cluster
+  AtomicBitmap linked(max_cluster + 1);
+  atomic<uint64_t> used_cnt{0};
+
+  parallel_ranges(thread_cnt, 2, (uint64_t)max_cluster + 1, [&](uint64_t first, uint64_t last) {
+    uint64_t used = 0;
+
+    for (uint64_t c = first; c < last; c++) {
+      uint32_t value = next_of(c);
+      if (value == 0)
+        continue;
+
+      used++;
+      if (is_link(value)) {
+        if (linked.test_and_set(value))
+          add_issue({FsckIssue::CROSS_LINK, "", value, 0, "linked to from more than one FAT entry"});
+      } else if (value != FAT_BAD && value < FAT_EOC_MIN) {
+        add_issue({FsckIssue::BAD_LINK, "", (uint32_t)c, value, "FAT entry links to " + to_string(value)});
+      }
+    }
+
+    used_cnt.fetch_add(used, memory_order_relaxed);
+  });
+
+  report.used_cluster_cnt = used_cnt;
+
+  // 2. chain walks, in parallel over the directory entries
+  vector<FsckEntry> entries = collect(fat32, fat, max_cluster);
+
+  AtomicBitmap referenced(max_cluster + 1);
+  atomic<uint64_t> referenced_cnt{0};
+  atomic<size_t> next_entry{0};
+
+  // (entry, cluster, hops before it): walks that ran into an already referenced cluster
+  struct Collision { FsckEntry *entry; uint32_t cluster; uint64_t hops; };
+  vector<Collision> collisions;
+
+  auto walk = [&](uint64_t, uint64_t) {
+    uint64_t referenced_local = 0;
+
+    for (size_t i; (i = next_entry.fetch_add(64, memory_order_relaxed)) < entries.size(); ) {
+      for (size_t k = i; k < min(entries.size(), i + 64); k++) {
+        FsckEntry *entry = &entries[k];
+        uint32_t cluster_no = entry->start;
+        uint64_t hops = 0;
+
+        if (cluster_no == 0 && (entry->is_dir || entry->size > 0)) {
+          add_issue({FsckIssue::SIZE_MISMATCH, entry->path, 0, 0, "has no clusters"});
+          continue;
+        }
+
+        if (cluster_no == 0)
+          continue;
+
+        if (!is_link(cluster_no)) {
+          add_issue({FsckIssue::BAD_LINK, entry->path, cluster_no, 0, "starts outside the data area"});
+          continue;
+        }
+
+        bool complete = false;
+        while (true) {
+          if (referenced.test_and_set(cluster_no)) {
+            lock_guard<mutex> guard(report_lock);
+            collisions.push_back({entry, cluster_no, hops});
+            break;
+          }
+
+          referenced_local++;
+          hops++;
+
+          uint32_t value = next_of(cluster_no);
+          if (value >= FAT_EOC_MIN) {
+            complete = true;
+            break;
+          }
+
+          if (value == 0) {
+            add_issue({FsckIssue::FREE_IN_CHAIN, entry->path, cluster_no, hops, "chain ends in a free entry"});
+            break;
+          }
+
+          if (!is_link(value)) {
+            add_issue({FsckIssue::BAD_LINK, entry->path, cluster_no, value, "chain links to " + to_string(value)});
+            break;
+          }
+
+          cluster_no = value;
+        }
+
+        uint64_t expected = ((uint64_t)entry->size + cluster_size - 1) / cluster_size;
+        if (complete && !entry->is_dir && hops != expected)
+          add_issue({FsckIssue::SIZE_MISMATCH, entry->path, entry->start, hops,
+              to_string(entry->size) + " bytes need " + to_string(expected) + " clusters, chain has " + to_string(hops)});
+      }
+    }
+
+    referenced_cnt.fetch_add(referenced_local, memory_order_relaxed);
+  };
+
+  parallel_ranges(thread_cnt, 0, thread_cnt, walk);
+
+  for (size_t i = 1; i < entries.size(); i++)
+    (entries[i].is_dir ? report.dir_cnt : report.file_cnt)++;
+
+  // a walk that hit a referenced cluster either came back to its own chain or met another one
+  for (auto& c : collisions) {
+    unordered_set<uint32_t> seen;
+    uint32_t cluster_no = c.entry->start;
+
+    for (uint64_t i = 0; i < c.hops; i++) {
+      seen.insert(cluster_no);
+      cluster_no = next_of(cluster_no);
+    }
+
+    if (seen.count(c.cluster))
+      add_issue({FsckIssue::LOOP, c.entry->path, c.cluster, c.hops, "chain loops back after " + to_string(c.hops) + " clusters"});
+    else
+      add_issue({FsckIssue::CROSS_LINK, c.entry->path, c.cluster, c.hops, "shares cluster with another chain"});
+  }
+
+  report.referenced_cluster_cnt = referenced_cnt;
+
+  // 3. lost clusters: allocated but not referenced, reported per chain head
+  AtomicBitmap visited(max_cluster + 1);
+  atomic<uint64_t> lost_cnt{0};
+  atomic<uint64_t> visited_cnt{0};
+
+  parallel_ranges(thread_cnt, 2, (uint64_t)max_cluster + 1, [&](uint64_t first, uint64_t last) {
+    uint64_t lost = 0, visited_local = 0;
+
+    for (uint64_t c = first; c < last; c++) {
+      uint32_t value = next_of(c);
+      if (value == 0 || value == FAT_BAD || referenced.test(c))
+        continue;
+
+      lost++;
+      if (linked.test(c))
+        continue;
+
+      // head of a lost chain, count its length; a loop at its end stops the walk where it closes
+      uint64_t len = 0;
+      for (uint32_t k = c; is_link(k) && !referenced.test(k) && !visited.test_and_set(k); k = next_of(k))
+        len++;
+
+      visited_local += len;
+      add_issue({FsckIssue::LOST_CLUSTERS, "", (uint32_t)c, len, "chain of " + to_string(len) + " clusters"});
+    }
+
+    lost_cnt.fetch_add(lost, memory_order_relaxed);
+    visited_cnt.fetch_add(visited_local, memory_order_relaxed);
+  });
+
+  report.lost_cluster_cnt = lost_cnt;
+
+  // lost clusters no head reaches: every one of them is linked to, so following
+  // the links ends in a loop. Reported once per loop, at the cluster closing it
+  if (visited_cnt < lost_cnt) {
+    vector<uint32_t> path;
+
+    for (uint32_t c = 2; c <= max_cluster; c++) {
+      uint32_t value = next_of(c);
+      if (value == 0 || value == FAT_BAD || referenced.test(c) || visited.test(c))
+        continue;
+
+      path.clear();
+      uint32_t k = c;
+      for (; is_link(k) && !referenced.test(k) && !visited.test_and_set(k); k = next_of(k))
+        path.push_back(k);
+
+      // otherwise it runs into a loop reported already
+      auto closing = find(path.begin(), path.end(), k);
+      if (closing != path.end()) {
+        uint64_t loop_len = path.end() - closing;
+        add_issue({FsckIssue::LOST_CLUSTERS, "", k, path.size(),
+            "headless chain of " + to_string(path.size()) + " clusters, loops back to " + to_string(k)
+            + " after " + to_string(loop_len)});
+      }
+    }
+  }
+
+  // 4. FAT copies against FAT #1, as ranges of differing entries
+  for (uint32_t copy = 1; copy < super_block->get_fat_no(); copy++) {
+    uint32_t *mirror = fat32.get_fat_area()->get_copy(copy);
+
+    parallel_ranges(thread_cnt, 0, entry_cnt, [&](uint64_t first, uint64_t last) {
+      for (uint32_t c = fat_mismatch(fat, mirror, first, last); c < last; c = fat_mismatch(fat, mirror, c, last)) {
+        uint32_t end = c;
+        while (end < last && fat[end] != mirror[end])
+          end++;
+
+        add_issue({FsckIssue::FAT_MISMATCH, "", c, end - c,
+            "FAT #" + to_string(copy + 1) + " differs in " + to_string(end - c) + " entries"});
+        c = end;
+      }
+    });
+  }
+
+  sort(report.issues.begin(), report.issues.end(), [](FsckIssue const& a, FsckIssue const& b) {
+    return a.kind != b.kind ? a.kind < b.kind : a.cluster < b.cluster;
+  });
+
+  return report;
+}
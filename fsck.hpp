@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fat32.hpp"
+
+using namespace std;
+
+struct FsckIssue
+{
+  enum Kind
+  {
+    CROSS_LINK,               // cluster reached from two chains (or twice from one FAT link)
+    FREE_IN_CHAIN,            // chain runs into a free cluster
+    BAD_LINK,                 // link to a reserved or out of range cluster
+    LOOP,                     // chain comes back to one of its own clusters
+    LOST_CLUSTERS,            // allocated chain no entry refers to, or a loop of them without a head
+    SIZE_MISMATCH,            // file size does not match the chain length
+    FAT_MISMATCH,             // FAT copies disagree on a range of entries
+  };
+
+  Kind kind;
+  string path;                // entry the issue was found on, empty for FAT level issues
+  uint32_t cluster;
+  uint64_t count;             // lost clusters, differing entries, chain length
+  string detail;
+};
+
+struct FsckReport
+{
+  vector<FsckIssue> issues;
+
+  uint64_t file_cnt = 0;
+  uint64_t dir_cnt = 0;
+  uint64_t used_cluster_cnt = 0;       // non-free FAT entries
+  uint64_t referenced_cluster_cnt = 0; // reached from a directory entry
+  uint64_t lost_cluster_cnt = 0;
+
+  bool is_clean() { return issues.empty(); }
+};
+
+//
+// Read-only consistency check of the FAT against the directory tree. The
+// FAT scan, the chain walks and the lost cluster search run on thread_cnt
+// threads over ranges of the FAT, sharing atomic bitmaps of the clusters
+// that have been referenced.
+//
+class Fsck
+{
+  public:
+    Fsck(FAT32& fat32, unsigned thread_cnt = 0);
+
+  public:
+    FsckReport run();
+
+    static char const* kind_name(FsckIssue::Kind kind);
+
+  private:
+    FAT32& fat32;
+    unsigned thread_cnt;
+};
@@ -0,0 +1,382 @@
+#include "hash.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+
+static constexpr uint32_t SHA256_K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static constexpr uint32_t SHA256_INIT[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static inline uint32_t load_be32(uint8_t const *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static inline uint32_t rotr(uint32_t x, int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(uint32_t state[8], uint8_t const *p)
+{
+  uint32_t w[64];
+  for (int t = 0; t < 16; t++)
+    w[t] = load_be32(p + 4 * t);
+  for (int t = 16; t < 64; t++) {
+    uint32_t s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+    uint32_t s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+    w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+  for (int t = 0; t < 64; t++) {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[t] + w[t];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+Sha256::Sha256()
+{
+  memcpy(state, SHA256_INIT, sizeof(state));
+}
+
+void Sha256::update(void const *data, size_t size)
+{
+  uint8_t const *p = (uint8_t const*)data;
+  total += size;
+
+  if (block_len > 0) {
+    size_t n = min(size, 64 - block_len);
+    memcpy(block + block_len, p, n);
+    block_len += n;
+    p += n;
+    size -= n;
+    if (block_len < 64)
+      return;
+    sha256_block(state, block);
+    block_len = 0;
+  }
+
+  for (; size >= 64; p += 64, size -= 64)
+    sha256_block(state, p);
+
+  memcpy(block, p, size);
+  block_len = size;
+}
+
+array<uint8_t, 32> Sha256::finish()
+{
+  uint64_t bits = total * 8;
+  uint8_t tail[72] = { 0x80 };
+  size_t pad = (block_len < 56 ? 56 : 120) - block_len;
+  for (int i = 0; i < 8; i++)
+    tail[pad + i] = bits >> (56 - 8 * i);
+  update(tail, pad + 8);
+
+  array<uint8_t, 32> digest;
+  for (int i = 0; i < 8; i++)
+    store_be32(&digest[4 * i], state[i]);
+  return digest;
+}
+
+//
+// MD5
+//
+
+static constexpr uint32_t MD5_K[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static constexpr int MD5_S[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(uint32_t state[4], uint8_t const *p)
+{
+  uint32_t m[16];
+  for (int i = 0; i < 16; i++)
+    m[i] = (uint32_t)p[4 * i] | ((uint32_t)p[4 * i + 1] << 8) | ((uint32_t)p[4 * i + 2] << 16) | ((uint32_t)p[4 * i + 3] << 24);
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+
+  for (int i = 0; i < 64; i++) {
+    uint32_t f;
+    int g;
+    if (i < 16)      { f = (b & c) | (~b & d); g = i; }
+    else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) % 16; }
+    else if (i < 48) { f = b ^ c ^ d;          g = (3 * i + 5) % 16; }
+    else             { f = c ^ (b | ~d);       g = (7 * i) % 16; }
+
+    f += a + MD5_K[i] + m[g];
+    a = d; d = c; c = b;
+    b += (f << MD5_S[i]) | (f >> (32 - MD5_S[i]));
+  }
+
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+}
+
+Md5::Md5()
+{
+  state[0] = 0x67452301;
+  state[1] = 0xefcdab89;
+  state[2] = 0x98badcfe;
+  state[3] = 0x10325476;
+}
+
+void Md5::update(void const *data, size_t size)
+{
+  uint8_t const *p = (uint8_t const*)data;
+  total += size;
+
+  if (block_len > 0) {
+    size_t n = min(size, 64 - block_len);
+    memcpy(block + block_len, p, n);
+    block_len += n;
+    p += n;
+    size -= n;
+    if (block_len < 64)
+      return;
+    md5_block(state, block);
+    block_len = 0;
+  }
+
+  for (; size >= 64; p += 64, size -= 64)
+    md5_block(state, p);
+
+  memcpy(block, p, size);
+  block_len = size;
+}
+
+array<uint8_t, 16> Md5::finish()
+{
+  uint64_t bits = total * 8;
+  uint8_t tail[72] = { 0x80 };
+  size_t pad = (block_len < 56 ? 56 : 120) - block_len;
+  for (int i = 0; i < 8; i++)
+    tail[pad + i] = bits >> (8 * i);
+  update(tail, pad + 8);
+
+  array<uint8_t, 16> digest;
+  for (int i = 0; i < 4; i++) {
+    for (int k = 0; k < 4; k++)
+      digest[4 * i + k] = state[i] >> (8 * k);
+  }
+  return digest;
+}
+
+//
+// SHA-256 across lanes, with GCC vector extensions. The body is inlined into
+// one function per instruction set; vectors never cross a call.
+//
+
+typedef uint32_t u32x8 __attribute__((vector_size(32)));
+
+// the blocks of one message: its full blocks, then one or two of padding
+struct LaneMessage
+{
+  uint8_t const *data;
+  size_t full_blocks;
+  size_t block_cnt;
+  uint8_t tail[128];
+
+  uint8_t const* get_block(size_t i) const
+  {
+    return i < full_blocks ? data + 64 * i : tail + 64 * (i - full_blocks);
+  }
+};
+
+#define LANE_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline __attribute__((always_inline))
+void sha256_lanes_body(LaneMessage const *lanes, size_t lane_cnt, uint32_t out[8][SHA256_LANES])
+{
+  static uint8_t const zero_block[64] = {};
+
+  u32x8 state[8];
+  for (int k = 0; k < 8; k++)
+    state[k] = u32x8{} + SHA256_INIT[k];
+
+  u32x8 block_cnt = {};
+  size_t max_blocks = 0;
+  for (size_t l = 0; l < lane_cnt; l++) {
+    block_cnt[l] = lanes[l].block_cnt;
+    max_blocks = max(max_blocks, lanes[l].block_cnt);
+  }
+
+  for (size_t i = 0; i < max_blocks; i++) {
+    // the lanes done with their message work on zeros and keep their state
+    u32x8 active = (u32x8)(u32x8{} + (uint32_t)i < block_cnt);
+
+    u32x8 w[64];
+    for (size_t l = 0; l < SHA256_LANES; l++) {
+      uint8_t const *p = l < lane_cnt && i < lanes[l].block_cnt ? lanes[l].get_block(i) : zero_block;
+      for (int t = 0; t < 16; t++)
+        w[t][l] = load_be32(p + 4 * t);
+    }
+
+    for (int t = 16; t < 64; t++) {
+      u32x8 s0 = LANE_ROTR(w[t - 15], 7) ^ LANE_ROTR(w[t - 15], 18) ^ (w[t - 15] >> 3);
+      u32x8 s1 = LANE_ROTR(w[t - 2], 17) ^ LANE_ROTR(w[t - 2], 19) ^ (w[t - 2] >> 10);
+      w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+    }
+
+    u32x8 a = state[0], b = state[1], c = state[2], d = state[3];
+    u32x8 e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int t = 0; t < 64; t++) {
+      u32x8 t1 = h + (LANE_ROTR(e, 6) ^ LANE_ROTR(e, 11) ^ LANE_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[t] + w[t];
+      u32x8 t2 = (LANE_ROTR(a, 2) ^ LANE_ROTR(a, 13) ^ LANE_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a & active; state[1] += b & active; state[2] += c & active; state[3] += d & active;
+    state[4] += e & active; state[5] += f & active; state[6] += g & active; state[7] += h & active;
+  }
+
+  for (int k = 0; k < 8; k++) {
+    for (size_t l = 0; l < SHA256_LANES; l++)
+      out[k][l] = state[k][l];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HASH_X86 1
+
+__attribute__((target("avx2")))
+static void sha256_lanes_avx2(LaneMessage const *lanes, size_t lane_cnt, uint32_t out[8][SHA256_LANES])
+{
+  sha256_lanes_body(lanes, lane_cnt, out);
+}
+#endif
+
+static void sha256_lanes_generic(LaneMessage const *lanes, size_t lane_cnt, uint32_t out[8][SHA256_LANES])
+{
+  sha256_lanes_body(lanes, lane_cnt, out);
+}
+
+struct LanesImpl
+{
+  void (*fn)(LaneMessage const*, size_t, uint32_t[8][SHA256_LANES]);
+  char const *isa;
+};
+
+static LanesImpl& lanes_impl()
+{
+  static LanesImpl impl = [] {
+#ifdef HASH_X86
+    if (__builtin_cpu_supports("avx2"))
+      return LanesImpl{ sha256_lanes_avx2, "avx2" };
+#endif
+    return LanesImpl{ sha256_lanes_generic, "generic" };
+  }();
+
+  return impl;
+}
+
+void sha256_lanes(vector<pair<void const*, size_t>> const& messages, vector<array<uint8_t, 32>>& digests)
+{
+  if (messages.size() > SHA256_LANES)
+    throw invalid_argument("sha256_lanes: more messages than lanes");
+
+  LaneMessage lanes[SHA256_LANES];
+  for (size_t l = 0; l < messages.size(); l++) {
+    auto [data, size] = messages[l];
+    LaneMessage& lane = lanes[l];
+
+    lane.data = (uint8_t const*)data;
+    lane.full_blocks = size / 64;
+
+    size_t rest = size % 64;
+    size_t tail_len = rest < 56 ? 64 : 128;
+    memset(lane.tail, 0, sizeof(lane.tail));
+    if (rest > 0)
+      memcpy(lane.tail, lane.data + 64 * lane.full_blocks, rest);
+    lane.tail[rest] = 0x80;
+    for (int i = 0; i < 8; i++)
+      lane.tail[tail_len - 8 + i] = (uint64_t)size * 8 >> (56 - 8 * i);
+
+    lane.block_cnt = lane.full_blocks + tail_len / 64;
+  }
+
+  uint32_t out[8][SHA256_LANES];
+  lanes_impl().fn(lanes, messages.size(), out);
+
+  digests.resize(messages.size());
+  for (size_t l = 0; l < messages.size(); l++) {
+    for (int k = 0; k < 8; k++)
+      store_be32(&digests[l][4 * k], out[k][l]);
+  }
+}
+
+char const* sha256_lanes_isa()
+{
+  return lanes_impl().isa;
+}
+
+bool set_sha256_lanes_isa(string const& isa)
+{
+  if (isa == "generic") {
+    lanes_impl() = LanesImpl{ sha256_lanes_generic, "generic" };
+    return true;
+  }
+
+#ifdef HASH_X86
+  if (isa == "avx2" && __builtin_cpu_supports("avx2")) {
+    lanes_impl() = LanesImpl{ sha256_lanes_avx2, "avx2" };
+    return true;
+  }
+#endif
+
+  return false;
+}
+
+string to_hex(uint8_t const *data, size_t size)
+{
+  static char const digits[] = "0123456789abcdef";
+
+  string res(2 * size, '0');
+  for (size_t i = 0; i < size; i++) {
+    res[2 * i] = digits[data[i] >> 4];
+    res[2 * i + 1] = digits[data[i] & 0x0F];
+  }
+  return res;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// SHA-256 (FIPS 180-4), fed in pieces of any size
+class Sha256
+{
+  public:
+    Sha256();
+
+  public:
+    void update(void const *data, size_t size);
+    array<uint8_t, 32> finish();
+
+  private:
+    uint32_t state[8];
+    uint8_t block[64];
+    size_t block_len = 0;
+    uint64_t total = 0;
+};
+
+// MD5 (RFC 1321), fed in pieces of any size
+class Md5
+{
+  public:
+    Md5();
+
+  public:
+    void update(void const *data, size_t size);
+    array<uint8_t, 16> finish();
+
+  private:
+    uint32_t state[4];
+    uint8_t block[64];
+    size_t block_len = 0;
+    uint64_t total = 0;
+};
+
+static constexpr size_t SHA256_LANES = 8;
+
+//
+// SHA-256 of up to SHA256_LANES whole messages at once, one message per
+// 32 bit lane of a vector: the lanes run the rounds in lockstep, and a lane
+// whose message has no more blocks keeps its state. Messages of similar
+// length waste the fewest lanes. AVX2 when the CPU has it, otherwise the
+// same vector code as the compiler lowers it for the base instruction set.
+//
+void sha256_lanes(vector<pair<void const*, size_t>> const& messages, vector<array<uint8_t, 32>>& digests);
+
+// "avx2" or "generic", whichever sha256_lanes() runs with
+char const* sha256_lanes_isa();
+// makes sha256_lanes() run with isa from now on, false when this CPU has no such
+// path; for tests, not to be called while another thread hashes
+bool set_sha256_lanes_isa(string const& isa);
+
+// lower case hex digits
+string to_hex(uint8_t const *data, size_t size);
@@ -0,0 +1,196 @@
+#include "image_generator.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "fat32.hpp"
+#include "fat32_format.hpp"
+
+
+// 2020-01-01 00:00:00, for every entry the generator writes
+static constexpr time_t GENERATOR_TIME = 1577836800;
+
+static uint64_t pick_size(mt19937_64& rng, GeneratorOptions const& options)
+{
+  uint64_t lo = options.min_size;
+  uint64_t hi = max(options.min_size, options.max_size);
+
+  switch (options.dist) {
+    case SizeDistribution::FIXED:
+      return hi;
+
+    case SizeDistribution::UNIFORM:
+      return uniform_int_distribution<uint64_t>(lo, hi)(rng);
+
+    case SizeDistribution::LOGNORMAL: {
+      // median at the geometric middle, most files fall within the range
+      double l = log((double)max<uint64_t>(lo, 1));
+      double h = log((double)max<uint64_t>(hi, 1));
+      double v = exp(normal_distribution<double>((l + h) / 2, max((h - l) / 4, 1e-9))(rng));
+      return clamp<uint64_t>((uint64_t)v, lo, hi);
+    }
+  }
+
+  return lo;
+}
+
+// cheap, seeded file contents; a file never repeats another file's bytes
+static string make_data(uint64_t size, uint64_t seed)
+{
+  string data(size, '\0');
+  uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+  for (uint64_t i = 0; i < size; i += 8) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    memcpy(&data[i], &x, min<uint64_t>(8, size - i));
+  }
+
+  return data;
+}
+
+static string make_name(mt19937_64& rng, double lfn, uint64_t idx)
+{
+  static char const *words[] = { "report", "photo", "backup", "notes", "Invoice", "draft", "scan", "music track" };
+  char buf[96];
+
+  if (lfn > 0 && uniform_real_distribution<double>(0, 1)(rng) < lfn) {
+    auto word = words[rng() % (sizeof(words) / sizeof(words[0]))];
+    snprintf(buf, sizeof(buf), "%s %llu of the synthetic set.dat", word, (unsigned long long)idx);
+  } else {
+    snprintf(buf, sizeof(buf), "F%07llu.DAT", (unsigned long long)(idx % 10000000));
+  }
+
+  return buf;
+}
+
+GeneratorStats generate_image(string const& path, GeneratorOptions const& options)
+{
+  if (options.min_size > 0xFFFFFFFF || options.max_size > 0xFFFFFFFF)
+    throw invalid_argument("file sizes are limited to 4 GB - 1 on FAT32");
+
+  FormatOptions format;
+  format.size = options.size;
+  format.cluster_size = options.cluster_size;
+  format.label = "SYNTHETIC";
+  format.volume_id = (uint32_t)(options.seed * 2654435761u) | 1;
+  format_image(path, format);
+
+  GeneratorStats stats;
+  mt19937_64 rng(options.seed);
+
+  FAT32 fat32(path, true);
+  fat32.build();
+  fat32.set_timestamp(GENERATOR_TIME);
+
+  // directories breadth first, fanout per level; used counts the slots of each,
+  // the root has the volume label and the others "." and ".."
+  vector<DirectoryEntry*> dirs = { fat32.get_root_dir() };
+  vector<uint32_t> used = { 1 };
+  size_t level_begin = 0;
+
+  for (uint32_t level = 0; level < options.depth; level++) {
+    size_t level_end = dirs.size();
+
+    for (size_t i = level_begin; i < level_end; i++) {
+      for (uint32_t k = 0; k < options.fanout; k++) {
+        char name[24];     // "D%02u_%04u" of two full uint32_t
+        snprintf(name, sizeof(name), "D%02u_%04u", level + 1, k);
+        dirs.push_back(fat32.create_dir(dirs[i], name));
+        used.push_back(2);
+        used[i]++;
+        stats.dir_cnt++;
+      }
+    }
+
+    level_begin = level_end;
+  }
+
+  uint32_t cluster_size = fat32.get_super_block()->get_cluster_size();
+  DirectoryEntry *held = nullptr;   // fragmented file waiting for a partner
+  string held_data;
+  bool held_deleted = false;
+  vector<DirectoryEntry*> doomed;   // removed once everything is written
+
+  for (uint64_t idx = 0; idx < options.file_cnt; idx++) {
+    size_t dir_idx = rng() % dirs.size();
+    string name = make_name(rng, options.lfn, idx);
+
+    // a full directory hands its place in dirs over to a new subdirectory, so
+    // none goes past FAT32::DIR_SLOT_MAX however many files there are
+    uint32_t slot_cnt = entry_slot_cnt(name);
+    if (used[dir_idx] + slot_cnt + 1 > FAT32::DIR_SLOT_MAX) {
+      dirs[dir_idx] = fat32.create_dir(dirs[dir_idx], "MORE");
+      used[dir_idx] = 2;
+      stats.dir_cnt++;
+    }
+    used[dir_idx] += slot_cnt;
+
+    DirectoryEntry *dir = dirs[dir_idx];
+    string data = make_data(pick_size(rng, options), options.seed ^ idx);
+
+    bool fragmented = options.frag > 0 && data.size() > cluster_size
+        && uniform_real_distribution<double>(0, 1)(rng) < options.frag;
+    bool deleted = options.deleted > 0 && uniform_real_distribution<double>(0, 1)(rng) < options.deleted;
+
+    stats.file_cnt++;
+    stats.byte_cnt += data.size();
+
+    if (!fragmented) {
+      DirectoryEntry *dentry = fat32.create_file(dir, name, data);
+      if (deleted)
+        doomed.push_back(dentry);
+      continue;
+    }
+
+    // two files grown a cluster at a time in turns end up interleaved on disk
+    DirectoryEntry *dentry = fat32.create_file(dir, name);
+    stats.fragmented_cnt++;
+
+    if (held == nullptr) {
+      held = dentry;
+      held_data = std::move(data);
+      held_deleted = deleted;
+      continue;
+    }
+
+    for (size_t a = 0, b = 0; a < held_data.size() || b < data.size(); ) {
+      if (a < held_data.size()) {
+        fat32.append(held, held_data.substr(a, cluster_size));
+        a += cluster_size;
+      }
+      if (b < data.size()) {
+        fat32.append(dentry, data.substr(b, cluster_size));
+        b += cluster_size;
+      }
+    }
+
+    if (held_deleted)
+      doomed.push_back(held);
+    if (deleted)
+      doomed.push_back(dentry);
+    held = nullptr;
+  }
+
+  // no partner came, written in one piece
+  if (held != nullptr) {
+    fat32.append(held, held_data);
+    stats.fragmented_cnt--;
+    if (held_deleted)
+      doomed.push_back(held);
+  }
+
+  // last, so no later file takes over the 0xE5 entries or the clusters they leave behind
+  for (DirectoryEntry *dentry : doomed)
+    fat32.remove(dentry);
+  stats.deleted_cnt = doomed.size();
+
+  fat32.flush();
+
+  return stats;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+enum class SizeDistribution
+{
+  FIXED,                             // every file is max_size
+  UNIFORM,                           // uniform in [min_size, max_size]
+  LOGNORMAL,                         // lognormal with its median halfway, clamped to [min_size, max_size]
+};
+
+struct GeneratorOptions
+{
+  uint64_t size = 0;                 // image size in bytes
+  uint32_t cluster_size = 0;         // 0: format default
+  uint64_t file_cnt = 1000;
+  uint32_t depth = 2;                // directory levels below the root
+  uint32_t fanout = 4;               // subdirectories per directory
+  uint64_t min_size = 0;
+  uint64_t max_size = 64 << 10;
+  SizeDistribution dist = SizeDistribution::LOGNORMAL;
+  double frag = 0.0;                 // share of files written interleaved with another one
+  double lfn = 0.0;                  // share of files with a long name
+  double deleted = 0.0;              // share of files removed again, leaving 0xE5 entries
+  uint64_t seed = 1;
+};
+
+struct GeneratorStats
+{
+  uint64_t dir_cnt = 0;
+  uint64_t file_cnt = 0;
+  uint64_t deleted_cnt = 0;
+  uint64_t fragmented_cnt = 0;
+  uint64_t byte_cnt = 0;
+};
+
+//
+// Formats path and fills it with a synthetic tree. Names, sizes, contents,
+// timestamps and the volume id depend only on the options, so the same
+// options always give a byte-identical image.
+//
+GeneratorStats generate_image(string const& path, GeneratorOptions const& options);
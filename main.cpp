@@ -1,368 +1,451 @@
+#include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <vector>
 #include <map>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <sys/stat.h>
-
-#include "byte_buffer.hpp"
+#include <unistd.h>
+
+#include "fat32.hpp"
+#include "carver.hpp"
+#include "cluster_map.hpp"
+#include "defrag.hpp"
+#include "file_reader.hpp"
+#include "fat32_format.hpp"
+#include "fat_mirror.hpp"
+#include "fragmentation.hpp"
+#include "fsck.hpp"
+#include "image_generator.hpp"
+#include "manifest.hpp"
+#include "orphans.hpp"
+#include "recovery.hpp"
+#include "tar_export.hpp"
 
 using namespace std;
 
-
-inline std::string& rtrim(std::string& s, const char* t = " \t\n\r\f\v")
+// "512M", "2T", "1000000000"
+uint64_t parse_size(string s)
 {
-  s.erase(s.find_last_not_of(t) + 1);
-  return s;
+  size_t idx = 0;
+  uint64_t size = stoull(s, &idx);
+  string unit = fold_name(s.substr(idx));
+
+  if (unit == "K") return size << 10;
+  if (unit == "M") return size << 20;
+  if (unit == "G") return size << 30;
+  if (unit == "T") return size << 40;
+  if (!unit.empty())
+    throw invalid_argument("bad size: " + s);
+
+  return size;
 }
 
-// overload of tolower(char) function
-string tolower(string s)
+GeneratorOptions parse_generator_options(int argc, char* argv[])
 {
-  string res = "";
-
-  for (int i = 0; i < s.size(); i++) {
-    res += tolower(s.at(i));
+  GeneratorOptions options;
+
+  for (int i = 0; i < argc; i++) {
+    string arg = argv[i];
+    size_t eq = arg.find('=');
+    if (eq == string::npos)
+      throw invalid_argument("expected key=value: " + arg);
+
+    string key = arg.substr(0, eq);
+    string value = arg.substr(eq + 1);
+
+    if (key == "files")         options.file_cnt = stoull(value);
+    else if (key == "depth")    options.depth = stoul(value);
+    else if (key == "fanout")   options.fanout = stoul(value);
+    else if (key == "min_size") options.min_size = parse_size(value);
+    else if (key == "max_size") options.max_size = parse_size(value);
+    else if (key == "cluster")  options.cluster_size = parse_size(value);
+    else if (key == "frag")     options.frag = stod(value);
+    else if (key == "lfn")      options.lfn = stod(value);
+    else if (key == "deleted")  options.deleted = stod(value);
+    else if (key == "seed")     options.seed = stoull(value);
+    else if (key == "dist") {
+      if (value == "fixed")          options.dist = SizeDistribution::FIXED;
+      else if (value == "uniform")   options.dist = SizeDistribution::UNIFORM;
+      else if (value == "lognormal") options.dist = SizeDistribution::LOGNORMAL;
+      else throw invalid_argument("bad distribution: " + value);
+    } else {
+      throw invalid_argument("unknown option: " + key);
+    }
   }
 
-  return res;
+  return options;
 }
 
-bool create_dirs(string file_path)
+int usage()
 {
-  istringstream iss(file_path);
-  string directory;
-  string curr_path = "";
-
-  while (std::getline(iss, directory, '/'))
-  {
-    curr_path += directory + "/";
-
-    struct stat info;
-    if (stat(curr_path.c_str(), &info) != 0) {
-        if (mkdir(curr_path.c_str(), 0777) != 0) {
-            std::cerr << "Error creating directory: " << strerror(errno) << std::endl;
-            return false;
-        }
-    }
-  }
-
-  return true;
+  cerr << "usage: main                                   build the tree of FAT32_simple.mdf" << endl;
+  cerr << "       main extract <image> <out dir> [stats]   copy every file out of the image," << endl;
+  cerr << "                                               counters go to stats (.json or .prom)" << endl;
+  cerr << "       main hashextract <image> <out dir> <manifest> extract, with SHA-256 and MD5 of every file" << endl;
+  cerr << "       main tar <image> <archive|-> [path] [manifest] write the tree (or path) as a tar stream" << endl;
+  cerr << "       main fsck <image> [threads]              check FAT chains against the directory tree" << endl;
+  cerr << "       main owner <image> <offset>...           which file owns each byte offset" << endl;
+  cerr << "       main lookup <image> <path>...            entries by path, case-insensitive" << endl;
+  cerr << "       main ls <image> [path]                   list a directory, reading only the directories on the way" << endl;
+  cerr << "       main cat <image> <path> [offset] [length] bytes of a file to stdout" << endl;
+  cerr << "       main frag <image> [top]                  fragmentation report" << endl;
+  cerr << "       main fatdiff <image> [--repair]          compare the FAT copies, make them agree" << endl;
+  cerr << "       main defrag <image>                      make every chain contiguous" << endl;
+  cerr << "       main deleted <image>                     list deleted entries and their chances" << endl;
+  cerr << "       main undelete <image> <out dir> [partial] recover deleted files whose clusters are free" << endl;
+  cerr << "       main carve <image> <out dir> [threads]   carve JPEG/PNG/PDF/ZIP files out of free clusters" << endl;
+  cerr << "       main orphans <image> [out dir]           find directories the root no longer reaches" << endl;
+  cerr << "       main format <image> <size> [cluster] [sector] create an empty FAT32 image" << endl;
+  cerr << "       main generate <image> <size> [key=value]... create a synthetic FAT32 image" << endl;
+  cerr << "            keys: files depth fanout min_size max_size dist=fixed|uniform|lognormal" << endl;
+  cerr << "                  frag lfn deleted (ratios 0..1) cluster seed" << endl;
+  return 1;
 }
 
-void export_file(string file_path, string file_name, string file_data)
+// FAT32_TRACE=<file> records trace spans and writes them there on exit
+static void write_trace()
 {
-  if (!create_dirs(file_path)) {
-    cerr << "error";
+  try {
+    Tracer::instance().write_chrome_trace(getenv("FAT32_TRACE"));
+  } catch (exception const& e) {
+    cerr << "error: " << e.what() << endl;
   }
-
-  ofstream ofs(file_path + "/" + file_name);
-
-  if (!ofs.good())
-    cerr << "error";
-
-  ofs << file_data;
-
-  ofs.close();
 }
 
-
-class SuperBlock
-{
-  public:
-    SuperBlock() {}
-
-    SuperBlock(uint8_t *buffer, int size)
-    {
-      sys::io::byte_buffer bb((uint8_t*)buffer, 0, size);
-      bb.skip(0x0B);
-
-      sector_size = bb.get_uint16_le();
-      uint8_t sector_per_cluster = bb.get_uint8();
-      cluster_size = sector_size * sector_per_cluster;
-      rsvd_sector_cnt = bb.get_uint16_le();
-      
-      fat_no = bb.get_uint8();
-      bb.skip(0x13);
-      fat_offset = rsvd_sector_cnt * sector_size;
-      fat_sector_no = bb.get_uint32_le();
-      fat_area_size = fat_sector_no * sector_size * fat_no;
-
-      data_area_addr = fat_offset + fat_area_size;
-      bb.skip(0x04);
-      root_cluster_addr = bb.get_uint32_le();
-    }
-
-  public:
-    uint16_t get_cluster_size()       { return cluster_size; }
-    uint16_t get_rsvd_sector_cnt()    { return rsvd_sector_cnt; }
-    uint16_t get_sector_size()        { return sector_size; }
-    uint32_t get_fat_offset()         { return fat_offset; }
-    uint32_t get_fat_sector_no()      { return fat_sector_no; }
-    uint32_t get_fat_area_size()      { return fat_area_size; }
-    uint32_t get_data_area_addr()     { return data_area_addr; }
-    uint32_t get_root_cluster_addr()  { return root_cluster_addr; }
-
-  private:
-    uint16_t sector_size;
-    uint16_t cluster_size;
-    uint16_t rsvd_sector_cnt;
-    uint8_t fat_no;
-    uint32_t fat_offset;
-    uint32_t fat_sector_no;
-    uint32_t fat_area_size;
-    uint32_t data_area_addr;
-    uint32_t root_cluster_addr;
-};
-
-class FatArea
+int main(int argc, char* argv[])
 {
-  public:
-    FatArea() {}
-
-    FatArea(uint8_t *buffer, int size)
-    {
-      sys::io::byte_buffer bb((uint8_t*)buffer, 0, size);
+  string cmd = argc > 1 ? argv[1] : "";
 
-      int entry_cnt = size / 4;
-      clusters_vec.reserve(entry_cnt);
+  if (getenv("FAT32_TRACE") != nullptr) {
+    Tracer::instance().enable();
+    Tracer::instance().set_thread_name("main");
+    atexit(write_trace);
+  }
 
-      for (int i = 0; i < entry_cnt; i++) {
-        clusters_vec.push_back(bb.get_uint32_le());
+  try {
+    if (cmd == "format") {
+      if (argc < 4)
+        return usage();
+
+      FormatOptions options;
+      options.size = parse_size(argv[3]);
+      if (argc > 4)
+        options.cluster_size = parse_size(argv[4]);
+      if (argc > 5)
+        options.sector_size = parse_size(argv[5]);
+
+      format_image(argv[2], options);
+      return 0;
+    } else if (cmd == "extract") {
+      if (argc < 4)
+        return usage();
+
+      FAT32 fat32(argv[2]);
+      fat32.build();
+      fat32.extract(fat32.get_root_dir(), argv[3]);
+
+      if (argc > 4)
+        fat32.get_stats().dump(argv[4], argv[2]);
+      return 0;
+    } else if (cmd == "hashextract") {
+      if (argc < 5)
+        return usage();
+
+      FAT32 fat32(argv[2]);
+      fat32.build();
+
+      HashManifest manifest;
+      fat32.extract(fat32.get_root_dir(), argv[3], &manifest);
+      manifest.finish();
+      write_file(argv[4], manifest.to_text());
+
+      cerr << manifest.get_entries().size() << " files hashed (sha256 " << sha256_lanes_isa() << ")" << endl;
+      return 0;
+    } else if (cmd == "tar") {
+      if (argc < 4)
+        return usage();
+
+      FAT32 fat32(argv[2]);
+      fat32.build();
+
+      DirectoryEntry *dentry = fat32.lookup(argc > 4 ? argv[4] : "/");
+      if (dentry == nullptr) {
+        cerr << argv[4] << ": not found" << endl;
+        return 1;
       }
-    }
-
-  public:
-    vector<uint32_t> get_clusters() { return clusters_vec; }
-
-  private:
-    vector<uint32_t> clusters_vec;
-};
-
-class DirectoryEntry
-{
-  public:
-    DirectoryEntry() {}
-
-    DirectoryEntry(sys::io::byte_buffer& bb)
-    {
-      file_name_hex = bb.get_uint64_le();
-      bb.reset();
-
-      file_name = bb.get_ascii(8);
-      file_ext = bb.get_ascii(3);
-      attribute = bb.get_uint8();
-
-      bb.skip(0x08);
-      start_cluster_hi = bb.get_uint16_le();
-      bb.skip(0x04);
-      start_cluster_lo = bb.get_uint16_le();
 
-      start_cluster_no = ((uint32_t)start_cluster_hi << 16) | start_cluster_lo;
-
-      file_size = bb.get_uint32_le();
-    }
-
-    DirectoryEntry(uint8_t *buffer, int size)
-    {
-      sys::io::byte_buffer bb((uint8_t*)buffer, 0, size);
-
-      file_name_hex = bb.get_uint64_le();
-      bb.reset();
+      bool to_stdout = strcmp(argv[3], "-") == 0;
+      int fd = to_stdout ? STDOUT_FILENO : open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) {
+        cerr << "error creating " << argv[3] << ": " << strerror(errno) << endl;
+        return 1;
+      }
 
-      file_name = bb.get_ascii(8);
-      file_ext = bb.get_ascii(3);
-      attribute = bb.get_uint8();
+      HashManifest manifest;
+      TarReport report = TarExport(fat32, fd, argc > 5 ? &manifest : nullptr).write(dentry);
+      if (!to_stdout && close(fd) != 0) {
+        cerr << "error writing " << argv[3] << ": " << strerror(errno) << endl;
+        return 1;
+      }
 
-      bb.skip(0x08);
-      start_cluster_hi = bb.get_uint16_le();
-      bb.skip(0x04);
-      start_cluster_lo = bb.get_uint16_le();
+      if (argc > 5) {
+        manifest.finish();
+        write_file(argv[5], manifest.to_text());
+      }
 
-      // Combine cluster numbers
-      start_cluster_no = ((uint32_t)start_cluster_hi << 16) | start_cluster_lo;
+      cerr << report.file_cnt << " files, " << report.dir_cnt << " dirs, " << report.data_bytes << " bytes of data, "
+           << report.archive_bytes << " bytes written" << endl;
+      return 0;
+    } else if (cmd == "fsck") {
+      if (argc < 3)
+        return usage();
 
-      file_size = bb.get_uint32_le();
-    }
+      FAT32 fat32(argv[2]);
+      fat32.build();
 
-  public:
-    bool is_deleted_file()
-    {
-      uint8_t first_byte = static_cast<uint8_t>(file_name_hex & 0xFF);
-      return (first_byte == 0xE5);
-    }
+      FsckReport report = Fsck(fat32, argc > 3 ? stoul(argv[3]) : 0).run();
+      for (auto& issue : report.issues) {
+        cout << Fsck::kind_name(issue.kind) << ": " << (issue.path.empty() ? "" : issue.path + ": ")
+             << "cluster " << issue.cluster << ", " << issue.detail << endl;
+      }
 
-  public:
-    void set_end_cluster_no(vector<uint32_t> clusters)
-    {
-      for (int i = start_cluster_no; i < clusters.size(); i++) {
-        if (clusters.at(i) == 0x0FFFFFFF) {
-          end_cluster_no = i;
-          return;
+      cout << report.file_cnt << " files, " << report.dir_cnt << " dirs, "
+           << report.used_cluster_cnt << " clusters used, " << report.referenced_cluster_cnt << " referenced, "
+           << report.lost_cluster_cnt << " lost, " << report.issues.size() << " issues" << endl;
+      return report.is_clean() ? 0 : 1;
+    } else if (cmd == "owner") {
+      if (argc < 4)
+        return usage();
+
+      FAT32 fat32(argv[2]);
+      ClusterMap map(fat32);
+      map.build();
+
+      for (int i = 3; i < argc; i++) {
+        uint64_t offset = parse_size(argv[i]);
+
+        // a cross-linked cluster has an owner per chain
+        for (auto& owner : map.find_offset(offset)) {
+          cout << offset << ": ";
+          if (owner.dentry != nullptr)
+            cout << owner.dentry->get_full_path() << " at " << owner.file_offset << " (cluster " << owner.cluster << ")" << endl;
+          else if (owner.cluster != 0)
+            cout << "cluster " << owner.cluster << ", not owned by any file" << endl;
+          else
+            cout << owner.region << endl;
         }
       }
-    }
+      return 0;
+    } else if (cmd == "lookup") {
+      if (argc < 4)
+        return usage();
+
+      FAT32 fat32(argv[2]);
+      fat32.build(true);
+
+      int missing = 0;
+      for (int i = 3; i < argc; i++) {
+        DirectoryEntry *dentry = fat32.lookup(argv[i]);
+        if (dentry == nullptr) {
+          cout << argv[i] << ": not found" << endl;
+          missing++;
+          continue;
+        }
 
-    void add_child(DirectoryEntry *child)
-    {
-      children.push_back(child);
-    }
+        cout << dentry->get_full_path() << (dentry->is_dir() && dentry->get_parent() != nullptr ? "/" : "") << ": " << dentry->get_file_size()
+             << " bytes, cluster " << dentry->get_start_cluster_no() << ", "
+             << fat32.to_extents(dentry->get_start_cluster_no()).size() << " extents" << endl;
+      }
+      return missing == 0 ? 0 : 1;
+    } else if (cmd == "ls") {
+      if (argc < 3)
+        return usage();
+
+      FAT32 fat32(argv[2]);
+      fat32.build(true);
+
+      DirectoryEntry *dir = fat32.lookup(argc > 3 ? argv[3] : "/");
+      if (dir == nullptr || !dir->is_dir()) {
+        cerr << (argc > 3 ? argv[3] : "/") << ": no such directory" << endl;
+        return 1;
+      }
 
-    void set_end_cluster_no() { end_cluster_no = file_size; }
-    void set_file_name(string str) { file_name = str; }
-    void set_path(string path) { this->path = path; }
-
-    string get_file_name()          { return file_name; }
-    string get_file_ext()           { return file_ext; }
-    uint8_t get_attribute()         { return attribute; }
-    uint32_t get_start_cluster_no() { return start_cluster_no; }
-    uint32_t get_end_cluster_no()   { return end_cluster_no; }
-    uint32_t get_file_size()        { return file_size; }
-    vector<DirectoryEntry*> get_children() { return children; }
-
-  private:
-    string file_name;
-    uint64_t file_name_hex;
-    string file_ext;
-    uint8_t attribute;
-    uint16_t start_cluster_hi;
-    uint16_t start_cluster_lo;
-    uint32_t start_cluster_no;
-    uint32_t end_cluster_no;
-    uint32_t file_size;
-
-    string path;
-    vector<DirectoryEntry*> children;
-};
-
-class Node
-{
-  public:
-    void set_size(uint32_t size) { this->size = size; }
-    void set_extents(map<uint32_t, uint32_t> extents)
-    {
-      this->extents = extents;
-    }
+      for (auto child : dir->get_children()) {
+        cout << (child->is_dir() ? "d " : "- ") << setw(10) << child->get_file_size() << " " << child->get_name()
+             << (child->is_dir() ? "/" : "") << endl;
+      }
 
-  private:
-    uint32_t size;
-    map<uint32_t, uint32_t> extents;
-};
+      FAT32Stats& stats = fat32.get_stats();
+      cerr << stats.get(FAT32Stats::READ_CALLS) << " reads, " << stats.get(FAT32Stats::BYTES_READ) << " bytes" << endl;
+      return 0;
+    } else if (cmd == "cat") {
+      if (argc < 4)
+        return usage();
 
-class FAT32
-{
-  public:
-    FAT32(string path)
-    {
-      fstream ifs(path);
-      if (!ifs.good())
-        cerr << "error reading file";
-
-      // Super Block/Boot Record
-      char buffer[96] = {0};
-      ifs.read(buffer, 96);
-      super_block = new SuperBlock((uint8_t*)buffer, 96);
-
-      // FAT area
-      vector<char> fat_buffer(super_block->get_fat_area_size());
-      ifs.seekg(super_block->get_fat_offset(), ios::beg);
-      ifs.read(&fat_buffer[0], super_block->get_fat_area_size());
-      fat_area = new FatArea((uint8_t*)fat_buffer.data(), super_block->get_fat_area_size());
-
-      ifs.close();
-    }
+      FAT32 fat32(argv[2]);
+      fat32.build(true);
 
-  public:
-    void build()
-    {
-      root_dir = new DirectoryEntry();
-      root_dir->set_path("root_inode");
+      DirectoryEntry *dentry = fat32.lookup(argv[3]);
+      if (dentry == nullptr || dentry->is_dir()) {
+        cerr << argv[3] << ": no such file" << endl;
+        return 1;
+      }
 
-      build_dir_tree(root_dir, super_block->get_data_area_addr() - 0x20);
-    }
+      FileReader reader(fat32, dentry);
+      uint64_t offset = argc > 4 ? parse_size(argv[4]) : 0;
+      uint64_t length = argc > 5 ? parse_size(argv[5]) : reader.get_size();
 
-    Node to_node(DirectoryEntry dentry)
-    {
-      Node node = Node();
-      node.set_size(dentry.get_file_size());
-      node.set_extents(to_extents(dentry.get_start_cluster_no()));
-      return node;
-    }
+      vector<char> buffer(1 << 20);
+      while (length > 0) {
+        size_t n = reader.read(offset, min<uint64_t>(length, buffer.size()), buffer.data());
+        if (n == 0)
+          break;
 
-    map<uint32_t, uint32_t> to_extents(uint32_t cluster_no)
-    {
-      map<uint32_t, uint32_t> extents;
-
-      uint32_t idx = cluster_no;
-      while (fat_area->get_clusters().at(idx) != 0x0FFFFFFF)
-      {
-        extents.insert({fat_area->get_clusters().at(idx), super_block->get_cluster_size()});
-        // Change to linked list-like ds
-        // fat_area->get_clusters().at(idx)
-        idx++;
+        cout.write(buffer.data(), n);
+        offset += n;
+        length -= n;
+      }
+      return 0;
+    } else if (cmd == "frag") {
+      if (argc < 3)
+        return usage();
+
+      FAT32 fat32(argv[2]);
+      fat32.build();
+      cout << analyze_fragmentation(fat32).to_text(argc > 3 ? stoul(argv[3]) : 20);
+      return 0;
+    } else if (cmd == "fatdiff") {
+      if (argc < 3)
+        return usage();
+
+      bool repair = argc > 3 && string(argv[3]) == "--repair";
+
+      FAT32 fat32(argv[2], repair);
+      fat32.build();
+      FatMirror mirror(fat32);
+      auto ranges = mirror.compare();
+
+      for (auto& range : ranges) {
+        cout << "clusters " << range.first << "-" << range.first + range.count - 1
+             << ": trusting FAT #" << range.trusted_copy + 1 << " (implausible entries:";
+        for (auto n : range.implausible)
+          cout << " " << n;
+        cout << ")" << endl;
       }
 
-      return extents;
-    }
-  
-  private:
-    void build_dir_tree(DirectoryEntry *parent_entry, uint32_t parent_entry_addr) {
-      uint32_t child_entry_addr = parent_entry_addr + 0x20; // directory entry size
-
-      while (true) {
-        fstream ifs("FAT32_simple.mdf");
-        ifs.seekg(child_entry_addr, ios::beg);
-        char child_direntry_buffer[32] = {0};
-        ifs.read(child_direntry_buffer, 32);
-        ifs.close();
-
-        // Check for the end of the children list
-        if (is_end_of_directory(child_direntry_buffer)) {
-          break;
-        }
-
-        DirectoryEntry* child_direntry = new DirectoryEntry((uint8_t*)child_direntry_buffer, 32);
-        uint8_t attribute = child_direntry->get_attribute();
-        string file_name = child_direntry->get_file_name();
-        rtrim(file_name);
+      cout << ranges.size() << " differing ranges (" << fat_mismatch_isa() << ")" << endl;
 
-        if (file_name.compare(".") == 0 || file_name.compare("..") == 0) { // skip "." or ".."
-          child_entry_addr += 0x20;
-          continue;
-        } else if (attribute == 0x10) { // if dir, then recursivly traverse
-          build_dir_tree(child_direntry, cal_data_offset(child_direntry->get_start_cluster_no()));
-        } else if (attribute != 0x20) { // if not file, then skip: {Hidden, Volume Label, LFN}
-          child_entry_addr += 0x20;
-          continue;
-        }
+      if (repair && !ranges.empty()) {
+        fat32.enable_wal();
+        mirror.apply(ranges);
+        fat32.flush();
+        cout << "repaired: every FAT copy now holds the trusted entries" << endl;
+        return 0;
+      }
 
-        parent_entry->add_child(child_direntry);
+      return ranges.empty() ? 0 : 1;
+    } else if (cmd == "defrag") {
+      if (argc < 3)
+        return usage();
+
+      FAT32 fat32(argv[2], true);
+      fat32.enable_wal();
+      fat32.build();
+
+      DefragReport report = Defragmenter(fat32).run();
+      cout << "file extents: " << report.file_extents_before << " -> " << report.file_extents_after
+           << ", dir extents: " << report.dir_extents_before << " -> " << report.dir_extents_after << endl;
+      cout << report.files_moved << " files, " << report.dirs_moved << " dirs moved ("
+           << report.clusters_moved << " clusters), " << report.skipped << " skipped" << endl;
+      return 0;
+    } else if (cmd == "deleted") {
+      if (argc < 3)
+        return usage();
+
+      FAT32 fat32(argv[2]);
+      auto entries = Recovery(fat32).scan();
+
+      for (auto& entry : entries) {
+        cout << entry.path << (entry.is_dir ? "/" : "") << ": " << Recovery::state_name(entry.state)
+             << ", cluster " << entry.start_cluster << ", " << entry.file_size << " bytes, "
+             << entry.free_cnt << "/" << entry.cluster_cnt << " clusters free" << endl;
+      }
+      cout << entries.size() << " deleted entries" << endl;
+      return 0;
+    } else if (cmd == "undelete") {
+      if (argc < 4)
+        return usage();
+
+      FAT32 fat32(argv[2]);
+      Recovery recovery(fat32);
+      auto entries = recovery.scan();
+
+      bool partial = argc > 4 && string(argv[4]) == "partial";
+      uint64_t cnt = recovery.recover(entries, argv[3], partial ? DeletedEntry::PARTIAL : DeletedEntry::RECOVERABLE);
+      cout << cnt << " of " << entries.size() << " deleted entries recovered" << endl;
+      return 0;
+    } else if (cmd == "carve") {
+      if (argc < 4)
+        return usage();
+
+      FAT32 fat32(argv[2]);
+      Carver carver(fat32, argc > 4 ? stoul(argv[4]) : 0);
+      CarveReport report = carver.run();
+
+      for (auto& file : report.files) {
+        cout << file.type << " at " << file.offset << ", " << file.size << " bytes"
+             << (file.complete ? "" : " (no footer)") << (file.ranges.size() > 1 ? ", fragmented" : "") << endl;
+      }
 
-        child_entry_addr += 0x20;
+      uint64_t cnt = carver.save(report, argv[3]);
+      cout << cnt << " files carved from " << report.free_cluster_cnt << " free clusters ("
+           << report.free_run_cnt << " runs, " << report.match_cnt << " signatures)" << endl;
+      return 0;
+    } else if (cmd == "orphans") {
+      if (argc < 3)
+        return usage();
+
+      FAT32 fat32(argv[2]);
+      OrphanScan scan(fat32);
+
+      for (auto& orphan : scan.run()) {
+        cout << "cluster " << orphan.cluster << ": " << OrphanScan::anchor_name(orphan.anchor)
+             << " " << (orphan.parent_path.empty() ? to_string(orphan.parent_cluster) : orphan.parent_path)
+             << ", " << orphan.dentry->get_children().size() << " entries"
+             << (orphan.allocated ? "" : ", clusters free") << endl;
       }
-    }
 
-    bool is_end_of_directory(char *buffer)
-    {
-      const char end_marker[32] = {0};
-      return (std::memcmp(buffer, end_marker, sizeof(end_marker)) == 0);
-    }
+      if (argc > 3) {
+        for (auto child : scan.get_tree()->get_children())
+          fat32.extract(child, argv[3]);
+      }
 
-    uint32_t cal_data_offset(uint32_t cluster_no)
-    {
-      uint32_t data_offset = super_block->get_data_area_addr() + ((cluster_no - super_block->get_root_cluster_addr()) * super_block->get_cluster_size());
-      return data_offset;
+      cout << scan.get_orphans().size() << " orphans among " << scan.get_dot_cluster_cnt() << " directory clusters, "
+           << scan.get_scanned_cnt() << " clusters scanned (" << find_dot_clusters_isa() << ")" << endl;
+      return 0;
+    } else if (cmd == "generate") {
+      if (argc < 4)
+        return usage();
+
+      GeneratorOptions options = parse_generator_options(argc - 4, argv + 4);
+      options.size = parse_size(argv[3]);
+
+      GeneratorStats stats = generate_image(argv[2], options);
+      cout << stats.dir_cnt << " dirs, " << stats.file_cnt << " files (" << stats.deleted_cnt << " deleted, "
+           << stats.fragmented_cnt << " fragmented), " << stats.byte_cnt << " bytes" << endl;
+      return 0;
+    } else if (!cmd.empty()) {
+      return usage();
     }
-  
-  private:
-    SuperBlock *super_block;
-    FatArea *fat_area;
-    DirectoryEntry *root_dir;
-};
+  } catch (exception const& e) {
+    cerr << "error: " << e.what() << endl;
+    return 1;
+  }
 
-int main(int argc, char* argv[])
-{
   FAT32 fat32("FAT32_simple.mdf");
   fat32.build();
 
@@ -0,0 +1,94 @@
+#include "manifest.hpp"
+
+#include <algorithm>
+
+
+void HashManifest::begin_file(DirectoryEntry *dentry)
+{
+  entries.push_back({ dentry->get_full_path(), dentry->get_file_size(), dentry->get_start_cluster_no(), {}, {} });
+
+  md5 = Md5();
+  data.clear();
+  streaming = false;
+}
+
+void HashManifest::file_data(void const *p, size_t size)
+{
+  md5.update(p, size);
+
+  if (streaming) {
+    sha256.update(p, size);
+    return;
+  }
+
+  if (data.size() + size <= LANE_MAX_BYTES) {
+    data.append((char const*)p, size);
+    return;
+  }
+
+  // too large for the lanes after all
+  streaming = true;
+  sha256 = Sha256();
+  sha256.update(data.data(), data.size());
+  sha256.update(p, size);
+  data.clear();
+}
+
+void HashManifest::end_file()
+{
+  ManifestEntry& entry = entries.back();
+  entry.md5 = md5.finish();
+
+  if (streaming) {
+    entry.sha256 = sha256.finish();
+    return;
+  }
+
+  queued.push_back({ entries.size() - 1, std::move(data) });
+  data = string();
+
+  if (queued.size() == QUEUE_CNT)
+    hash_queued();
+}
+
+void HashManifest::finish()
+{
+  hash_queued();
+}
+
+// lanes of a group finish together when their messages are about as long
+void HashManifest::hash_queued()
+{
+  TraceSpan span("HashManifest::hash_queued", "files", queued.size());
+
+  sort(queued.begin(), queued.end(), [](Queued const& a, Queued const& b) { return a.data.size() < b.data.size(); });
+
+  vector<pair<void const*, size_t>> messages;
+  vector<array<uint8_t, 32>> digests;
+
+  for (size_t first = 0; first < queued.size(); first += SHA256_LANES) {
+    size_t last = min(queued.size(), first + SHA256_LANES);
+
+    messages.clear();
+    for (size_t i = first; i < last; i++)
+      messages.push_back({ queued[i].data.data(), queued[i].data.size() });
+
+    sha256_lanes(messages, digests);
+    for (size_t i = first; i < last; i++)
+      entries[queued[i].index].sha256 = digests[i - first];
+  }
+
+  queued.clear();
+}
+
+string HashManifest::to_text()
+{
+  string res = "# path\tsize\tstart_cluster\tsha256\tmd5\n";
+
+  for (auto& entry : entries) {
+    res += entry.path + "\t" + to_string(entry.size) + "\t" + to_string(entry.start_cluster) + "\t"
+         + to_hex(entry.sha256.data(), entry.sha256.size()) + "\t" + to_hex(entry.md5.data(), entry.md5.size()) + "\n";
+  }
+
+  return res;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fat32.hpp"
+#include "hash.hpp"
+
+using namespace std;
+
+struct ManifestEntry
+{
+  string path;
+  uint64_t size;
+  uint32_t start_cluster;
+  array<uint8_t, 32> sha256;
+  array<uint8_t, 16> md5;
+};
+
+//
+// SHA-256 and MD5 of every file an extraction (or a tar export) writes,
+// hashed from the bytes on their way out. MD5 is computed as the data
+// arrives. Files up to LANE_MAX_BYTES are kept and their SHA-256 computed
+// SHA256_LANES at a time by sha256_lanes(), grouped by size once QUEUE_CNT
+// of them are waiting; a larger file is hashed as it streams through.
+// Entries are in the order the files were written; finish() hashes what is
+// still queued and must come before the entries are read.
+//
+class HashManifest : public ExtractSink
+{
+  public:
+    static constexpr size_t LANE_MAX_BYTES = 256 << 10;
+    static constexpr size_t QUEUE_CNT = 8 * SHA256_LANES;
+
+  public:
+    void begin_file(DirectoryEntry *dentry) override;
+    void file_data(void const *data, size_t size) override;
+    void end_file() override;
+
+    void finish();
+
+    vector<ManifestEntry>& get_entries() { return entries; }
+    // "path<TAB>size<TAB>start cluster<TAB>sha256<TAB>md5" lines under a header
+    string to_text();
+
+  private:
+    void hash_queued();
+
+  private:
+    struct Queued
+    {
+      size_t index;
+      string data;
+    };
+
+    vector<ManifestEntry> entries;
+    vector<Queued> queued;
+
+    // the file being written
+    Md5 md5;
+    Sha256 sha256;
+    string data;
+    bool streaming = false;
+};
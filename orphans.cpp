@@ -0,0 +1,331 @@
+#include "orphans.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+#include "parallel.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ORPHANS_X86 1
+#endif
+
+
+// data read at once by a scanning thread
+static constexpr uint32_t BATCH_BYTES = 4 << 20;
+
+static char const DOT_NAME[16]     = ".          ";
+static char const DOT_DOT_NAME[16] = "..         ";
+
+static bool is_dot_cluster_scalar(uint8_t const *p)
+{
+  return memcmp(p, DOT_NAME, 11) == 0 && (p[0x0B] & 0x10)
+      && memcmp(p + 0x20, DOT_DOT_NAME, 11) == 0 && (p[0x2B] & 0x10);
+}
+
+static void find_dot_clusters_scalar(uint8_t const *buffer, uint32_t count, uint32_t cluster_size, vector<uint32_t>& found)
+{
+  for (uint32_t i = 0; i < count; i++) {
+    if (is_dot_cluster_scalar(buffer + (size_t)i * cluster_size))
+      found.push_back(i);
+  }
+}
+
+#ifdef ORPHANS_X86
+__attribute__((target("sse2")))
+static void find_dot_clusters_sse2(uint8_t const *buffer, uint32_t count, uint32_t cluster_size, vector<uint32_t>& found)
+{
+  // the 11 name bytes of both entries by compare, the directory bit of both attributes by mask
+  __m128i dot = _mm_loadu_si128((__m128i const*)DOT_NAME);
+  __m128i dot_dot = _mm_loadu_si128((__m128i const*)DOT_DOT_NAME);
+  __m128i dir_bit = _mm_set_epi8(0, 0, 0, 0, 0x10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t const *p = buffer + (size_t)i * cluster_size;
+    __m128i a = _mm_loadu_si128((__m128i const*)p);
+    __m128i b = _mm_loadu_si128((__m128i const*)(p + 0x20));
+
+    int name_a = _mm_movemask_epi8(_mm_cmpeq_epi8(a, dot)) & 0x7FF;
+    int name_b = _mm_movemask_epi8(_mm_cmpeq_epi8(b, dot_dot)) & 0x7FF;
+    int dir = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(_mm_and_si128(a, b), dir_bit), dir_bit)) & 0x800;
+
+    if (name_a == 0x7FF && name_b == 0x7FF && dir)
+      found.push_back(i);
+  }
+}
+#endif
+
+struct DotScanImpl
+{
+  void (*fn)(uint8_t const*, uint32_t, uint32_t, vector<uint32_t>&);
+  char const *isa;
+};
+
+static DotScanImpl const& dot_scan_impl()
+{
+  static DotScanImpl const impl = [] {
+#ifdef ORPHANS_X86
+    if (__builtin_cpu_supports("sse2"))
+      return DotScanImpl{ find_dot_clusters_sse2, "sse2" };
+#endif
+    return DotScanImpl{ find_dot_clusters_scalar, "scalar" };
+  }();
+
+  return impl;
+}
+
+void find_dot_clusters(uint8_t const *buffer, uint32_t count, uint32_t cluster_size, vector<uint32_t>& found)
+{
+  dot_scan_impl().fn(buffer, count, cluster_size, found);
+}
+
+char const* find_dot_clusters_isa()
+{
+  return dot_scan_impl().isa;
+}
+
+// every directory below dentry by start cluster
+static void index_dirs(DirectoryEntry *dentry, unordered_map<uint32_t, DirectoryEntry*>& dirs)
+{
+  for (auto child : dentry->get_children()) {
+    if (child->is_dir()) {
+      dirs.emplace(child->get_start_cluster_no(), child);
+      index_dirs(child, dirs);
+    }
+  }
+}
+
+char const* OrphanScan::anchor_name(OrphanDir::Anchor anchor)
+{
+  switch (anchor) {
+    case OrphanDir::LIVE_PARENT:    return "live parent";
+    case OrphanDir::ORPHAN_PARENT:  return "orphan parent";
+    case OrphanDir::ROOT_PARENT:    return "root";
+    case OrphanDir::UNKNOWN_PARENT: return "unknown parent";
+  }
+
+  return "?";
+}
+
+OrphanScan::OrphanScan(FAT32& fat32, unsigned thread_cnt)
+  : fat32(fat32), thread_cnt(thread_cnt != 0 ? thread_cnt : max(1u, thread::hardware_concurrency()))
+{
+}
+
+OrphanScan::~OrphanScan()
+{
+  fat32.delete_subtree(tree);
+}
+
+// directory start clusters, sorted, each "." entry checked to point at its own cluster
+vector<uint32_t> OrphanScan::scan()
+{
+  TraceSpan span("OrphanScan::scan");
+
+  SuperBlock *super_block = fat32.get_super_block();
+  uint32_t cluster_size = super_block->get_cluster_size();
+  uint32_t max_cluster = super_block->get_cluster_cnt() + 1;
+
+  // clusters past the end of a truncated image cannot be read
+  uint64_t image_size = fat32.get_image_size();
+  while (max_cluster >= 2 && fat32.cal_data_offset(max_cluster) + cluster_size > image_size)
+    max_cluster--;
+
+  vector<uint32_t> starts;
+  mutex starts_lock;
+  exception_ptr error;
+
+  parallel_ranges(thread_cnt, 2, (uint64_t)max_cluster + 1, [&](uint64_t first, uint64_t last) {
+    TraceSpan span("OrphanScan::scan range", "cluster", first);
+
+    // an exception must not leave the thread, the first one is rethrown after the join
+    try {
+      uint32_t batch = max<uint32_t>(1, BATCH_BYTES / cluster_size);
+      vector<uint8_t> buffer((size_t)batch * cluster_size);
+      vector<uint32_t> found, local;
+
+      for (uint64_t c = first; c < last; c += batch) {
+        uint32_t n = min<uint64_t>(batch, last - c);
+        fat32.read_clusters(c, n, buffer.data());
+
+        found.clear();
+        find_dot_clusters(buffer.data(), n, cluster_size, found);
+
+        for (uint32_t i : found) {
+          sys::io::byte_buffer bb(&buffer[(size_t)i * cluster_size], 0x20);
+          if ((((uint32_t)bb.get_uint16_le(0x14) << 16) | bb.get_uint16_le(0x1A)) == c + i)
+            local.push_back(c + i);
+        }
+      }
+
+      lock_guard<mutex> guard(starts_lock);
+      starts.insert(starts.end(), local.begin(), local.end());
+    } catch (...) {
+      lock_guard<mutex> guard(starts_lock);
+      if (!error)
+        error = current_exception();
+    }
+  });
+
+  if (error)
+    rethrow_exception(error);
+
+  scanned_cnt = max_cluster - 1;
+  sort(starts.begin(), starts.end());
+
+  return starts;
+}
+
+//
+// Start clusters of the directories reachable from the root with their paths,
+// hidden ones included: a raw breadth first walk like Fsck does, names from
+// the tree where it has them.
+//
+void OrphanScan::reachable(unordered_map<uint32_t, string>& dirs)
+{
+  SuperBlock *super_block = fat32.get_super_block();
+  uint32_t cluster_size = super_block->get_cluster_size();
+  uint32_t max_cluster = super_block->get_cluster_cnt() + 1;
+  uint32_t max_dir_clusters = 65536 * 0x20 / cluster_size + 1;   // 65536 entries at most
+  uint32_t *fat = fat32.get_fat_area()->get_copy(0);
+
+  unordered_map<uint32_t, DirectoryEntry*> tree_dirs;
+  index_dirs(fat32.get_root_dir(), tree_dirs);
+
+  vector<uint32_t> queue = { super_block->get_root_cluster_addr() };
+  dirs[queue[0]] = "/";
+  vector<uint8_t> buffer(cluster_size);
+
+  for (size_t d = 0; d < queue.size(); d++) {
+    uint32_t cluster_no = queue[d];
+    string path = dirs[queue[d]];
+    bool end = false;
+
+    for (uint32_t n = 0; !end && n < max_dir_clusters && cluster_no >= 2 && cluster_no <= max_cluster; n++) {
+      fat32.read_cluster(cluster_no, buffer.data());
+
+      for (uint32_t slot = 0; slot < cluster_size / 0x20; slot++) {
+        uint8_t *e = &buffer[slot * 0x20];
+        uint8_t attribute = e[0x0B];
+
+        if (e[0] == 0x00) {
+          end = true;
+          break;
+        }
+
+        if (e[0] == 0xE5 || e[0] == '.' || attribute == 0x0F || (attribute & 0x18) != 0x10)
+          continue;
+
+        DirectoryEntry dentry(e, 0x20);
+        uint32_t start = dentry.get_start_cluster_no();
+        if (start == 0 || dirs.count(start))
+          continue;
+
+        auto it = tree_dirs.find(start);
+        dirs[start] = it != tree_dirs.end() ? it->second->get_full_path()
+                                            : (path == "/" ? "" : path) + "/" + dentry.get_short_name();
+        queue.push_back(start);
+      }
+
+      cluster_no = fat[cluster_no] & 0x0FFFFFFF;
+    }
+  }
+}
+
+vector<OrphanDir>& OrphanScan::run()
+{
+  TraceSpan span("OrphanScan::run");
+
+  if (fat32.get_root_dir() == nullptr)
+    fat32.build();
+
+  uint32_t cluster_size = fat32.get_super_block()->get_cluster_size();
+  uint32_t *fat = fat32.get_fat_area()->get_copy(0);
+
+  vector<uint32_t> starts = scan();
+  dot_cluster_cnt = starts.size();
+
+  unordered_map<uint32_t, string> live;
+  reachable(live);
+
+  orphans.clear();
+  unordered_map<uint32_t, size_t> orphan_at;
+  vector<uint8_t> buffer(cluster_size);
+
+  for (uint32_t c : starts) {
+    if (live.count(c))
+      continue;
+
+    fat32.read_cluster(c, buffer.data());
+    sys::io::byte_buffer bb(&buffer[0x20], 0x20);
+    uint32_t parent = ((uint32_t)bb.get_uint16_le(0x14) << 16) | bb.get_uint16_le(0x1A);
+
+    orphan_at[c] = orphans.size();
+    orphans.push_back({ c, parent, OrphanDir::UNKNOWN_PARENT, "", (fat[c] & 0x0FFFFFFF) != 0, nullptr });
+  }
+
+  for (auto& orphan : orphans) {
+    auto it = live.find(orphan.parent_cluster);
+    if (orphan.parent_cluster == 0) {
+      orphan.anchor = OrphanDir::ROOT_PARENT;
+      orphan.parent_path = "/";
+    } else if (it != live.end()) {
+      orphan.anchor = OrphanDir::LIVE_PARENT;
+      orphan.parent_path = it->second;
+    } else if (orphan_at.count(orphan.parent_cluster) && orphan.parent_cluster != orphan.cluster) {
+      orphan.anchor = OrphanDir::ORPHAN_PARENT;
+    }
+  }
+
+  // the recovered tree: orphans anchored outside the orphans first, then the
+  // others below their parents once those are in; what is left is a cycle
+  fat32.delete_subtree(tree);
+  tree = new DirectoryEntry();
+  tree->set_attribute(0x10);
+  tree->set_start_cluster_no(0);
+
+  unordered_map<uint32_t, DirectoryEntry*> nodes;
+
+  auto attach = [&](OrphanDir& orphan, DirectoryEntry *parent) {
+    auto it = nodes.find(orphan.cluster);
+    if (it != nodes.end()) {
+      orphan.dentry = it->second;         // reached through its parent's entries
+      return;
+    }
+
+    DirectoryEntry *dentry = fat32.build_subtree(orphan.cluster);
+    dentry->set_long_name("DIR" + to_string(orphan.cluster));
+    parent->add_child(dentry);
+
+    orphan.dentry = dentry;
+    nodes[orphan.cluster] = dentry;
+    index_dirs(dentry, nodes);
+  };
+
+  for (auto& orphan : orphans) {
+    if (orphan.anchor != OrphanDir::ORPHAN_PARENT)
+      attach(orphan, tree);
+  }
+
+  for (bool progress = true; progress; ) {
+    progress = false;
+    for (auto& orphan : orphans) {
+      auto parent = nodes.find(orphan.parent_cluster);
+      if (orphan.dentry == nullptr && parent != nodes.end()) {
+        attach(orphan, parent->second);
+        progress = true;
+      }
+    }
+  }
+
+  for (auto& orphan : orphans) {
+    if (orphan.dentry == nullptr)
+      attach(orphan, tree);
+  }
+
+  return orphans;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "fat32.hpp"
+
+using namespace std;
+
+// first clusters among count clusters of cluster_size bytes at buffer that start
+// with a "." and a ".." entry, as indexes into buffer; vector compares where available
+void find_dot_clusters(uint8_t const *buffer, uint32_t count, uint32_t cluster_size, vector<uint32_t>& found);
+
+// "sse2" or "scalar", whichever find_dot_clusters() runs with
+char const* find_dot_clusters_isa();
+
+struct OrphanDir
+{
+  enum Anchor
+  {
+    LIVE_PARENT,              // ".." names a directory reachable from the root
+    ORPHAN_PARENT,            // ".." names another orphan
+    ROOT_PARENT,              // ".." is 0
+    UNKNOWN_PARENT,           // ".." names a cluster that is no directory
+  };
+
+  uint32_t cluster;
+  uint32_t parent_cluster;    // from "..", 0 for the root
+  Anchor anchor;
+  string parent_path;         // where it belongs, for LIVE_PARENT and ROOT_PARENT
+  bool allocated;             // the FAT has the cluster in use
+
+  DirectoryEntry *dentry;     // in the recovered tree
+};
+
+//
+// Finds directories the tree no longer reaches. Every data cluster is read,
+// in parallel over ranges of the data area, and the ones that begin with a
+// "." entry pointing at themselves followed by a ".." entry are directory
+// starts. Those not reachable from the root are the orphans; the ".." entry
+// tells where each one was linked. The recovered tree holds the orphans whose
+// parent is not an orphan itself as "DIR<cluster>" entries, each with its own
+// subtree, and orphans inside them below their parents.
+//
+class OrphanScan
+{
+  public:
+    OrphanScan(FAT32& fat32, unsigned thread_cnt = 0);
+    OrphanScan(OrphanScan const&) = delete;
+    ~OrphanScan();
+
+  public:
+    vector<OrphanDir>& run();
+
+    vector<OrphanDir>& get_orphans() { return orphans; }
+    DirectoryEntry* get_tree() { return tree; }
+
+    uint64_t get_scanned_cnt() { return scanned_cnt; }
+    uint64_t get_dot_cluster_cnt() { return dot_cluster_cnt; }
+
+    static char const* anchor_name(OrphanDir::Anchor anchor);
+
+  private:
+    vector<uint32_t> scan();
+    void reachable(unordered_map<uint32_t, string>& dirs);
+
+  private:
+    FAT32& fat32;
+    unsigned thread_cnt;
+
+    vector<OrphanDir> orphans;
+    DirectoryEntry *tree = nullptr;
+
+    uint64_t scanned_cnt = 0;
+    uint64_t dot_cluster_cnt = 0;
+};
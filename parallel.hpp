@@ -0,0 +1,26 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// runs fn(first, last) on thread_cnt threads over [begin, end)
+template<typename Fn>
+void parallel_ranges(unsigned thread_cnt, uint64_t begin, uint64_t end, Fn fn)
+{
+  uint64_t total = end > begin ? end - begin : 0;
+  uint64_t step = (total + thread_cnt - 1) / max(thread_cnt, 1u);
+  vector<thread> threads;
+
+  for (unsigned t = 0; t < thread_cnt && begin + t * step < end; t++) {
+    uint64_t first = begin + t * step;
+    uint64_t last = min(end, first + step);
+    threads.emplace_back([=, &fn] { fn(first, last); });
+  }
+
+  for (auto& t : threads)
+    t.join();
+}
@@ -0,0 +1,291 @@
+#include "recovery.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+char const* Recovery::state_name(DeletedEntry::State state)
+{
+  switch (state) {
+    case DeletedEntry::RECOVERABLE: return "recoverable";
+    case DeletedEntry::PARTIAL:     return "partially overwritten";
+    case DeletedEntry::OVERWRITTEN: return "overwritten";
+    case DeletedEntry::EMPTY:       return "empty";
+    case DeletedEntry::LOST:        return "lost";
+  }
+
+  return "?";
+}
+
+// a directory cluster of a deleted directory still starts with its own "." entry
+static bool is_dir_start(uint8_t const *buffer, uint32_t cluster_no)
+{
+  if (memcmp(buffer, ".          ", 11) != 0 || (buffer[0x0B] & 0x10) == 0)
+    return false;
+
+  sys::io::byte_buffer bb((uint8_t*)buffer, 0x20);
+  return (((uint32_t)bb.get_uint16_le(0x14) << 16) | bb.get_uint16_le(0x1A)) == cluster_no;
+}
+
+//
+// The long name when its parts are all there, otherwise the 8.3 name. Deleting
+// overwrites the first byte of every entry, so only a long name that still ends
+// in its terminator is known to be complete, and the first character of the 8.3
+// name is the one that makes the checksum of the long name parts match.
+//
+static string entry_name(uint8_t const *e, vector<array<char16_t, 13>> const& parts, uint8_t sum)
+{
+  uint8_t short_name[11];
+  memcpy(short_name, e, 11);
+
+  bool matched = lfn_checksum(short_name) == sum;
+  if (!matched && short_name[0] == 0xE5 && !parts.empty()) {
+    // the first byte goes into the checksum only once, one value matches
+    for (int c = 0x21; c < 0x7F && !matched; c++) {
+      short_name[0] = c;
+      matched = lfn_checksum(short_name) == sum;
+    }
+    if (!matched)
+      short_name[0] = 0xE5;
+  }
+
+  if (matched && !parts.empty()) {
+    u16string long_name;
+    for (auto it = parts.rbegin(); it != parts.rend(); ++it)
+      long_name.append(it->begin(), it->end());
+
+    bool complete = e[0] != 0xE5 || long_name.find(u'\0') != u16string::npos;
+    string name = decode_lfn(long_name);
+    if (complete && !name.empty())
+      return name;
+  }
+
+  if (short_name[0] == 0xE5)
+    short_name[0] = '_';
+
+  string base((char*)short_name, 8), ext((char*)short_name + 8, 3);
+  rtrim(base);
+  rtrim(ext);
+  return ext.empty() ? base : base + "." + ext;
+}
+
+vector<DeletedEntry> Recovery::scan()
+{
+  TraceSpan span("Recovery::scan");
+
+  SuperBlock *super_block = fat32.get_super_block();
+  uint32_t cluster_size = super_block->get_cluster_size();
+  uint32_t slot_cnt = cluster_size / 0x20;
+  uint32_t max_cluster = super_block->get_cluster_cnt() + 1;
+  uint32_t max_dir_clusters = 65536 * 0x20 / cluster_size + 1;   // 65536 entries at most
+  uint32_t *fat = fat32.get_fat_area()->get_copy(0);
+
+  struct Dir { string path; uint32_t start; bool deleted; };
+  vector<Dir> dirs = { { "", super_block->get_root_cluster_addr(), false } };
+  unordered_set<uint32_t> visited = { super_block->get_root_cluster_addr() };
+
+  vector<DeletedEntry> entries;
+  vector<uint8_t> buffer(cluster_size);
+
+  for (size_t d = 0; d < dirs.size(); d++) {
+    uint32_t cluster_no = dirs[d].start;
+
+    // long name parts seen since the last short entry, in slot order (last part first)
+    vector<array<char16_t, 13>> lfn;
+    uint8_t lfn_sum = 0;
+
+    for (uint32_t n = 0; n < max_dir_clusters && cluster_no >= 2 && cluster_no <= max_cluster; n++) {
+      fat32.read_cluster(cluster_no, buffer.data());
+
+      // a deleted directory's clusters are free, only its first one can be found
+      if (dirs[d].deleted && n == 0 && !is_dir_start(buffer.data(), cluster_no))
+        break;
+
+      for (uint32_t slot = 0; slot < slot_cnt; slot++) {
+        uint8_t *e = &buffer[slot * 0x20];
+        uint8_t attribute = e[0x0B];
+        bool deleted = e[0] == 0xE5;
+
+        if (attribute == 0x0F) {
+          static constexpr int char_at[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+          sys::io::byte_buffer bb(e, 0x20);
+          array<char16_t, 13> part;
+          for (int k = 0; k < 13; k++)
+            part[k] = bb.get_uint16_le(char_at[k]);
+
+          if (lfn.empty() || e[13] != lfn_sum)
+            lfn.clear();
+          lfn.push_back(part);
+          lfn_sum = e[13];
+          continue;
+        }
+
+        vector<array<char16_t, 13>> name_parts;
+        name_parts.swap(lfn);
+
+        // unused, "." and "..", and the volume label
+        if (e[0] == 0x00 || e[0] == '.' || (attribute & 0x08))
+          continue;
+
+        DirectoryEntry dentry(e, 0x20);
+        // paths end up under the output directory of recover(), no ".." or '/' in a component
+        string name = safe_name(entry_name(e, name_parts, lfn_sum));
+
+        // live entries only count inside deleted directories, live directories are searched
+        if (!deleted && !dirs[d].deleted) {
+          uint32_t start = dentry.get_start_cluster_no();
+          if ((attribute & 0x10) && start != 0 && visited.insert(start).second)
+            dirs.push_back({ dirs[d].path + "/" + name, start, false });
+          continue;
+        }
+
+        DeletedEntry entry;
+        entry.path = dirs[d].path + "/" + name;
+        entry.entry_cluster = cluster_no;
+        entry.entry_slot = slot;
+        entry.start_cluster = dentry.get_start_cluster_no();
+        entry.is_dir = attribute & 0x10;
+        entry.file_size = entry.is_dir ? 0 : dentry.get_file_size();
+        entry.in_deleted_dir = dirs[d].deleted;
+        estimate(entry);
+
+        if (entry.is_dir && entry.state == DeletedEntry::RECOVERABLE && visited.insert(entry.start_cluster).second)
+          dirs.push_back({ entry.path, entry.start_cluster, true });
+
+        entries.push_back(std::move(entry));
+      }
+
+      if (dirs[d].deleted)
+        break;
+
+      cluster_no = fat[cluster_no] & 0x0FFFFFFF;
+    }
+  }
+
+  return entries;
+}
+
+void Recovery::estimate(DeletedEntry& entry)
+{
+  uint32_t cluster_size = fat32.get_super_block()->get_cluster_size();
+  uint32_t max_cluster = fat32.get_super_block()->get_cluster_cnt() + 1;
+  uint32_t *fat = fat32.get_fat_area()->get_copy(0);
+
+  entry.cluster_cnt = entry.is_dir ? 1 : ((uint64_t)entry.file_size + cluster_size - 1) / cluster_size;
+  entry.free_cnt = 0;
+  entry.extents.clear();
+
+  if (entry.start_cluster == 0) {
+    entry.state = entry.cluster_cnt == 0 ? DeletedEntry::EMPTY : DeletedEntry::LOST;
+    return;
+  }
+
+  if (entry.start_cluster < 2 || (uint64_t)entry.start_cluster + entry.cluster_cnt - 1 > max_cluster) {
+    entry.state = DeletedEntry::LOST;
+    return;
+  }
+
+  if (entry.cluster_cnt == 0) {
+    entry.state = DeletedEntry::EMPTY;
+    return;
+  }
+
+  for (uint32_t c = entry.start_cluster; c < entry.start_cluster + entry.cluster_cnt; c++)
+    entry.free_cnt += (fat[c] & 0x0FFFFFFF) == 0;
+
+  entry.extents.push_back({ 0, entry.start_cluster, entry.cluster_cnt });
+
+  if (entry.free_cnt == entry.cluster_cnt)
+    entry.state = DeletedEntry::RECOVERABLE;
+  else if (entry.free_cnt == 0)
+    entry.state = DeletedEntry::OVERWRITTEN;
+  else
+    entry.state = DeletedEntry::PARTIAL;
+}
+
+// bytes read with one read_clusters() when recovering
+static constexpr size_t RECOVER_CHUNK = 1 << 20;
+
+// fn(data, size) for the contents along the extents, front to back, up to
+// RECOVER_CHUNK bytes at a time; file_size bytes in total
+template<typename Fn>
+void Recovery::for_each_chunk(DeletedEntry const& entry, Fn fn)
+{
+  uint32_t cluster_size = fat32.get_super_block()->get_cluster_size();
+  uint32_t batch = max<uint32_t>(1, RECOVER_CHUNK / cluster_size);
+  vector<uint8_t> buffer((size_t)batch * cluster_size);
+
+  for (auto& extent : entry.extents) {
+    for (uint32_t i = 0; i < extent.count; i += batch) {
+      uint64_t pos = (uint64_t)(extent.logical + i) * cluster_size;
+      if (pos >= entry.file_size)
+        return;
+
+      uint32_t n = min(batch, extent.count - i);
+      fat32.read_clusters(extent.cluster + i, n, buffer.data());
+      fn(buffer.data(), min<uint64_t>((uint64_t)n * cluster_size, entry.file_size - pos));
+    }
+  }
+}
+
+string Recovery::read(DeletedEntry const& entry)
+{
+  string data;
+  data.reserve(entry.file_size);
+
+  for_each_chunk(entry, [&](uint8_t const *chunk, size_t size) {
+    data.append((char const*)chunk, size);
+  });
+
+  return data;
+}
+
+uint64_t Recovery::recover(vector<DeletedEntry> const& entries, string const& out_dir, DeletedEntry::State worst_state)
+{
+  TraceSpan span("Recovery::recover");
+
+  uint64_t written = 0;
+
+  for (auto& entry : entries) {
+    if (entry.is_dir || entry.state > worst_state || entry.state == DeletedEntry::LOST)
+      continue;
+
+    string path = out_dir + entry.path;
+    create_dirs(path.substr(0, path.rfind('/')));
+
+    // a name may have been deleted more than once
+    struct stat st;
+    string target = path;
+    for (int n = 1; stat(target.c_str(), &st) == 0; n++)
+      target = path + "~" + to_string(n);
+
+    int out = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+      throw runtime_error("error creating " + target + ": " + strerror(errno));
+
+    for_each_chunk(entry, [&](uint8_t const *chunk, size_t size) {
+      for (size_t pos = 0; pos < size; ) {
+        ssize_t n = write(out, chunk + pos, size - pos);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n < 0) {
+          close(out);
+          throw runtime_error("error writing " + target + ": " + strerror(errno));
+        }
+        pos += n;
+      }
+    });
+
+    close(out);
+    written++;
+  }
+
+  return written;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fat32.hpp"
+
+using namespace std;
+
+struct DeletedEntry
+{
+  enum State
+  {
+    RECOVERABLE,              // every cluster it would have used is still free
+    PARTIAL,                  // some of them have been allocated again
+    OVERWRITTEN,              // all of them have
+    EMPTY,                    // no data, only the entry is left
+    LOST,                     // start cluster or size point outside the data area
+  };
+
+  string path;                // long name if its entries survived, else '_' for the lost first character
+  uint32_t entry_cluster;     // where the 32 byte entry is
+  uint32_t entry_slot;
+  uint32_t start_cluster;
+  uint32_t file_size;
+  bool is_dir;
+  bool in_deleted_dir;        // found inside a deleted directory, the entry itself may look live
+
+  State state;
+  uint32_t cluster_cnt;       // clusters the size needs
+  uint32_t free_cnt;          // how many of them are free now
+
+  // FAT32 deletes the chain, so the file is assumed to have been contiguous
+  vector<Extent> extents;
+};
+
+//
+// Finds deleted entries by reading every directory cluster once, breadth
+// first, slot by slot up to the end of the cluster; slots behind the end
+// marker are looked at too. Deleted directories that still start with their
+// "." entry are read as well. Long names are put together from the deleted
+// long name entries right before a short entry when their checksum matches.
+//
+class Recovery
+{
+  public:
+    Recovery(FAT32& fat32) : fat32(fat32) {}
+
+  public:
+    vector<DeletedEntry> scan();
+
+    // contents along the extents, file_size bytes; clusters allocated again hold other data
+    string read(DeletedEntry const& entry);
+    // writes the files of entries in worst_state or a better one below out_dir,
+    // a chunk at a time; returns the number of files written
+    uint64_t recover(vector<DeletedEntry> const& entries, string const& out_dir, DeletedEntry::State worst_state = DeletedEntry::RECOVERABLE);
+
+    static char const* state_name(DeletedEntry::State state);
+
+  private:
+    void estimate(DeletedEntry& entry);
+    template<typename Fn>
+    void for_each_chunk(DeletedEntry const& entry, Fn fn);
+
+  private:
+    FAT32& fat32;
+};
@@ -0,0 +1,251 @@
+#include "tar_export.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "file_reader.hpp"
+
+
+static constexpr size_t BLOCK = 512;
+static constexpr size_t OUT_BYTES = 1 << 20;
+
+struct TarHeader
+{
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+};
+
+static_assert(sizeof(TarHeader) == BLOCK);
+
+// zero padded octal filling width - 1 digits and a NUL
+static void put_octal(char *field, size_t width, uint64_t value)
+{
+  snprintf(field, width, "%0*llo", (int)width - 1, (unsigned long long)value);
+}
+
+// where path splits into a ustar prefix and name, string::npos if it does not
+static size_t ustar_split(string const& path)
+{
+  for (size_t pos = path.find('/'); pos != string::npos; pos = path.find('/', pos + 1)) {
+    if (pos > 155)
+      break;
+    if (path.size() - pos - 1 <= 100 && pos + 1 < path.size())
+      return pos;
+  }
+
+  return string::npos;
+}
+
+// "<len> path=<path>\n", len counting itself
+static string pax_record(string const& key, string const& value)
+{
+  string body = " " + key + "=" + value + "\n";
+  size_t len = body.size() + 1;
+  while (to_string(len).size() + body.size() != len)
+    len = to_string(len).size() + body.size();
+
+  return to_string(len) + body;
+}
+
+TarExport::TarExport(FAT32& fat32, int fd, ExtractSink *sink)
+  : fat32(fat32), fd(fd), sink(sink), out(OUT_BYTES)
+{
+}
+
+TarReport TarExport::write(DirectoryEntry *dentry)
+{
+  TraceSpan span("TarExport::write");
+
+  report = TarReport();
+  dirs.clear();
+  files.clear();
+
+  collect(dentry, dentry == fat32.get_root_dir() ? "" : safe_name(dentry->get_name()));
+
+  // physical order for the contents, tree order among empty files
+  stable_sort(files.begin(), files.end(), [](auto const& a, auto const& b) {
+    return a.second->get_start_cluster_no() < b.second->get_start_cluster_no();
+  });
+
+  for (auto& [path, dir] : dirs)
+    put_header(path + "/", dir, '5', 0);
+
+  for (auto& [path, file] : files) {
+    put_header(path, file, '0', file->get_file_size());
+    put_body(file);
+  }
+
+  // end of archive, two zero blocks
+  char zeros[2 * BLOCK] = {};
+  put(zeros, sizeof(zeros));
+  flush();
+
+  report.dir_cnt = dirs.size();
+  report.file_cnt = files.size();
+
+  return report;
+}
+
+void TarExport::collect(DirectoryEntry *dentry, string const& path)
+{
+  if (!dentry->is_dir()) {
+    files.push_back({ path, dentry });
+    return;
+  }
+
+  if (!path.empty())
+    dirs.push_back({ path, dentry });
+
+  for (auto child : dentry->get_children())
+    collect(child, path.empty() ? safe_name(child->get_name()) : path + "/" + safe_name(child->get_name()));
+}
+
+void TarExport::put_header(string const& path, DirectoryEntry *dentry, char type, uint64_t size)
+{
+  time_t mtime = from_fat_time(dentry->get_write_date(), dentry->get_write_time());
+
+  TarHeader header;
+  memset(&header, 0, sizeof(header));
+
+  auto finish = [&] {
+    put_octal(header.uid, sizeof(header.uid), 0);
+    put_octal(header.gid, sizeof(header.gid), 0);
+    put_octal(header.mtime, sizeof(header.mtime), max<time_t>(mtime, 0));
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+
+    memset(header.chksum, ' ', sizeof(header.chksum));
+    unsigned sum = 0;
+    for (size_t i = 0; i < BLOCK; i++)
+      sum += ((uint8_t*)&header)[i];
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", sum);
+    header.chksum[7] = ' ';
+
+    put(&header, sizeof(header));
+  };
+
+  size_t split = path.size() <= 100 ? string::npos : ustar_split(path);
+
+  if (path.size() > 100 && split == string::npos) {
+    // the whole path in a pax header, a truncated one in the ustar header after it
+    string record = pax_record("path", path);
+    snprintf(header.name, sizeof(header.name), "PaxHeader/%.80s", path.substr(path.rfind('/', path.size() - 2) + 1).c_str());
+    put_octal(header.mode, sizeof(header.mode), 0644);
+    put_octal(header.size, sizeof(header.size), record.size());
+    header.typeflag = 'x';
+    finish();
+
+    put(record.data(), record.size());
+    pad();
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.name, path.data(), 100);
+  } else if (split != string::npos) {
+    memcpy(header.prefix, path.data(), split);
+    memcpy(header.name, path.data() + split + 1, path.size() - split - 1);
+  } else {
+    memcpy(header.name, path.data(), path.size());
+  }
+
+  put_octal(header.mode, sizeof(header.mode), type == '5' ? 0755 : 0644);
+  put_octal(header.size, sizeof(header.size), size);
+  header.typeflag = type;
+  finish();
+}
+
+// the contents read straight into the output buffer; a chain shorter than
+// the size is made up with zeros, the header has promised size bytes
+void TarExport::put_body(DirectoryEntry *dentry)
+{
+  FileReader reader(fat32, dentry);
+  uint64_t size = dentry->get_file_size();
+
+  if (sink != nullptr)
+    sink->begin_file(dentry);
+
+  for (uint64_t offset = 0; offset < size; ) {
+    if (used == out.size())
+      flush();
+
+    size_t want = min<uint64_t>(size - offset, out.size() - used);
+    size_t n = reader.read(offset, want, &out[used]);
+    if (n == 0) {
+      memset(&out[used], 0, want);
+      n = want;
+    }
+
+    if (sink != nullptr)
+      sink->file_data(&out[used], n);
+
+    used += n;
+    offset += n;
+  }
+
+  if (sink != nullptr)
+    sink->end_file();
+
+  report.data_bytes += size;
+  report.archive_bytes += size;
+  pad();
+}
+
+void TarExport::put(void const *data, size_t size)
+{
+  char const *p = (char const*)data;
+  report.archive_bytes += size;
+
+  while (size > 0) {
+    if (used == out.size())
+      flush();
+
+    size_t n = min(size, out.size() - used);
+    memcpy(&out[used], p, n);
+    used += n;
+    p += n;
+    size -= n;
+  }
+}
+
+// zeros up to the next block boundary
+void TarExport::pad()
+{
+  static char const zeros[BLOCK] = {};
+
+  if (report.archive_bytes % BLOCK != 0)
+    put(zeros, BLOCK - report.archive_bytes % BLOCK);
+}
+
+void TarExport::flush()
+{
+  size_t pos = 0;
+
+  while (pos < used) {
+    ssize_t n = ::write(fd, out.data() + pos, used - pos);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw runtime_error(string("error writing archive: ") + strerror(errno));
+    pos += n;
+  }
+
+  used = 0;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fat32.hpp"
+
+using namespace std;
+
+struct TarReport
+{
+  uint64_t dir_cnt = 0;
+  uint64_t file_cnt = 0;
+  uint64_t data_bytes = 0;      // file contents
+  uint64_t archive_bytes = 0;   // everything written, headers and padding included
+};
+
+//
+// Writes a tree as a POSIX tar (ustar) stream to a file descriptor, a pipe
+// or stdout as well as a file; nothing is created on the local filesystem.
+// The directories come first, in tree order, then the files sorted by start
+// cluster, so their contents are read front to back across the image (the
+// reads go through a FileReader, which prefetches ahead). Paths are relative
+// to the parent of the exported entry, each name passed through safe_name();
+// one that does not fit the 100 + 155 bytes of a ustar header gets a pax
+// extended header. Modification times come from the directory entries. A
+// sink, if given, sees every file's contents as they go into the archive.
+//
+class TarExport
+{
+  public:
+    TarExport(FAT32& fat32, int fd, ExtractSink *sink = nullptr);
+
+  public:
+    TarReport write(DirectoryEntry *dentry);
+
+  private:
+    void collect(DirectoryEntry *dentry, string const& path);
+    void put_header(string const& path, DirectoryEntry *dentry, char type, uint64_t size);
+    void put_body(DirectoryEntry *dentry);
+
+    void put(void const *data, size_t size);
+    void pad();
+    void flush();
+
+  private:
+    FAT32& fat32;
+    int fd;
+    ExtractSink *sink;
+
+    vector<pair<string, DirectoryEntry*>> dirs;
+    vector<pair<string, DirectoryEntry*>> files;
+
+    vector<char> out;             // written when full
+    size_t used = 0;
+
+    TarReport report;
+};
@@ -0,0 +1,148 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+
+Tracer& Tracer::instance()
+{
+  // never destroyed, spans may end during static destruction
+  static Tracer *tracer = new Tracer();
+
+  return *tracer;
+}
+
+void Tracer::enable(size_t events_per_thread)
+{
+  lock_guard<mutex> guard(buffers_lock);
+
+  if (!enabled.load(memory_order_relaxed)) {
+    capacity = max<size_t>(events_per_thread, 1);
+    epoch = chrono::steady_clock::now();
+
+    for (auto& buffer : buffers) {
+      lock_guard<mutex> buffer_guard(buffer->lock);
+      buffer->events.clear();
+      buffer->next = 0;
+    }
+  }
+
+  enabled.store(true, memory_order_relaxed);
+}
+
+Tracer::ThreadBuffer* Tracer::thread_buffer()
+{
+  thread_local ThreadBuffer *buffer = nullptr;
+
+  if (buffer == nullptr) {
+    auto owned = make_shared<ThreadBuffer>();
+    owned->tid = (uint32_t)syscall(SYS_gettid);
+    owned->name = "thread " + to_string(owned->tid);
+
+    lock_guard<mutex> guard(buffers_lock);
+    buffers.push_back(owned);
+    buffer = owned.get();
+  }
+
+  return buffer;
+}
+
+void Tracer::set_thread_name(string const& name)
+{
+  ThreadBuffer *buffer = thread_buffer();
+  lock_guard<mutex> guard(buffer->lock);
+
+  buffer->name = name;
+}
+
+void Tracer::record(char const *name, char const *arg_name, uint64_t arg, chrono::steady_clock::time_point start)
+{
+  auto end = chrono::steady_clock::now();
+  ThreadBuffer *buffer = thread_buffer();
+
+  TraceEvent event;
+  event.name = name;
+  event.arg_name = arg_name;
+  event.arg = arg;
+  event.start_ns = start > epoch ? chrono::duration_cast<chrono::nanoseconds>(start - epoch).count() : 0;
+  event.dur_ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+
+  // only the owning thread writes, the lock is uncontended unless a dump runs
+  lock_guard<mutex> guard(buffer->lock);
+
+  if (buffer->events.size() < capacity)
+    buffer->events.push_back(event);
+  else
+    buffer->events[buffer->next % capacity] = event;
+
+  buffer->next++;
+}
+
+static void append_escaped(string& out, char const *s)
+{
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\')
+      out += '\\';
+    if ((unsigned char)*s < 0x20)
+      continue;
+    out += *s;
+  }
+}
+
+void Tracer::write_chrome_trace(string const& path)
+{
+  string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+  bool first = true;
+  int pid = getpid();
+  char buf[160];
+
+  lock_guard<mutex> guard(buffers_lock);
+
+  for (auto& buffer : buffers) {
+    lock_guard<mutex> buffer_guard(buffer->lock);
+
+    out += first ? "" : ",\n";
+    first = false;
+    out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + to_string(pid) + ",\"tid\":" + to_string(buffer->tid)
+        + ",\"args\":{\"name\":\"";
+    append_escaped(out, buffer->name.c_str());
+    out += "\"}}";
+
+    // oldest first
+    size_t cnt = buffer->events.size();
+    size_t begin = buffer->next > cnt ? buffer->next % cnt : 0;
+
+    for (size_t i = 0; i < cnt; i++) {
+      TraceEvent const& e = buffer->events[(begin + i) % cnt];
+
+      out += ",\n{\"name\":\"";
+      append_escaped(out, e.name);
+      snprintf(buf, sizeof(buf), "\",\"cat\":\"fat32\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u",
+          e.start_ns / 1e3, e.dur_ns / 1e3, pid, buffer->tid);
+      out += buf;
+
+      if (e.arg_name != nullptr) {
+        out += ",\"args\":{\"";
+        append_escaped(out, e.arg_name);
+        out += "\":" + to_string(e.arg) + "}";
+      }
+
+      out += "}";
+    }
+  }
+
+  out += "\n]}\n";
+
+  FILE *fp = fopen(path.c_str(), "w");
+  if (fp == nullptr)
+    throw runtime_error("error creating " + path + ": " + strerror(errno));
+
+  bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+  ok = fclose(fp) == 0 && ok;
+  if (!ok)
+    throw runtime_error("error writing " + path);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct TraceEvent
+{
+  char const *name;                  // string literals only, they are not copied
+  char const *arg_name;              // nullptr: no argument
+  uint64_t arg;
+  uint64_t start_ns;                 // since Tracer::enable()
+  uint64_t dur_ns;
+};
+
+//
+// Collects TraceSpans of all threads. Every thread records into a ring
+// buffer of its own, the oldest events are overwritten when it is full.
+// While disabled a span costs one relaxed load.
+//
+class Tracer
+{
+  public:
+    static Tracer& instance();
+
+    void enable(size_t events_per_thread = 1 << 16);
+    void disable() { enabled.store(false, memory_order_relaxed); }
+    bool is_enabled() { return enabled.load(memory_order_relaxed); }
+
+    // name shown for the calling thread's timeline
+    void set_thread_name(string const& name);
+
+    // Chrome trace-event JSON, loads in chrome://tracing and Perfetto
+    void write_chrome_trace(string const& path);
+
+    void record(char const *name, char const *arg_name, uint64_t arg, chrono::steady_clock::time_point start);
+    chrono::steady_clock::time_point get_epoch() { return epoch; }
+
+  private:
+    struct ThreadBuffer
+    {
+      mutex lock;
+      vector<TraceEvent> events;
+      size_t next = 0;               // total events recorded, next % size is the slot to write
+      uint32_t tid;
+      string name;
+    };
+
+    Tracer() {}
+    ThreadBuffer* thread_buffer();
+
+  private:
+    atomic<bool> enabled{false};
+    size_t capacity = 1 << 16;
+    chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+
+    mutex buffers_lock;
+    // kept after their thread exits, so its events are still written
+    vector<shared_ptr<ThreadBuffer>> buffers;
+};
+
+// records the time from construction to destruction as a complete ("X") event
+class TraceSpan
+{
+  public:
+    TraceSpan(char const *name, char const *arg_name = nullptr, uint64_t arg = 0)
+      : name(name), arg_name(arg_name), arg(arg), active(Tracer::instance().is_enabled())
+    {
+      if (active)
+        start = chrono::steady_clock::now();
+    }
+
+    ~TraceSpan()
+    {
+      if (active)
+        Tracer::instance().record(name, arg_name, arg, start);
+    }
+
+    TraceSpan(TraceSpan const&) = delete;
+
+  private:
+    char const *name;
+    char const *arg_name;
+    uint64_t arg;
+    bool active;
+    chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,197 @@
+#include "wal.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "byte_buffer.hpp"
+
+
+static constexpr char WAL_MAGIC[] = "FAT32WAL";
+static constexpr char WAL_COMMIT[] = "COMMITED";
+static constexpr uint32_t HEADER_SIZE = 24;
+static constexpr uint32_t RECORD_HEADER_SIZE = 16;
+static constexpr uint32_t TRAILER_SIZE = 16;
+
+uint32_t crc32(uint8_t const *data, size_t size, uint32_t crc)
+{
+  static auto const table = [] {
+    array<uint32_t, 256> t;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      t[i] = c;
+    }
+    return t;
+  }();
+
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++)
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+  return ~crc;
+}
+
+static void write_all(int fd, void const *buffer, size_t size, uint64_t offset)
+{
+  char const *p = (char const*)buffer;
+
+  while (size > 0) {
+    ssize_t n = pwrite(fd, p, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw runtime_error(string("write-ahead log: write failed: ") + strerror(errno));
+
+    p += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+WriteAheadLog::WriteAheadLog(string path)
+  : path(path)
+{
+  fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    throw runtime_error("error opening write-ahead log " + path + ": " + strerror(errno));
+
+  staged.resize(HEADER_SIZE);
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+  if (fd >= 0)
+    close(fd);
+}
+
+void WriteAheadLog::add(uint64_t offset, uint8_t const *data, uint32_t size)
+{
+  size_t at = staged.size();
+  staged.resize(at + RECORD_HEADER_SIZE + size);
+
+  sys::io::byte_buffer bb(&staged[at], RECORD_HEADER_SIZE);
+  bb.put_uint64_le(offset);
+  bb.put_uint32_le(size);
+  bb.put_uint32_le(crc32(data, size));
+  memcpy(&staged[at + RECORD_HEADER_SIZE], data, size);
+
+  record_cnt++;
+}
+
+// one write and one fsync for the whole batch
+void WriteAheadLog::commit()
+{
+  if (record_cnt == 0)
+    return;
+
+  sys::io::byte_buffer header(staged.data(), HEADER_SIZE);
+  header.put_ascii(WAL_MAGIC, 8, ' ');
+  header.put_uint64_le(++seq);
+  header.put_uint32_le(record_cnt);
+  header.put_uint32_le(0);
+
+  uint32_t crc = crc32(staged.data(), staged.size());
+  size_t at = staged.size();
+  staged.resize(at + TRAILER_SIZE);
+
+  sys::io::byte_buffer trailer(&staged[at], TRAILER_SIZE);
+  trailer.put_ascii(WAL_COMMIT, 8, ' ');
+  trailer.put_uint32_le(crc);
+  trailer.put_uint32_le(at);
+
+  if (ftruncate(fd, 0) != 0)
+    throw runtime_error(string("write-ahead log: truncate failed: ") + strerror(errno));
+
+  write_all(fd, staged.data(), staged.size(), 0);
+
+  if (fsync(fd) != 0)
+    throw runtime_error(string("write-ahead log: fsync failed: ") + strerror(errno));
+}
+
+// the batch reached the image, the log may be reused
+void WriteAheadLog::checkpoint()
+{
+  if (ftruncate(fd, 0) != 0)
+    throw runtime_error(string("write-ahead log: truncate failed: ") + strerror(errno));
+
+  staged.assign(HEADER_SIZE, 0);
+  record_cnt = 0;
+}
+
+bool WriteAheadLog::load(vector<Record>& records)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < HEADER_SIZE + TRAILER_SIZE)
+    return false;
+
+  vector<uint8_t> log(st.st_size);
+  if (pread(fd, log.data(), log.size(), 0) != (ssize_t)log.size())
+    return false;
+
+  sys::io::byte_buffer bb(log.data(), (int)log.size());
+  if (bb.get_ascii(8) != WAL_MAGIC)
+    return false;
+
+  seq = bb.get_uint64_le();
+  uint32_t cnt = bb.get_uint32_le();
+  bb.skip(4);
+
+  for (uint32_t i = 0; i < cnt; i++) {
+    if (bb.remained_size() < (int)RECORD_HEADER_SIZE)
+      return false;
+
+    uint64_t offset = bb.get_uint64_le();
+    uint32_t size = bb.get_uint32_le();
+    uint32_t crc = bb.get_uint32_le();
+
+    if (bb.remained_size() < (int)size)
+      return false;
+
+    uint8_t *data = bb.get_bytes(size);
+    if (crc32(data, size) != crc)
+      return false;
+
+    records.push_back({offset, vector<uint8_t>(data, data + size)});
+  }
+
+  uint32_t batch_len = bb.offset();
+  if (bb.remained_size() < (int)TRAILER_SIZE || bb.get_ascii(8) != WAL_COMMIT)
+    return false;
+
+  return bb.get_uint32_le() == crc32(log.data(), batch_len) && bb.get_uint32_le() == batch_len;
+}
+
+bool WriteAheadLog::has_pending()
+{
+  vector<Record> records;
+  return load(records);
+}
+
+bool WriteAheadLog::replay(int image_fd)
+{
+  vector<Record> records;
+
+  if (!load(records)) {
+    // torn batch: never applied to the image, nothing to undo
+    checkpoint();
+    return false;
+  }
+
+  sort(records.begin(), records.end(),
+      [](Record const& a, Record const& b) { return a.offset < b.offset; });
+
+  for (auto& r : records)
+    write_all(image_fd, r.data.data(), r.data.size(), r.offset);
+
+  if (fsync(image_fd) != 0)
+    throw runtime_error(string("write-ahead log: fsync of image failed: ") + strerror(errno));
+
+  checkpoint();
+  return true;
+}
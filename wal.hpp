@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//
+// Sidecar write-ahead log for metadata (FAT sectors, directory clusters,
+// FSInfo). A batch is appended as
+//
+//   header  : "FAT32WAL" | seq u64 | record count u32 | reserved u32
+//   record  : image offset u64 | size u32 | crc32(data) u32 | data
+//   trailer : "COMMITED" | crc32(header + records) u32 | batch length u32
+//
+// and made durable with a single fsync. Only then are the records applied to
+// the image; a batch without a valid trailer was never applied and is dropped.
+//
+class WriteAheadLog
+{
+  public:
+    struct Record
+    {
+      uint64_t offset;
+      vector<uint8_t> data;
+    };
+
+  public:
+    WriteAheadLog(string path);
+    WriteAheadLog(WriteAheadLog const&) = delete;
+    ~WriteAheadLog();
+
+  public:
+    void add(uint64_t offset, uint8_t const *data, uint32_t size);
+    void commit();
+    void checkpoint();
+
+    // applies a committed batch left by a crash to image_fd, returns whether there was one
+    bool replay(int image_fd);
+    bool has_pending();
+
+    string get_path() { return path; }
+    uint32_t get_record_cnt() { return record_cnt; }
+
+  private:
+    bool load(vector<Record>& records);
+
+  private:
+    string path;
+    int fd = -1;
+    uint64_t seq = 0;
+    uint32_t record_cnt = 0;
+    vector<uint8_t> staged;
+};
+
+uint32_t crc32(uint8_t const *data, size_t size, uint32_t crc = 0);